@@ -479,6 +479,7 @@ JNIEXPORT jlong JNICALL Java_com_eclipsesource_v8_V8__1createIsolate
           env->GetStringUTFChars(nativejsSnapshotSoName, NULL);
       create_params.snapshot_blob = const_cast<v8::StartupData *>
           (hybrid::GetCustomJsSnapshot(nativejs_snapshot_so_name));
+      create_params.external_references = hybrid::GetExternalReferences();
       env->ReleaseStringUTFChars(nativejsSnapshotSoName, nativejs_snapshot_so_name);
   }
   runtime->isolate = v8::Isolate::New(create_params);
@@ -63,6 +63,12 @@ void ThrowExecutionException(J2V8Runtime* runtime, v8::TryCatch* trycatch) {
 const v8::StartupData* GetCustomJsSnapshot(
     const char* nativejs_snapshot_so_name);
 
+// the native callbacks and the member tables of the snapshot classes
+// (JSEnv::RegisterSnapshotClass) which may be referenced by a custom
+// snapshot, 0 terminated, for v8::Isolate::CreateParams::external_references
+// and v8::SnapshotCreator
+const intptr_t* GetExternalReferences();
+
 bool OnCreateIsolate(J2V8Runtime* runtime);
 
 void OnDestroyIsolate(J2V8Runtime* runtime);
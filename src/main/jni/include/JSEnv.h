@@ -12,9 +12,11 @@
 #include <cstring>
 #include <cwchar>
 
-#define JSENV_VERSION 1100
+#define JSENV_VERSION 1200
 
 #define JSENV_ENTRY "get_jsenv"
+#define JSENV_SNAPSHOT_CLASS_ENTRY "register_jsenv_snapshot_class"
+#define JSENV_SNAPSHOT_ENTRY "create_jsenv_snapshot"
 
 #define JSENV_SO_NAME "JSENV_SO_NAME"
 #define JSENV_DEFAULT_SO_NAME "libjsenv.so"
@@ -32,6 +34,14 @@ typedef JSEnv* (*get_jsenv_cb)(J2V8Handle, int);
 typedef struct JSObject_* JSObject;
 typedef struct JSClass_* JSClass;
 typedef struct J2V8ObjectHandle_* J2V8ObjectHandle;
+typedef struct JSExternalString_* JSExternalString;
+typedef struct JSPropertyKey_* JSPropertyKey;
+typedef struct JSObjectShape_* JSObjectShape;
+typedef struct JSSerializedData_* JSSerializedData;
+typedef struct JSArgs_* JSArgs;
+typedef struct JSAsyncToken_* JSAsyncToken;
+typedef struct JSPreparedCall_* JSPreparedCall;
+typedef struct JSEventChannel_* JSEventChannel;
 
 template <typename TCHAR>
 static TCHAR* tstrndup(const TCHAR* str, int len) {
@@ -61,6 +71,11 @@ struct JSValue {
     kJSDataView,
     kJSPromise,
     kJSResolver,
+    kExternalString,  // JSExternalString, see JSEnv::NewExternalString
+    kInt64,           // a Number, exact in the safe integer range
+    kUint64,          // a Number, exact in the safe integer range
+    kBigInt64,        // a BigInt
+    kBigUint64,       // a BigInt
     kUint = kUInt,  // renmae kUInt as kUint
   };
 
@@ -89,8 +104,14 @@ struct JSValue {
   bool IsUint() const { return type == kUInt; }
   bool IsInteger() const { return IsInt() || IsUint(); }
   bool IsFloat() const { return type == kFloat; }
-  bool IsNumber() const { return IsFloat() || IsInteger(); }
+  bool IsNumber() const {
+    return IsFloat() || IsInteger() || IsInt64() || IsUint64();
+  }
   bool IsBoolean() const { return type == kBoolean; }
+  bool IsExternalString() const { return type == kExternalString; }
+  bool IsInt64() const { return type == kInt64; }
+  bool IsUint64() const { return type == kUint64; }
+  bool IsBigInt() const { return type == kBigInt64 || type == kBigUint64; }
   bool IsObject() const {
     return type == kJSObject || type == kJSFunction || type == kJSArray ||
            type == kJSTypedArray || type == kJSArrayBuffer ||
@@ -100,9 +121,12 @@ struct JSValue {
   int IntVal() const { return data.ival; }
   uint32_t UintVal() const { return data.uval; }
   double FloatVal() const { return data.fval; }
+  int64_t Int64Val() const { return data.i64; }
+  uint64_t Uint64Val() const { return data.u64; }
   const jschar_t* UTF16Str() const { return data.utf16_str; }
   const char* UTF8Str() const { return data.utf8_str; }
   JSObject Object() const { return data.object; }
+  JSExternalString ExternalString() const { return data.external_str; }
   bool Boolean() const { return data.bval; }
 
   JSValue() : type(kNull), need_free(0) {}
@@ -153,6 +177,32 @@ struct JSValue {
     need_free = false;
   }
 
+  void Set(int64_t i64) {
+    AutoFree();
+    data.i64 = i64;
+    type = kInt64;
+    length = sizeof(int64_t);
+    need_free = false;
+  }
+
+  void Set(uint64_t u64) {
+    AutoFree();
+    data.u64 = u64;
+    type = kUint64;
+    length = sizeof(uint64_t);
+    need_free = false;
+  }
+
+  void SetBigInt(int64_t i64) {
+    Set(i64);
+    type = kBigInt64;
+  }
+
+  void SetBigUint(uint64_t u64) {
+    Set(u64);
+    type = kBigUint64;
+  }
+
   void Set(double dval) {
     AutoFree();
     data.fval = dval;
@@ -201,6 +251,41 @@ struct JSValue {
     need_free = false;
   }
 
+  // the JSValue doesn't own a reference, |str| must live until the value
+  // is converted
+  void Set(JSExternalString str) {
+    AutoFree();
+    data.external_str = str;
+    type = kExternalString;
+    length = sizeof(JSExternalString);
+    need_free = false;
+  }
+
+  // copy the value, the string buffer is duplicated, so the copy is still
+  // valid after the arguments of a native callback are released
+  void CopyFrom(const JSValue& value) {
+    if (&value == this) {
+      return;
+    }
+    switch (value.type) {
+      case kUTF8String:
+        Set(value.UTF8Str(), static_cast<int>(value.Length()),
+            value.UTF8Str() != nullptr);
+        break;
+      case kUTF16String:
+        Set(value.UTF16Str(), static_cast<int>(value.Length()),
+            value.UTF16Str() != nullptr);
+        break;
+      default:
+        AutoFree();
+        type = value.type;
+        length = value.length;
+        data = value.data;
+        need_free = false;
+        break;
+    }
+  }
+
   ~JSValue() { AutoFree(); }
 
   int type : 24;
@@ -211,9 +296,12 @@ struct JSValue {
     int ival;
     uint32_t uval;
     double fval;
+    int64_t i64;
+    uint64_t u64;
     const jschar_t* utf16_str;  // utf16 string
     const char* utf8_str;       // utf16 string
     JSObject object;
+    JSExternalString external_str;
   } data;
 
  private:
@@ -233,6 +321,16 @@ enum {
   kJSPromiseStateRejected
 };
 
+// JSEnv::SetMicrotaskPolicy, the values of v8::MicrotasksPolicy
+enum {
+  // the microtasks run by JSEnv::PerformMicrotaskCheckpoint only
+  kJSMicrotaskPolicyExplicit,
+  // the microtasks run when the outermost ExecuteScript/CallFunction returns
+  kJSMicrotaskPolicyScoped,
+  // the microtasks run when the JS call depth gets to 0 (the default)
+  kJSMicrotaskPolicyAuto
+};
+
 struct JSException {
   enum { kNoneException, kJSException, kNativeException };
 
@@ -246,6 +344,68 @@ struct JSException {
   const char* message;
 };
 
+// commands of JSEnv::DispatchJSEnvCommand
+enum {
+  // data: JSArenaStats*, return data
+  kJSEnvCommandGetArenaStats = 1,
+  // data: ignored, reset the high water mark and the counters
+  kJSEnvCommandResetArenaStats,
+  // The callback profile needs a build with JSENV_ENABLE_CALLBACK_PROFILING,
+  // otherwise these commands return nullptr.
+  // data: JSCallbackProfileReport*, return data
+  kJSEnvCommandGetCallbackProfile,
+  // data: JSCallbackProfileJSON*, return data
+  kJSEnvCommandGetCallbackProfileJSON,
+  // data: ignored, reset the counters
+  kJSEnvCommandResetCallbackProfile,
+};
+
+// usage of the arena the native callbacks convert their arguments in
+struct JSArenaStats {
+  size_t capacity;          // bytes reserved by the arena
+  size_t used;              // bytes in use now
+  size_t high_water_mark;   // max bytes in use since the last reset
+  size_t block_count;       // blocks reserved by the arena
+  uint64_t allocation_count;       // allocations served since the last reset
+  uint64_t heap_allocation_count;  // blocks malloc'ed since the last reset
+};
+
+// counters of one native callback, keyed by the registered domain
+// ("owner.name"), "Class.member" (getters and setters are "Class.member:get"
+// and "Class.member:set", the interceptors "Class[name]" and "Class[index]")
+// or "function@<callback address>" for NewFunction
+struct JSCallbackProfileEntry {
+  const char* name;      // valid until the JSEnv is released
+  uint64_t call_count;
+  uint64_t total_ns;     // wall time of the calls
+  uint64_t max_ns;       // wall time of the longest call
+  uint64_t marshal_ns;   // converting the arguments and the result
+  uint64_t callback_ns;  // inside the native callback
+};
+
+// the called callbacks, the hottest (by total_ns) first
+struct JSCallbackProfileReport {
+  JSCallbackProfileEntry* entries;  // filled up to capacity
+  int capacity;
+  int count;  // entries in the profile, it may be larger than capacity
+};
+
+struct JSCallbackProfileJSON {
+  char* buffer;   // '\0' terminated, truncated to size - 1
+  size_t size;
+  size_t length;  // length of the whole report
+};
+
+// the queued finalizers (kFlagDeferredFinalize, kFlagBackgroundFinalize)
+struct JSFinalizeStats {
+  size_t pending;               // queued now
+  size_t max_pending;           // the deepest queue since the last reset
+  uint64_t finalize_count;      // finalizers run since the last reset
+  uint64_t total_latency_ns;    // from the GC to the end of the finalizer
+  uint64_t max_latency_ns;
+  uint64_t total_finalize_ns;   // inside the finalizers
+};
+
 typedef bool (*UserFunctionCallback)(JSEnv*,
                                      void* user_data,
                                      J2V8ObjectHandle handle,
@@ -257,6 +417,15 @@ typedef void (*JSWeakReferenceCallback)(const void* weak_data);
 
 using JSArrayBufferReleaseExteranlCallback = JSWeakReferenceCallback;
 
+// encoding of the buffer of a JSExternalString
+enum {
+  kJSExternalStringLatin1,  // one byte per character
+  kJSExternalStringUTF16,   // uint16_t code units
+};
+
+typedef void (*JSExternalStringReleaseCallback)(void* user_data,
+                                                const void* data);
+
 ///////////////////////////////////////
 // define the class
 
@@ -267,6 +436,60 @@ typedef bool (*JSFunctionCallback)(JSEnv* env,
                                    int argc,
                                    JSValue* presult);
 
+// the arguments are got by JSEnv::GetArg on demand, |args| is valid until
+// the callback returns
+typedef bool (*JSLazyFunctionCallback)(JSEnv* env,
+                                       void* user_data,
+                                       JSObject self,
+                                       JSArgs args,
+                                       JSValue* presult);
+
+// the callback of NewAsyncFunction: the call returns a Promise, it's settled
+// by JSEnv::CompleteAsync on |token|, from any thread. The arguments are
+// valid until the callback returns.
+typedef void (*JSAsyncFunctionCallback)(JSEnv* env,
+                                        void* user_data,
+                                        JSObject self,
+                                        const JSValue* argv,
+                                        int argc,
+                                        JSAsyncToken token);
+
+// called on the completing thread when the first completion is queued, the
+// embedder should call JSEnv::RunAsyncCompletions on the JS thread
+typedef void (*JSAsyncNotifyCallback)(JSEnv* env, void* user_data);
+
+// a task of JSEnv::PostTask, |env| is null if the JSEnv is detached before
+// the task runs: only free |user_data| then
+typedef void (*JSTaskCallback)(JSEnv* env, void* user_data);
+
+// one call of a batched domain function. The arguments are read without
+// V8 when they are all numbers, booleans, null or undefined (kNull), 64 bit
+// BigInts or strings (kUTF8String, '\0' terminated): they're in |argv|. A
+// call with any other argument falls back to the structured clone (see
+// JSEnv::SerializeValue) of the Array of its arguments: |argv| is null and
+// NewSerializedData copies |data| to be read by DeserializeValue.
+struct JSBatchedCall {
+  const JSValue* argv;
+  int argc;
+  const void* data;
+  size_t size;
+};
+
+// the callback of RegisterBatchedCallback: the calls queued since the last
+// delivery, in call order. They're consecutive in one buffer which is valid
+// until the callback returns.
+typedef void (*JSBatchedCallsCallback)(JSEnv* env,
+                                       void* user_data,
+                                       const JSBatchedCall* calls,
+                                       int count);
+
+enum {
+  kJSTaskPriorityHigh,
+  kJSTaskPriorityNormal,
+  kJSTaskPriorityLow,
+  kJSTaskPriorityCount
+};
+
 typedef bool (*JSPropertyGetCallback)(JSEnv* env,
                                       void* user_data,
                                       JSObject self,
@@ -279,9 +502,121 @@ typedef bool (*JSPropertySetCallback)(JSEnv* env,
 
 typedef void (*JSFinalizeCallback)(void* private_data, void* extra_data);
 
+///////////////////////////////////////
+// typed function
+// A native function of plain scalar types, the arguments are converted by
+// their declared types and no JSValue is made. See JSEnv::NewTypedFunction.
+
+enum {
+  kJSTypeVoid,  // return type only
+  kJSTypeInt32,
+  kJSTypeUint32,
+  kJSTypeDouble,
+  kJSTypeBoolean,
+  kJSTypeInt64,
+};
+
+union JSTypedValue {
+  int32_t i32;
+  uint32_t u32;
+  double f64;
+  bool b;
+  int64_t i64;
+};
+
+// call |function| with the converted arguments, generated by
+// JSEnv::NewTypedFunction
+typedef void (*JSTypedFunctionThunk)(void* function,
+                                     const JSTypedValue* argv,
+                                     JSTypedValue* presult);
+
+template <typename T>
+struct JSTypedValueTraits;
+
+#define JSTYPED_VALUE_TRAITS(T, TYPE, FIELD)                   \
+  template <>                                                  \
+  struct JSTypedValueTraits<T> {                               \
+    enum { kType = TYPE };                                     \
+    static T Get(const JSTypedValue& value) {                  \
+      return static_cast<T>(value.FIELD);                      \
+    }                                                          \
+    static void Set(JSTypedValue* pvalue, T val) {             \
+      pvalue->FIELD = val;                                     \
+    }                                                          \
+  };
+
+JSTYPED_VALUE_TRAITS(int32_t, kJSTypeInt32, i32)
+JSTYPED_VALUE_TRAITS(uint32_t, kJSTypeUint32, u32)
+JSTYPED_VALUE_TRAITS(double, kJSTypeDouble, f64)
+JSTYPED_VALUE_TRAITS(float, kJSTypeDouble, f64)
+JSTYPED_VALUE_TRAITS(bool, kJSTypeBoolean, b)
+JSTYPED_VALUE_TRAITS(int64_t, kJSTypeInt64, i64)
+
+#undef JSTYPED_VALUE_TRAITS
+
+template <size_t... I>
+struct JSTypedIndexes {};
+
+template <size_t N, size_t... I>
+struct JSTypedMakeIndexes : JSTypedMakeIndexes<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct JSTypedMakeIndexes<0, I...> {
+  typedef JSTypedIndexes<I...> Type;
+};
+
+template <typename F>
+struct JSTypedFunction;
+
+template <typename R, typename... A>
+struct JSTypedFunction<R(A...)> {
+  enum { kReturnType = JSTypedValueTraits<R>::kType };
+
+  static void Call(void* function,
+                   const JSTypedValue* argv,
+                   JSTypedValue* presult) {
+    Call(function, argv, presult,
+         typename JSTypedMakeIndexes<sizeof...(A)>::Type());
+  }
+
+  template <size_t... I>
+  static void Call(void* function,
+                   const JSTypedValue* argv,
+                   JSTypedValue* presult,
+                   JSTypedIndexes<I...>) {
+    R (*fn)(A...) = reinterpret_cast<R (*)(A...)>(function);
+    JSTypedValueTraits<R>::Set(
+        presult, fn(JSTypedValueTraits<A>::Get(argv[I])...));
+  }
+};
+
+template <typename... A>
+struct JSTypedFunction<void(A...)> {
+  enum { kReturnType = kJSTypeVoid };
+
+  static void Call(void* function,
+                   const JSTypedValue* argv,
+                   JSTypedValue* presult) {
+    Call(function, argv, typename JSTypedMakeIndexes<sizeof...(A)>::Type());
+  }
+
+  template <size_t... I>
+  static void Call(void* function,
+                   const JSTypedValue* argv,
+                   JSTypedIndexes<I...>) {
+    void (*fn)(A...) = reinterpret_cast<void (*)(A...)>(function);
+    fn(JSTypedValueTraits<A>::Get(argv[I])...);
+  }
+};
+
 typedef struct {
   const char* name;
-  JSFunctionCallback function;
+  // |lazy_function| is set if |flags| has JSEnv::kFlagLazyArgs, see
+  // JSEnv::LazyFunctionDefinition
+  union {
+    JSFunctionCallback function;
+    JSLazyFunctionCallback lazy_function;
+  };
   void* user_data;
   uint32_t flags;
 } JSFunctionDefinition;
@@ -306,6 +641,84 @@ typedef struct {
   JSFunctionDefinition* functions;
 } JSClassDefinition;
 
+// interceptors of the instances of a class (JSEnv::CreateClassWithInterceptors)
+// A callback returns false if it doesn't handle the property, the object is
+// used then. The callbacks may be null, the arguments are valid until the
+// callback returns.
+typedef bool (*JSNamedPropertyGetCallback)(JSEnv* env,
+                                           void* user_data,
+                                           JSObject self,
+                                           const JSValue* name,
+                                           JSValue* pvalue);
+typedef bool (*JSNamedPropertySetCallback)(JSEnv* env,
+                                           void* user_data,
+                                           JSObject self,
+                                           const JSValue* name,
+                                           const JSValue* pvalue);
+// query: true if the property exists; delete: true if it's deleted
+typedef bool (*JSNamedPropertyQueryCallback)(JSEnv* env,
+                                             void* user_data,
+                                             JSObject self,
+                                             const JSValue* name);
+// sets *pnames to an Array of the names
+typedef bool (*JSNamedPropertyEnumerateCallback)(JSEnv* env,
+                                                 void* user_data,
+                                                 JSObject self,
+                                                 JSValue* pnames);
+
+typedef bool (*JSIndexedPropertyGetCallback)(JSEnv* env,
+                                             void* user_data,
+                                             JSObject self,
+                                             uint32_t index,
+                                             JSValue* pvalue);
+typedef bool (*JSIndexedPropertySetCallback)(JSEnv* env,
+                                             void* user_data,
+                                             JSObject self,
+                                             uint32_t index,
+                                             const JSValue* pvalue);
+typedef bool (*JSIndexedPropertyQueryCallback)(JSEnv* env,
+                                               void* user_data,
+                                               JSObject self,
+                                               uint32_t index);
+// the indexes 0 to count - 1 are enumerated
+typedef uint32_t (*JSIndexedPropertyCountCallback)(JSEnv* env,
+                                                   void* user_data,
+                                                   JSObject self);
+
+// The named callbacks are called for the string names which are not found
+// on the object and its prototype chain, so the class members are not
+// shadowed. |flags| are the JSEnv::kFlag* of the converted names and values.
+typedef struct {
+  JSNamedPropertyGetCallback getter;
+  JSNamedPropertySetCallback setter;
+  JSNamedPropertyQueryCallback query;
+  JSNamedPropertyQueryCallback deleter;
+  JSNamedPropertyEnumerateCallback enumerator;
+  void* user_data;
+  uint32_t flags;
+} JSNamedPropertyHandler;
+
+typedef struct {
+  JSIndexedPropertyGetCallback getter;
+  JSIndexedPropertySetCallback setter;
+  JSIndexedPropertyQueryCallback query;
+  JSIndexedPropertyQueryCallback deleter;
+  JSIndexedPropertyCountCallback enumerator;
+  void* user_data;
+  uint32_t flags;
+} JSIndexedPropertyHandler;
+
+// snapshot classes (JSEnv::RegisterSnapshotClass and JSEnv::CreateSnapshot)
+typedef int (*register_snapshot_class_cb)(const JSClassDefinition*,
+                                          int,
+                                          const JSNamedPropertyHandler*,
+                                          const JSIndexedPropertyHandler*);
+// the blob is valid until the callback returns
+typedef void (*JSSnapshotWriteCallback)(const char* data,
+                                        int size,
+                                        void* user_data);
+typedef bool (*create_snapshot_cb)(const char*, JSSnapshotWriteCallback, void*);
+
 ///////////////////////////////////////////////////////
 // inspector
 class JSInspectorSession {
@@ -360,7 +773,38 @@ class JSInspectorClient {
 
 class JSEnv {
  public:
-  enum { kFlagUseUTF8 = 1 };
+  enum {
+    kFlagUseUTF8 = 1,
+    // string arguments of a native callback may point to the V8 string
+    // contents instead of a copy, they may not end with '\0' (use Length()).
+    // Like all the callback arguments they are only valid until the callback
+    // returns, call JSValue::CopyFrom to keep one.
+    kFlagBorrowString = 2,
+    // a Number which is an integer but not an int32 is got as kInt64
+    // instead of kFloat
+    kFlagUseInt64 = 4,
+    // JSFunctionDefinition: the callback is |lazy_function| instead of
+    // |function|. Set by LazyFunctionDefinition, NewLazyFunction and
+    // RegisterLazyCallbackOnObject; RegisterCallbackOnObject rejects it.
+    kFlagLazyArgs = 8,
+    // JSPropertyDefinition: the getter is called once by CreateClass, with a
+    // null self, and the value is a read-only data property of the
+    // prototype (of the object template for a class without a constructor).
+    // A value which is not a primitive makes it kFlagLazy.
+    kFlagConstant = 16,
+    // JSPropertyDefinition: the getter is called by the first read of an
+    // instance and the value is kept as its data property. The setter is not
+    // called, an assignment replaces the value (it's read-only without a
+    // setter).
+    kFlagLazy = 32,
+    // JSClassDefinition::constructor: the finalize callback is not called by
+    // the GC but queued, and run on the JS thread by RunPendingFinalizers
+    // (RunPendingTasks runs them too, the task wakeup fd is signaled)
+    kFlagDeferredFinalize = 64,
+    // JSClassDefinition::constructor: the finalize callback is queued and
+    // run on a background thread, it must not touch the JSEnv
+    kFlagBackgroundFinalize = 128,
+  };
 
   virtual int GetVersion() const = 0;
 
@@ -574,17 +1018,8 @@ class JSEnv {
   static JSEnv* GetInstance(J2V8Handle handle,
                             int version = JSENV_VERSION,
                             void* j2v8_so_handle = nullptr) {
-    if (j2v8_so_handle == nullptr) {
-      const char* jsenv_so_name = getenv(JSENV_SO_NAME);
-      if (!jsenv_so_name) {
-        jsenv_so_name = JSENV_DEFAULT_SO_NAME;
-      }
-
-      j2v8_so_handle = dlopen(jsenv_so_name, RTLD_NOW);
-    }
-
-    get_jsenv_cb get_env =
-        reinterpret_cast<get_jsenv_cb>(dlsym(j2v8_so_handle, JSENV_ENTRY));
+    get_jsenv_cb get_env = reinterpret_cast<get_jsenv_cb>(
+        dlsym(OpenJSEnvSo(j2v8_so_handle), JSENV_ENTRY));
 
     if (!get_env) {
       return nullptr;
@@ -608,6 +1043,405 @@ class JSEnv {
 
  protected:
   virtual ~JSEnv() {}
+
+ public:
+  // version 1200
+  // keep the 1100 vtable layout, new interfaces are appended here
+
+  // external string
+  // Wrap an immutable native buffer, it's not copied into the JS heap when
+  // it's converted to a JS string (Set it to a JSValue). |length| is the
+  // count of characters. The buffer must be valid until |release_callback|
+  // is called, that is after DeleteExternalString and when all the JS
+  // strings made from it are collected.
+  virtual JSExternalString NewExternalString(
+      const void* data,
+      size_t length,
+      int encoding,
+      JSExternalStringReleaseCallback release_callback,
+      void* user_data) = 0;
+  virtual void DeleteExternalString(JSExternalString str) = 0;
+
+  // property key
+  // An internalized key kept by the JSEnv, the same name returns the same
+  // key. Access by a key doesn't create a string, use it for the hot
+  // properties. The key is valid until the JSEnv is released.
+  virtual JSPropertyKey CreatePropertyKey(const char* name) = 0;
+  virtual bool GetObjectProperty(JSObject object,
+                                 JSPropertyKey key,
+                                 JSValue* pvalue,
+                                 uint32_t flags = 0) = 0;
+  virtual bool SetObjectProperty(JSObject object,
+                                 JSPropertyKey key,
+                                 const JSValue* pvalue) = 0;
+  virtual bool GetGlobal(JSPropertyKey key,
+                         JSValue* pvalue,
+                         uint32_t flags = 0) = 0;
+  virtual bool SetGlobal(JSPropertyKey key, const JSValue* pvalue) = 0;
+  template <typename TValue>
+  bool SetObjectPropertyValue(JSObject object,
+                              JSPropertyKey key,
+                              const TValue& value) {
+    JSValue jsvalue(value);
+    return SetObjectProperty(object, key, &jsvalue);
+  }
+  template <typename TValue>
+  bool SetGlobalValue(JSPropertyKey key, const TValue& value) {
+    JSValue jsvalue(value);
+    return SetGlobal(key, &jsvalue);
+  }
+
+  // batched property access, the whole batch is done in one call.
+  // GetObjectProperties sets a failed value to null and returns false,
+  // object values are handles of the current scope like GetObjectProperty.
+  virtual bool GetObjectProperties(JSObject object,
+                                   const JSValue* keys,
+                                   int count,
+                                   JSValue* values,
+                                   uint32_t flags = 0) = 0;
+  virtual bool GetObjectProperties(JSObject object,
+                                   const JSPropertyKey* keys,
+                                   int count,
+                                   JSValue* values,
+                                   uint32_t flags = 0) = 0;
+  virtual bool SetObjectProperties(JSObject object,
+                                   const JSValue* keys,
+                                   const JSValue* values,
+                                   int count) = 0;
+  virtual bool SetObjectProperties(JSObject object,
+                                   const JSPropertyKey* keys,
+                                   const JSValue* values,
+                                   int count) = 0;
+
+  // bulk array access, |object| is an Array or a TypedArray. The elements
+  // of a TypedArray are read and written in place without V8 values.
+  // GetArrayElements sets the elements out of range to null, it fails on a
+  // TypedArray without a backing store (detached).
+  virtual bool GetArrayElements(JSObject object,
+                                uint32_t start,
+                                uint32_t count,
+                                JSValue* values,
+                                uint32_t flags = 0) = 0;
+  virtual bool SetArrayElements(JSObject object,
+                                uint32_t start,
+                                const JSValue* values,
+                                uint32_t count) = 0;
+
+  // object shape
+  // A property layout registered once, the objects made by
+  // NewObjectWithShape have the same hidden class and are created
+  // initialized in one call. The missing values are null. The shape is valid
+  // until the JSEnv is released. Duplicate names are rejected (nullptr).
+  virtual JSObjectShape CreateObjectShape(const char* const* names,
+                                          int count) = 0;
+  virtual JSObject NewObjectWithShape(JSObjectShape shape,
+                                      const JSValue* values,
+                                      int count) = 0;
+
+  // structured clone
+  // Serialize a value by the structured clone algorithm. The data doesn't
+  // belong to the JSEnv, it can be deserialized by another JSEnv (isolate).
+  // The ArrayBuffers in |transfers| are moved instead of copied: they are
+  // detached, and the data can be deserialized only once, a failed
+  // DeserializeValue consumes it too.
+  virtual JSSerializedData SerializeValue(const JSValue* pvalue,
+                                          const JSObject* transfers = nullptr,
+                                          int transfer_count = 0) = 0;
+  virtual bool DeserializeValue(JSSerializedData data,
+                                JSValue* pvalue,
+                                uint32_t flags = 0) = 0;
+  // the bytes to save in native storage, nullptr if the data has transfers
+  virtual const void* GetSerializedDataBuffer(JSSerializedData data,
+                                              size_t* psize) = 0;
+  // the bytes are copied
+  virtual JSSerializedData NewSerializedData(const void* buffer,
+                                             size_t size) = 0;
+  virtual void DeleteSerializedData(JSSerializedData data) = 0;
+
+  // JSON
+  // JSON.parse of a string value (UTF8, UTF16 or external) without a script
+  virtual bool ParseJSON(const JSValue* json,
+                         JSValue* presult,
+                         uint32_t flags = 0) = 0;
+  template <typename TCHAR>
+  bool ParseJSON(const TCHAR* json,
+                 int length,
+                 JSValue* presult,
+                 uint32_t flags = 0) {
+    JSValue json_value;
+    json_value.Set(json, length);
+    return ParseJSON(&json_value, presult, flags);
+  }
+  // JSON.stringify, the result is a string in the encoding of |flags|
+  virtual bool StringifyJSON(const JSValue* pvalue,
+                             JSValue* presult,
+                             uint32_t flags = 0) = 0;
+  bool StringifyJSON(JSObject object, JSValue* presult, uint32_t flags = 0) {
+    JSValue value(object);
+    return StringifyJSON(&value, presult, flags);
+  }
+
+  // lazy arguments
+  // A function whose arguments are not converted before the call, the
+  // callback queries and converts only what it uses. GetArg converts by the
+  // flags of the function, a string is valid until the callback returns.
+  virtual JSObject NewLazyFunction(JSLazyFunctionCallback callback,
+                                   void* user_data,
+                                   uint32_t flags = 0) = 0;
+  // a JSFunctionDefinition of a lazy class method or constructor
+  static JSFunctionDefinition LazyFunctionDefinition(
+      const char* name,
+      JSLazyFunctionCallback function,
+      void* user_data = nullptr,
+      uint32_t flags = 0) {
+    JSFunctionDefinition definition = {name, {nullptr}, user_data,
+                                       flags | kFlagLazyArgs};
+    definition.lazy_function = function;
+    return definition;
+  }
+  virtual int GetArgsLength(JSArgs args) = 0;
+  // the JSValue type without a conversion, an object is classified like
+  // GetObjectType. A BigInt out of 64 bits is kNull, GetArg fails on it.
+  // GetArg sets the same type, e.g. an array argument is kJSArray.
+  virtual int GetArgType(JSArgs args, int index) = 0;
+  virtual bool GetArg(JSArgs args, int index, JSValue* pvalue) = 0;
+
+  // typed function
+  // NewTypedFunction<double(int32_t, int32_t)>(fn) makes a JS function which
+  // converts its arguments to the declared types (ToInt32, ToNumber, ...),
+  // calls |fn| and returns its result without JSValues. The types are
+  // int32_t, uint32_t, int64_t, double, float, bool and void (return only).
+  // An int64_t argument takes a Number or a BigInt, an int64_t result is a
+  // BigInt. It's for pure helpers: |fn| can't access the JSEnv or throw.
+  enum { kMaxTypedFunctionArgs = 8 };
+  virtual JSObject NewTypedFunctionWithSignature(JSTypedFunctionThunk thunk,
+                                                 void* function,
+                                                 int return_type,
+                                                 const int* arg_types,
+                                                 int argc) = 0;
+  template <typename F>
+  JSObject NewTypedFunction(F* function) {
+    return NewTypedFunctionWithTypes(function);
+  }
+
+  // Unbinds a function made by NewFunction, NewLazyFunction, NewTypedFunction
+  // or RegisterFunction: the native callback is never called again (the
+  // function returns undefined), so its user_data can be freed now. The
+  // native record of a function is freed when the function is collected,
+  // DeleteFunction is only needed to drop the binding earlier.
+  virtual bool DeleteFunction(JSObject function) = 0;
+
+  // async function
+  // The function returns a Promise, |callback| hands the token to a worker
+  // and returns. Every token must be completed once, the completions are
+  // queued without a lock and settled on the JS thread by
+  // RunAsyncCompletions, in order, with one microtask checkpoint per batch.
+  // If |callback| throws (SetException), the promise is rejected with the
+  // exception and the token is consumed: it must not be completed then.
+  virtual JSObject NewAsyncFunction(JSAsyncFunctionCallback callback,
+                                    void* user_data,
+                                    uint32_t flags = 0) = 0;
+  // Thread safe. |pvalue| is copied, it can't be an object (return those by
+  // CompleteAsyncWithSerializedData), nullptr is undefined. It returns false
+  // if the value can't be sent, the token is still pending then. Like
+  // PostTask, the completing thread must hold its own AddReference on the
+  // JSEnv while it completes.
+  virtual bool CompleteAsync(JSAsyncToken token,
+                             bool resolve,
+                             const JSValue* pvalue) = 0;
+  // thread safe, takes the ownership of |data| (see SerializeValue)
+  virtual bool CompleteAsyncWithSerializedData(JSAsyncToken token,
+                                               bool resolve,
+                                               JSSerializedData data) = 0;
+  // set it before the async functions are called
+  virtual void SetAsyncNotifyCallback(JSAsyncNotifyCallback callback,
+                                      void* user_data) = 0;
+  // JS thread, returns the number of the settled promises
+  virtual int RunAsyncCompletions() = 0;
+
+  // tasks
+  // Thread safe, |callback| runs on the JS thread by RunPendingTasks, the
+  // higher priority first, in the post order within a priority. It returns
+  // false if the JSEnv is detached, the task isn't called then. The posting
+  // thread must hold its own AddReference on the JSEnv while it posts.
+  virtual bool PostTask(JSTaskCallback callback,
+                        void* user_data,
+                        int priority = kJSTaskPriorityNormal) = 0;
+  // An eventfd which is readable while tasks or async completions are queued,
+  // the host loop polls it (e.g. ALooper_addFd) and calls RunPendingTasks.
+  // It's owned by the JSEnv.
+  virtual int GetTaskWakeupFd() = 0;
+  // JS thread. Settles the async completions and runs the tasks until the
+  // queue is empty or |budget_us| is used up (negative for no limit), one
+  // task at least. The fd stays readable if tasks are left. It returns the
+  // number of the tasks run.
+  virtual int RunPendingTasks(int64_t budget_us = -1) = 0;
+
+  // microtasks
+  // With kJSMicrotaskPolicyExplicit a native loop can settle a frame of
+  // promises and run them by one checkpoint. RunPendingTasks and
+  // RunAsyncCompletions run one checkpoint per batch in every policy.
+  virtual bool SetMicrotaskPolicy(int policy) = 0;
+  virtual int GetMicrotaskPolicy() = 0;
+  virtual void PerformMicrotaskCheckpoint() = 0;
+  // The number of the promises settled successfully by Resolve, Reject and
+  // the async completions since the last checkpoint. It is not the length
+  // of the microtask queue, which V8 doesn't expose: the reactions of other
+  // promises (await) and queueMicrotask are not counted.
+  virtual int GetSettledPromiseCount() = 0;
+
+  // prepared call
+  // For calling the same function with the same receiver and arity many
+  // times (event dispatch): the handles are resolved once and the argument
+  // buffer is reused. |self| is null for the global object.
+  virtual JSPreparedCall PrepareCall(JSObject function,
+                                     JSObject self,
+                                     int argc) = 0;
+  // |argv| has the |argc| of PrepareCall values, |presult| may be null
+  virtual bool InvokePreparedCall(JSPreparedCall call,
+                                  const JSValue* argv,
+                                  JSValue* presult,
+                                  uint32_t flags = 0) = 0;
+  virtual void DeletePreparedCall(JSPreparedCall call) = 0;
+
+  // event channel
+  // A native owned list of JS listeners. EmitEvent converts the payload once
+  // and calls every listener in one handle scope and TryCatch, a listener
+  // which throws doesn't stop the others: the exceptions are joined into the
+  // JSEnv exception after all the listeners are called.
+  virtual JSEventChannel CreateEventChannel() = 0;
+  virtual void DeleteEventChannel(JSEventChannel channel) = 0;
+  // the JS side of the channel, an object with addListener(fn) and
+  // removeListener(fn)
+  virtual JSObject GetEventChannelObject(JSEventChannel channel) = 0;
+  virtual bool AddEventListener(JSEventChannel channel, JSObject listener) = 0;
+  virtual bool RemoveEventListener(JSEventChannel channel,
+                                   JSObject listener) = 0;
+  virtual int GetEventListenerCount(JSEventChannel channel) = 0;
+  // returns the number of the listeners called, -1 if |channel| is null
+  virtual int EmitEvent(JSEventChannel channel,
+                        const JSValue* argv,
+                        int argc) = 0;
+
+  // batched domain calls
+  // Like RegisterCallbackOnObject, but the calls of the function aren't
+  // delivered one by one: the arguments of each call are encoded into a
+  // native buffer, and the buffer is delivered to |callback| at once when
+  // the outermost call into V8 returns (the auto and scoped policies, even
+  // if no microtask ran), after a checkpoint of the explicit policy, by
+  // FlushBatchedCalls or at Detach. The JS function returns undefined, it
+  // throws if an argument can't be cloned.
+  virtual bool RegisterBatchedCallback(J2V8ObjectHandle object,
+                                       const char* domain,
+                                       JSBatchedCallsCallback callback,
+                                       void* user_data) = 0;
+  virtual void FlushBatchedCalls() = 0;
+
+  // class interceptors
+  // CreateClass with the named and the indexed interceptors of the
+  // instances, either may be null: a native container is exposed as a
+  // (array-like) view without copying it into JS. The handlers are copied.
+  virtual JSClass CreateClassWithInterceptors(
+      const JSClassDefinition* class_definition,
+      JSClass super,
+      const JSNamedPropertyHandler* named_handler,
+      const JSIndexedPropertyHandler* indexed_handler) = 0;
+
+  // queued finalizers
+  // returns the number of the finalizers run, at least one runs if any is
+  // queued. The ones left are run at Detach.
+  virtual int RunPendingFinalizers(int64_t budget_us = -1) = 0;
+  virtual void GetFinalizeStats(JSFinalizeStats* pstats) = 0;
+  virtual void ResetFinalizeStats() = 0;
+
+  // bulk instances
+  // NewInstance |count| times in one pass: the objects are made from the
+  // object template without calling the constructor, the internal field of
+  // GetObjectPrivateData is set from |private_data| (if not null) and the
+  // finalizers are registered together. Returns the number of the objects
+  // made into |objects|, less than |count| only if an allocation fails.
+  virtual int NewInstances(JSClass clazz,
+                           int count,
+                           JSObject* objects,
+                           void* const* private_data = nullptr) = 0;
+
+  // lazy callback on object
+  // RegisterCallbackOnObject with a JSLazyFunctionCallback. Unlike the
+  // UserFunctionCallback, which gets the J2V8ObjectHandle of |object|,
+  // |self| of the callback is the receiver of the call (this).
+  virtual bool RegisterLazyCallbackOnObject(J2V8ObjectHandle object,
+                                            const char* domain,
+                                            JSLazyFunctionCallback callback,
+                                            void* user_data,
+                                            uint32_t flags = 0) = 0;
+
+  // snapshot classes
+  // Registers a class whose templates are put in the startup snapshots made
+  // by CreateSnapshot. The same classes are registered in the same order by
+  // the process which makes a snapshot and by the ones which load it, before
+  // their first isolate: the member tables of a class are shared by the
+  // isolates of the process and are external references of the snapshot.
+  // The definition is kept. Returns the id of the class, the |super_id| of
+  // its subclasses, or -1.
+  // CreateClass (CreateClassWithInterceptors) of the definition with the
+  // registered super class and handlers restores its templates from the
+  // snapshot of the isolate, if the super class is restored too, or builds
+  // them. The getter of a kFlagConstant property is called by CreateSnapshot
+  // (with a null env), not by a restoring CreateClass. A snapshot is only
+  // restored by a process which registered the same classes: CreateSnapshot
+  // marks it with the class names and the JSENV_VERSION. The members of a
+  // snapshot class are not counted by the callback profiler, their tables
+  // are shared by the isolates.
+  static int RegisterSnapshotClass(
+      const JSClassDefinition* class_definition,
+      int super_id = -1,
+      const JSNamedPropertyHandler* named_handler = nullptr,
+      const JSIndexedPropertyHandler* indexed_handler = nullptr,
+      void* j2v8_so_handle = nullptr) {
+    register_snapshot_class_cb register_class =
+        reinterpret_cast<register_snapshot_class_cb>(
+            dlsym(OpenJSEnvSo(j2v8_so_handle), JSENV_SNAPSHOT_CLASS_ENTRY));
+    return register_class ? register_class(class_definition, super_id,
+                                           named_handler, indexed_handler)
+                          : -1;
+  }
+  // Makes a startup snapshot of the registered classes and of a context
+  // which has run |script| (UTF-8, may be null), it's passed to
+  // |write_callback|. It's loaded as the nativejs snapshot of a runtime.
+  // Returns false if the script throws or a class can't be added.
+  static bool CreateSnapshot(const char* script,
+                             JSSnapshotWriteCallback write_callback,
+                             void* user_data,
+                             void* j2v8_so_handle = nullptr) {
+    create_snapshot_cb create_snapshot = reinterpret_cast<create_snapshot_cb>(
+        dlsym(OpenJSEnvSo(j2v8_so_handle), JSENV_SNAPSHOT_ENTRY));
+    return create_snapshot &&
+           create_snapshot(script, write_callback, user_data);
+  }
+
+ private:
+  static void* OpenJSEnvSo(void* j2v8_so_handle) {
+    if (j2v8_so_handle == nullptr) {
+      const char* jsenv_so_name = getenv(JSENV_SO_NAME);
+      if (!jsenv_so_name) {
+        jsenv_so_name = JSENV_DEFAULT_SO_NAME;
+      }
+
+      j2v8_so_handle = dlopen(jsenv_so_name, RTLD_NOW);
+    }
+    return j2v8_so_handle;
+  }
+
+  template <typename R, typename... A>
+  JSObject NewTypedFunctionWithTypes(R (*function)(A...)) {
+    static_assert(sizeof...(A) <= kMaxTypedFunctionArgs,
+                  "too many arguments for a typed function");
+    const int arg_types[] = {JSTypedValueTraits<A>::kType..., 0};
+    return NewTypedFunctionWithSignature(
+        JSTypedFunction<R(A...)>::Call, reinterpret_cast<void*>(function),
+        JSTypedFunction<R(A...)>::kReturnType, arg_types,
+        static_cast<int>(sizeof...(A)));
+  }
 };
 
 }  // namespace hybrid
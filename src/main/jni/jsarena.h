@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSARENA_H_
+#define HYBRID_JSARENA_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+// Bump allocator used by the native callback trampolines. Each callback takes
+// a Mark on entry and resets to it on return, so nested callbacks are safe and
+// the blocks are reused: the steady state does no heap allocation.
+class JSArena {
+ public:
+  static const size_t kDefaultBlockSize = 16 * 1024;
+  static const size_t kAlignment = 8;
+
+  struct Mark {
+    size_t block;
+    size_t used;
+  };
+
+  class Scope {
+   public:
+    explicit Scope(JSArena* arena) : arena_(arena), mark_({0, 0}) {
+      if (arena_) {
+        mark_ = arena_->GetMark();
+      }
+    }
+
+    ~Scope() {
+      if (arena_) {
+        arena_->Reset(mark_);
+      }
+    }
+
+   private:
+    JSArena* arena_;
+    Mark mark_;
+  };
+
+  explicit JSArena(size_t block_size = kDefaultBlockSize)
+      : block_size_(block_size), current_(0), used_(0) {
+    ResetStats();
+  }
+
+  ~JSArena() {
+    for (Block& block : blocks_) {
+      free(block.data);
+    }
+  }
+
+  void* Allocate(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+
+    if (current_ >= blocks_.size() || blocks_[current_].size - used_ < size) {
+      if (!NextBlock(size)) {
+        return nullptr;
+      }
+    }
+
+    void* ptr = blocks_[current_].data + used_;
+    used_ += size;
+
+    stats_.allocation_count++;
+    size_t in_use = InUse();
+    if (in_use > stats_.high_water_mark) {
+      stats_.high_water_mark = in_use;
+    }
+    return ptr;
+  }
+
+  template <typename T>
+  T* AllocateArray(size_t count) {
+    return reinterpret_cast<T*>(Allocate(count * sizeof(T)));
+  }
+
+  Mark GetMark() const { return {current_, used_}; }
+
+  // release everything allocated after |mark|, the blocks are kept
+  void Reset(const Mark& mark) {
+    current_ = mark.block;
+    used_ = mark.used;
+  }
+
+  void GetStats(JSArenaStats* pstats) const {
+    *pstats = stats_;
+    pstats->capacity = 0;
+    for (const Block& block : blocks_) {
+      pstats->capacity += block.size;
+    }
+    pstats->block_count = blocks_.size();
+    pstats->used = InUse();
+  }
+
+  void ResetStats() {
+    memset(&stats_, 0, sizeof(stats_));
+    stats_.high_water_mark = InUse();
+  }
+
+ private:
+  struct Block {
+    uint8_t* data;
+    size_t size;
+  };
+
+  // bytes in use, the tail of the skipped blocks is counted as used
+  size_t InUse() const {
+    size_t in_use = used_;
+    for (size_t i = 0; i < current_ && i < blocks_.size(); i++) {
+      in_use += blocks_[i].size;
+    }
+    return in_use;
+  }
+
+  bool NextBlock(size_t size) {
+    size_t next = current_ < blocks_.size() ? current_ + 1 : blocks_.size();
+
+    if (next >= blocks_.size() || blocks_[next].size < size) {
+      size_t block_size = size > block_size_ ? size : block_size_;
+      uint8_t* data = reinterpret_cast<uint8_t*>(malloc(block_size));
+      if (data == nullptr) {
+        return false;
+      }
+      blocks_.insert(blocks_.begin() + next, Block{data, block_size});
+      stats_.heap_allocation_count++;
+    }
+
+    current_ = next;
+    used_ = 0;
+    return true;
+  }
+
+  size_t block_size_;
+  std::vector<Block> blocks_;
+  size_t current_;
+  size_t used_;
+  JSArenaStats stats_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSARENA_H_
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSASYNC_H_
+#define HYBRID_JSASYNC_H_
+
+#include <v8.h>
+#include <atomic>
+
+#include "JSEnv.h"
+#include "jsmpsc_queue.h"
+
+namespace hybrid {
+
+class JSEnvImpl;
+
+// JSAsyncToken: one pending call of a NewAsyncFunction function. It's made
+// on the isolate thread, completed on any thread and settled (and deleted)
+// on the isolate thread.
+struct AsyncCompletion {
+  explicit AsyncCompletion(JSEnvImpl* jsenv)
+      : jsenv(jsenv),
+        completed(false),
+        resolve(false),
+        serialized_data(nullptr),
+        next(nullptr) {}
+
+  static AsyncCompletion* From(JSAsyncToken token) {
+    return reinterpret_cast<AsyncCompletion*>(token);
+  }
+
+  JSAsyncToken ToJSAsyncToken() {
+    return reinterpret_cast<JSAsyncToken>(this);
+  }
+
+  JSEnvImpl* jsenv;
+  // only touched on the isolate thread
+  v8::Global<v8::Promise::Resolver> resolver;
+  std::atomic<bool> completed;
+  bool resolve;
+  // the result, a copied JSValue or a JSSerializedData
+  JSValue value;
+  JSSerializedData serialized_data;
+  AsyncCompletion* next;
+};
+
+typedef MPSCQueue<AsyncCompletion> AsyncCompletionQueue;
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSASYNC_H_
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSCALLBACK_PROFILER_H_
+#define HYBRID_JSCALLBACK_PROFILER_H_
+
+// Per-callback counters of the native callback trampolines. They're built
+// only with JSENV_ENABLE_CALLBACK_PROFILING (gn arg
+// enable_jsenv_callback_profiling), otherwise the JSENV_PROFILE_* macros
+// expand to nothing.
+
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+class CallbackProfiler {
+ public:
+  struct Entry {
+    explicit Entry(const std::string& name) : name(name) { Reset(); }
+
+    void Reset() {
+      call_count = 0;
+      total_ns = 0;
+      max_ns = 0;
+      callback_ns = 0;
+    }
+
+    std::string name;
+    uint64_t call_count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t callback_ns;
+  };
+
+  // the entries are kept until the profiler is destroyed, the callbacks
+  // hold the pointers
+  Entry* GetEntry(const std::string& name) {
+    std::unique_ptr<Entry>& entry = entries_[name];
+    if (!entry) {
+      entry.reset(new Entry(name));
+    }
+    return entry.get();
+  }
+
+  void Reset() {
+    for (auto& it : entries_) {
+      it.second->Reset();
+    }
+  }
+
+  void GetReport(JSCallbackProfileReport* preport) const {
+    std::vector<const Entry*> entries = SortedEntries();
+    preport->count = static_cast<int>(entries.size());
+    for (int i = 0; i < preport->count && i < preport->capacity; i++) {
+      const Entry* entry = entries[i];
+      JSCallbackProfileEntry* pentry = &preport->entries[i];
+      pentry->name = entry->name.c_str();
+      pentry->call_count = entry->call_count;
+      pentry->total_ns = entry->total_ns;
+      pentry->max_ns = entry->max_ns;
+      pentry->marshal_ns = entry->total_ns - entry->callback_ns;
+      pentry->callback_ns = entry->callback_ns;
+    }
+  }
+
+  // {"callbacks":[{"name":"...","count":1,"total_ns":2,...},...]}
+  void GetJSONReport(JSCallbackProfileJSON* pjson) const {
+    std::string json = "{\"callbacks\":[";
+    bool first = true;
+    for (const Entry* entry : SortedEntries()) {
+      if (!first) {
+        json += ',';
+      }
+      first = false;
+      json += "{\"name\":";
+      AppendJSONString(&json, entry->name);
+      char buffer[160];
+      snprintf(buffer, sizeof(buffer),
+               ",\"count\":%llu,\"total_ns\":%llu,\"max_ns\":%llu,"
+               "\"marshal_ns\":%llu,\"callback_ns\":%llu}",
+               static_cast<unsigned long long>(entry->call_count),
+               static_cast<unsigned long long>(entry->total_ns),
+               static_cast<unsigned long long>(entry->max_ns),
+               static_cast<unsigned long long>(entry->total_ns -
+                                               entry->callback_ns),
+               static_cast<unsigned long long>(entry->callback_ns));
+      json += buffer;
+    }
+    json += "]}";
+
+    pjson->length = json.size();
+    if (pjson->buffer != nullptr && pjson->size > 0) {
+      size_t n = std::min(json.size(), pjson->size - 1);
+      memcpy(pjson->buffer, json.data(), n);
+      pjson->buffer[n] = '\0';
+    }
+  }
+
+  static uint64_t NowNanos() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+ private:
+  // the called entries, the hottest first
+  std::vector<const Entry*> SortedEntries() const {
+    std::vector<const Entry*> entries;
+    for (auto& it : entries_) {
+      if (it.second->call_count > 0) {
+        entries.push_back(it.second.get());
+      }
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry* a, const Entry* b) {
+                return a->total_ns > b->total_ns;
+              });
+    return entries;
+  }
+
+  static void AppendJSONString(std::string* pjson, const std::string& str) {
+    *pjson += '"';
+    for (char c : str) {
+      if (c == '"' || c == '\\') {
+        *pjson += '\\';
+        *pjson += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        *pjson += buffer;
+      } else {
+        *pjson += c;
+      }
+    }
+    *pjson += '"';
+  }
+
+  std::map<std::string, std::unique_ptr<Entry>> entries_;
+};
+
+// Times one trampoline call: the time outside BeginCallback/EndCallback is
+// the marshalling of the arguments and the result.
+class CallbackProfileScope {
+ public:
+  explicit CallbackProfileScope(CallbackProfiler::Entry* entry)
+      : entry_(entry),
+        start_(entry ? CallbackProfiler::NowNanos() : 0),
+        callback_start_(0),
+        callback_ns_(0) {}
+
+  ~CallbackProfileScope() {
+    if (entry_ == nullptr) {
+      return;
+    }
+    uint64_t elapsed = CallbackProfiler::NowNanos() - start_;
+    entry_->call_count++;
+    entry_->total_ns += elapsed;
+    entry_->max_ns = std::max(entry_->max_ns, elapsed);
+    entry_->callback_ns += callback_ns_;
+  }
+
+  void BeginCallback() {
+    if (entry_) {
+      callback_start_ = CallbackProfiler::NowNanos();
+    }
+  }
+
+  void EndCallback() {
+    if (entry_) {
+      callback_ns_ += CallbackProfiler::NowNanos() - callback_start_;
+    }
+  }
+
+ private:
+  CallbackProfiler::Entry* entry_;
+  uint64_t start_;
+  uint64_t callback_start_;
+  uint64_t callback_ns_;
+};
+
+}  // namespace hybrid
+
+#define JSENV_PROFILE_SCOPE(entry) \
+  hybrid::CallbackProfileScope jsenv_profile_scope(entry)
+#define JSENV_PROFILE_BEGIN_CALLBACK() jsenv_profile_scope.BeginCallback()
+#define JSENV_PROFILE_END_CALLBACK() jsenv_profile_scope.EndCallback()
+
+#else  // JSENV_ENABLE_CALLBACK_PROFILING
+
+#define JSENV_PROFILE_SCOPE(entry)
+#define JSENV_PROFILE_BEGIN_CALLBACK()
+#define JSENV_PROFILE_END_CALLBACK()
+
+#endif  // JSENV_ENABLE_CALLBACK_PROFILING
+
+#endif  // HYBRID_JSCALLBACK_PROFILER_H_
@@ -16,8 +16,11 @@ using v8::Function;
 using v8::FunctionCallbackInfo;
 using v8::FunctionTemplate;
 using v8::Handle;
+using v8::HandleScope;
+using v8::Integer;
 using v8::Isolate;
 using v8::Local;
+using v8::Name;
 using v8::Object;
 using v8::ObjectTemplate;
 using v8::Persistent;
@@ -30,40 +33,119 @@ using v8::WeakCallbackType;
 
 namespace hybrid {
 
-JSClassTemplate::JSClassTemplate(Isolate* isolate,
-                                 const JSClassDefinition* class_define,
-                                 JSClassTemplate* parent) {
-  Local<ObjectTemplate> object_templ;
-  Local<Template> templ;
+// copies the member of the callback union selected by kFlagLazyArgs
+template <typename TInfo>
+static void CopyFunction(const JSFunctionDefinition& fd, TInfo* pinfo) {
+  if (fd.flags & JSEnv::kFlagLazyArgs) {
+    pinfo->lazy_function = fd.lazy_function;
+  } else {
+    pinfo->function = fd.function;
+  }
+}
+
+// the handler given to CreateClassWithInterceptors is the one of the snapshot
+// class, |registered| if |is_set|
+template <typename T>
+static bool SameHandler(const T* handler, bool is_set, const T& registered) {
+  if (handler == nullptr || !is_set) {
+    return handler == nullptr && !is_set;
+  }
+
+  return handler->getter == registered.getter &&
+         handler->setter == registered.setter &&
+         handler->query == registered.query &&
+         handler->deleter == registered.deleter &&
+         handler->enumerator == registered.enumerator &&
+         handler->user_data == registered.user_data &&
+         handler->flags == registered.flags;
+}
 
+JSClassTemplate::JSClassTemplate(
+    Isolate* isolate,
+    const JSClassDefinition* class_define,
+    JSClassTemplate* parent,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
   if (class_define->class_name) {
     class_name_ = class_define->class_name;
   }
   finalize_ = class_define->finalize;
-  constructor_.function = class_define->constructor.function;
-  constructor_.user_data = class_define->constructor.user_data;
-  constructor_.flags = class_define->constructor.flags;
-  constructor_.self = this;
+  finalize_mode_ =
+      class_define->constructor.flags &
+      (JSEnv::kFlagDeferredFinalize | JSEnv::kFlagBackgroundFinalize);
+  instances_ = nullptr;
+
+  SnapshotClass snapshot;
+  snapshot_id_ = GetSnapshotClass(class_define, named_handler,
+                                  indexed_handler, &snapshot);
+  if (snapshot_id_ >= 0) {
+    // shared with the other isolates, the members are not profiled
+    info_ = snapshot.info;
+    owns_info_ = false;
+  } else {
+    info_ = NewClassInfo(class_define, named_handler, indexed_handler);
+    owns_info_ = true;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    InitProfileEntries(isolate, class_define);
+#endif
+  }
+
+  // a restored template inherits from the restored one of the super class
+  Local<Template> templ;
+  if (snapshot_id_ >= 0) {
+    JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+    int super_id = snapshot.super_id;
+    if (jsenv && jsenv->HasSnapshotClasses() &&
+        (parent ? parent->restored_ && parent->snapshot_id_ == super_id
+                : super_id < 0)) {
+      templ = RestoreTemplate(isolate);
+    }
+  }
+
+  restored_ = !templ.IsEmpty();
+  if (!restored_) {
+    templ = NewTemplate(isolate, class_define, info_,
+                        parent ? parent->GetFunctionTemplate(isolate)
+                               : Local<FunctionTemplate>(),
+                        named_handler, indexed_handler);
+  }
+
+  template_.Reset(isolate, templ);
+}
+
+Local<Template> JSClassTemplate::NewTemplate(
+    Isolate* isolate,
+    const JSClassDefinition* class_define,
+    ClassInfo* info,
+    Local<FunctionTemplate> parent,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
+  Local<ObjectTemplate> object_templ;
+  Local<ObjectTemplate> instance_templ;
+  Local<Template> templ;
 
-  if (class_define->constructor.function) {
+  if (HasFunction(class_define->constructor)) {
     Local<FunctionTemplate> func_templ =
         FunctionTemplate::New(isolate, V8FunctionCallback,
-                              External::New(isolate, &this->constructor_));
+                              External::New(isolate, &info->constructor));
 
-    if (parent) {
-      func_templ->Inherit(parent->GetFunctionTemplate(isolate));
+    if (!parent.IsEmpty()) {
+      func_templ->Inherit(parent);
     }
 
     func_templ->InstanceTemplate()->SetInternalFieldCount(2);
     object_templ = func_templ->PrototypeTemplate();
+    instance_templ = func_templ->InstanceTemplate();
     templ = func_templ;
   } else {
     object_templ = ObjectTemplate::New(isolate);
     object_templ->SetInternalFieldCount(2);
+    instance_templ = object_templ;
     templ = object_templ;
   }
 
-  InitMemberInfos(class_define);
+  SetInterceptors(isolate, instance_templ, info, named_handler,
+                  indexed_handler);
 
   // add the property define
   if (class_define->properties) {
@@ -73,9 +155,25 @@ JSClassTemplate::JSClassTemplate(Isolate* isolate,
         break;
       }
 
-      PropertyInfo* pinfo = &properties_[i];
-      v8::AccessorGetterCallback getter = nullptr;
-      v8::AccessorSetterCallback setter = nullptr;
+      PropertyInfo* pinfo = &info->properties[i];
+      Local<String> name = ToV8String(isolate, pd.name);
+
+      if (pd.getter && (pd.flags & JSEnv::kFlagConstant) &&
+          SetConstantProperty(isolate, object_templ, name, pd)) {
+        continue;
+      }
+
+      if (pd.getter && (pd.flags & (JSEnv::kFlagConstant | JSEnv::kFlagLazy))) {
+        // the getter is called by the first read of an instance, the value
+        // is kept as a data property of the instance
+        instance_templ->SetLazyDataProperty(
+            name, &V8PropertyGetter, External::New(isolate, pinfo),
+            pd.setter ? v8::None : v8::ReadOnly);
+        continue;
+      }
+
+      v8::AccessorNameGetterCallback getter = nullptr;
+      v8::AccessorNameSetterCallback setter = nullptr;
 
       if (pd.getter) {
         getter = &V8PropertyGetter;
@@ -85,15 +183,8 @@ JSClassTemplate::JSClassTemplate(Isolate* isolate,
         setter = &V8PropertySetter;
       }
 
-      object_templ->SetAccessor(ToV8String(isolate, pd.name), getter, setter,
+      object_templ->SetAccessor(name, getter, setter,
                                 External::New(isolate, pinfo));
-
-      pinfo->getter = pd.getter;
-      pinfo->setter = pd.setter;
-      pinfo->user_data = pd.user_data;
-      pinfo->flags = pd.flags;
-
-      pinfo->self = this;
     }
   }
 
@@ -106,23 +197,55 @@ JSClassTemplate::JSClassTemplate(Isolate* isolate,
         break;
       }
 
-      FunctionInfo* finfo = &functions_[i];
+      object_templ->Set(
+          ToV8String(isolate, fd.name),
+          FunctionTemplate::New(isolate, &V8FunctionCallback,
+                                External::New(isolate, &info->functions[i])));
+    }
+  }
 
-      object_templ->Set(ToV8String(isolate, fd.name),
-                        FunctionTemplate::New(isolate, &V8FunctionCallback,
-                                              External::New(isolate, finfo)));
+  return templ;
+}
 
-      finfo->function = fd.function;
-      finfo->user_data = fd.user_data;
-      finfo->self = this;
-      finfo->flags = fd.flags;
-    }
+Local<Template> JSClassTemplate::RestoreTemplate(Isolate* isolate) {
+  // the data index of a snapshot class is its id + 1, see
+  // AddSnapshotClasses
+  size_t index = static_cast<size_t>(snapshot_id_) + 1;
+  if (IsFunctionTemplate()) {
+    return isolate->GetDataFromSnapshotOnce<FunctionTemplate>(index)
+        .FromMaybe(Local<FunctionTemplate>());
   }
+  return isolate->GetDataFromSnapshotOnce<ObjectTemplate>(index)
+      .FromMaybe(Local<ObjectTemplate>());
+}
 
-  template_.Reset(isolate, templ);
+// the getter of a kFlagConstant property is called once, with a null self,
+// only a primitive value can be set on the template
+bool JSClassTemplate::SetConstantProperty(Isolate* isolate,
+                                          Local<ObjectTemplate> templ,
+                                          Local<String> name,
+                                          const JSPropertyDefinition& pd) {
+  JSValue value;
+  if (!pd.getter(JSEnvImpl::From(isolate), pd.user_data, nullptr, &value)) {
+    return false;
+  }
+
+  Local<Value> v8_value = ToV8Value(isolate, &value);
+  if (v8_value.IsEmpty() || v8_value->IsObject()) {
+    ALOGE(TAG, "the constant property %s is not a primitive, it's lazy",
+          pd.name);
+    return false;
+  }
+
+  templ->Set(name, v8_value,
+             static_cast<v8::PropertyAttribute>(v8::ReadOnly | v8::DontDelete));
+  return true;
 }
 
-void JSClassTemplate::InitMemberInfos(const JSClassDefinition* class_def) {
+JSClassTemplate::ClassInfo* JSClassTemplate::NewClassInfo(
+    const JSClassDefinition* class_def,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
   int prop_count = 0;
   int func_count = 0;
 
@@ -136,24 +259,334 @@ void JSClassTemplate::InitMemberInfos(const JSClassDefinition* class_def) {
       func_count++;
   }
 
-  properties_ = nullptr;
-  functions_ = nullptr;
+  // zeroed: no member, no interceptor and no profile entry
+  ClassInfo* info = new ClassInfo();
+
+  CopyFunction(class_def->constructor, &info->constructor);
+  info->constructor.user_data = class_def->constructor.user_data;
+  info->constructor.flags = class_def->constructor.flags;
+
+  if (named_handler) {
+    info->named_handler = *named_handler;
+  }
+
+  if (indexed_handler) {
+    info->indexed_handler = *indexed_handler;
+  }
 
   if (prop_count <= 0 && func_count <= 0) {
-    return;
+    return info;
   }
 
   uint8_t* ptr = new uint8_t[prop_count * sizeof(PropertyInfo) +
                              func_count * sizeof(FunctionInfo)];
 
   if (prop_count > 0) {
-    properties_ = reinterpret_cast<PropertyInfo*>(ptr);
+    info->properties = reinterpret_cast<PropertyInfo*>(ptr);
   }
 
   if (func_count > 0) {
-    functions_ = reinterpret_cast<FunctionInfo*>(
+    info->functions = reinterpret_cast<FunctionInfo*>(
         ptr + prop_count * sizeof(PropertyInfo));
   }
+
+  for (int i = 0; i < prop_count; i++) {
+    const JSPropertyDefinition& pd = class_def->properties[i];
+    PropertyInfo* pinfo = &info->properties[i];
+    pinfo->getter = pd.getter;
+    pinfo->setter = pd.setter;
+    pinfo->user_data = pd.user_data;
+    pinfo->flags = pd.flags;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    pinfo->getter_profile = nullptr;
+    pinfo->setter_profile = nullptr;
+#endif
+  }
+
+  for (int i = 0; i < func_count; i++) {
+    const JSFunctionDefinition& fd = class_def->functions[i];
+    FunctionInfo* finfo = &info->functions[i];
+    CopyFunction(fd, finfo);
+    finfo->user_data = fd.user_data;
+    finfo->flags = fd.flags;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    finfo->profile = nullptr;
+#endif
+  }
+
+  return info;
+}
+
+void JSClassTemplate::DeleteClassInfo(ClassInfo* info) {
+  if (info->properties) {
+    delete[] reinterpret_cast<uint8_t*>(info->properties);
+  } else if (info->functions) {
+    delete[] reinterpret_cast<uint8_t*>(info->functions);
+  }
+  delete info;
+}
+
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+void JSClassTemplate::InitProfileEntries(
+    Isolate* isolate,
+    const JSClassDefinition* class_define) {
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  CallbackProfiler* profiler = jsenv ? jsenv->callback_profiler() : nullptr;
+  if (profiler == nullptr) {
+    return;
+  }
+
+  info_->constructor.profile =
+      profiler->GetEntry(class_name_ + ".constructor");
+  info_->named_profile = profiler->GetEntry(class_name_ + "[name]");
+  info_->indexed_profile = profiler->GetEntry(class_name_ + "[index]");
+
+  if (class_define->properties) {
+    for (int i = 0; class_define->properties[i].name; i++) {
+      std::string member_name =
+          class_name_ + "." + class_define->properties[i].name;
+      info_->properties[i].getter_profile =
+          profiler->GetEntry(member_name + ":get");
+      info_->properties[i].setter_profile =
+          profiler->GetEntry(member_name + ":set");
+    }
+  }
+
+  if (class_define->functions) {
+    for (int i = 0; class_define->functions[i].name; i++) {
+      const char* name = class_define->functions[i].name;
+      info_->functions[i].profile =
+          profiler->GetEntry(class_name_ + "." + name);
+    }
+  }
+}
+#endif
+
+void JSClassTemplate::SetInterceptors(
+    Isolate* isolate,
+    Local<ObjectTemplate> instance_templ,
+    ClassInfo* info,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
+  if (named_handler) {
+    // the members of the class are found before the interceptors
+    v8::PropertyHandlerFlags flags = static_cast<v8::PropertyHandlerFlags>(
+        static_cast<int>(v8::PropertyHandlerFlags::kNonMasking) |
+        static_cast<int>(v8::PropertyHandlerFlags::kOnlyInterceptStrings));
+    instance_templ->SetHandler(v8::NamedPropertyHandlerConfiguration(
+        named_handler->getter ? V8NamedGetter : nullptr,
+        named_handler->setter ? V8NamedSetter : nullptr,
+        named_handler->query ? V8NamedQuery : nullptr,
+        named_handler->deleter ? V8NamedDeleter : nullptr,
+        named_handler->enumerator ? V8NamedEnumerator : nullptr,
+        External::New(isolate, info), flags));
+  }
+
+  if (indexed_handler) {
+    instance_templ->SetHandler(v8::IndexedPropertyHandlerConfiguration(
+        indexed_handler->getter ? V8IndexedGetter : nullptr,
+        indexed_handler->setter ? V8IndexedSetter : nullptr,
+        indexed_handler->query ? V8IndexedQuery : nullptr,
+        indexed_handler->deleter ? V8IndexedDeleter : nullptr,
+        indexed_handler->enumerator ? V8IndexedEnumerator : nullptr,
+        External::New(isolate, info)));
+  }
+}
+
+void JSClassTemplate::AddExternalReferences(std::vector<intptr_t>* prefs) {
+  const intptr_t refs[] = {
+      reinterpret_cast<intptr_t>(V8PropertyGetter),
+      reinterpret_cast<intptr_t>(V8PropertySetter),
+      reinterpret_cast<intptr_t>(V8FunctionCallback),
+      reinterpret_cast<intptr_t>(V8NamedGetter),
+      reinterpret_cast<intptr_t>(V8NamedSetter),
+      reinterpret_cast<intptr_t>(V8NamedQuery),
+      reinterpret_cast<intptr_t>(V8NamedDeleter),
+      reinterpret_cast<intptr_t>(V8NamedEnumerator),
+      reinterpret_cast<intptr_t>(V8IndexedGetter),
+      reinterpret_cast<intptr_t>(V8IndexedSetter),
+      reinterpret_cast<intptr_t>(V8IndexedQuery),
+      reinterpret_cast<intptr_t>(V8IndexedDeleter),
+      reinterpret_cast<intptr_t>(V8IndexedEnumerator),
+  };
+  prefs->insert(prefs->end(), std::begin(refs), std::end(refs));
+
+  // the External data of the templates of the snapshot classes
+  SnapshotRegistry* registry = GetSnapshotRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  registry->sealed = true;
+  for (const SnapshotClass& snapshot : registry->classes) {
+    const JSClassDefinition* class_define = snapshot.class_define;
+    ClassInfo* info = snapshot.info;
+    prefs->push_back(reinterpret_cast<intptr_t>(info));
+    prefs->push_back(reinterpret_cast<intptr_t>(&info->constructor));
+    for (int i = 0;
+         class_define->properties && class_define->properties[i].name; i++) {
+      prefs->push_back(reinterpret_cast<intptr_t>(&info->properties[i]));
+    }
+    for (int i = 0;
+         class_define->functions && class_define->functions[i].name; i++) {
+      prefs->push_back(reinterpret_cast<intptr_t>(&info->functions[i]));
+    }
+  }
+}
+
+JSClassTemplate::SnapshotRegistry* JSClassTemplate::GetSnapshotRegistry() {
+  static SnapshotRegistry* registry = new SnapshotRegistry();
+  return registry;
+}
+
+int JSClassTemplate::GetSnapshotClass(
+    const JSClassDefinition* class_define,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler,
+    SnapshotClass* psnapshot) {
+  SnapshotRegistry* registry = GetSnapshotRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  int id = FindSnapshotClass(class_define, named_handler, indexed_handler);
+  if (id >= 0) {
+    *psnapshot = registry->classes[id];
+  }
+  return id;
+}
+
+int JSClassTemplate::FindSnapshotClass(
+    const JSClassDefinition* class_define,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
+  const std::vector<SnapshotClass>& classes = GetSnapshotRegistry()->classes;
+  for (size_t i = 0; i < classes.size(); i++) {
+    const SnapshotClass& snapshot = classes[i];
+    if (snapshot.class_define == class_define &&
+        SameHandler(named_handler, snapshot.has_named_handler,
+                    snapshot.info->named_handler) &&
+        SameHandler(indexed_handler, snapshot.has_indexed_handler,
+                    snapshot.info->indexed_handler)) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+int JSClassTemplate::RegisterSnapshotClass(
+    const JSClassDefinition* class_define,
+    int super_id,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
+  if (class_define == nullptr) {
+    return -1;
+  }
+
+  SnapshotRegistry* registry = GetSnapshotRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  if (registry->sealed) {
+    ALOGE(TAG, "the snapshot class %s is registered too late",
+          class_define->class_name ? class_define->class_name : "");
+    return -1;
+  }
+
+  if (super_id < 0) {
+    super_id = -1;
+  } else if (super_id >= static_cast<int>(registry->classes.size()) ||
+             !HasFunction(registry->classes[super_id].info->constructor) ||
+             !HasFunction(class_define->constructor)) {
+    return -1;
+  }
+
+  int id = FindSnapshotClass(class_define, named_handler, indexed_handler);
+  if (id >= 0) {
+    return registry->classes[id].super_id == super_id ? id : -1;
+  }
+
+  SnapshotClass snapshot;
+  snapshot.class_define = class_define;
+  snapshot.super_id = super_id;
+  snapshot.has_named_handler = named_handler != nullptr;
+  snapshot.has_indexed_handler = indexed_handler != nullptr;
+  snapshot.info = NewClassInfo(class_define, named_handler, indexed_handler);
+  registry->classes.push_back(snapshot);
+  return static_cast<int>(registry->classes.size()) - 1;
+}
+
+std::string JSClassTemplate::GetSnapshotMarker() {
+  std::string marker = "jsenv snapshot " + std::to_string(JSENV_VERSION);
+  for (const SnapshotClass& snapshot : GetSnapshotRegistry()->classes) {
+    marker += ' ';
+    if (snapshot.class_define->class_name) {
+      marker += snapshot.class_define->class_name;
+    }
+  }
+  return marker;
+}
+
+bool JSClassTemplate::AddSnapshotClasses(v8::SnapshotCreator* creator) {
+  SnapshotRegistry* registry = GetSnapshotRegistry();
+  {
+    // sealed by the external references of |creator|
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    if (!registry->sealed) {
+      return false;
+    }
+  }
+
+  Isolate* isolate = creator->GetIsolate();
+  HandleScope handle_scope(isolate);
+  const std::vector<SnapshotClass>& classes = registry->classes;
+  std::vector<Local<Template>> templates;
+
+  Local<String> marker = ToV8String(isolate, GetSnapshotMarker().c_str());
+  if (creator->AddData(marker) != 0) {
+    ALOGE(TAG, "the snapshot marker is not the data 0");
+    return false;
+  }
+
+  for (const SnapshotClass& snapshot : classes) {
+    Local<FunctionTemplate> parent;
+    if (snapshot.super_id >= 0) {
+      parent = templates[snapshot.super_id].As<FunctionTemplate>();
+    }
+
+    ClassInfo* info = snapshot.info;
+    Local<Template> templ = NewTemplate(
+        isolate, snapshot.class_define, info, parent,
+        snapshot.has_named_handler ? &info->named_handler : nullptr,
+        snapshot.has_indexed_handler ? &info->indexed_handler : nullptr);
+
+    size_t index = creator->AddData(templ);
+    if (index != templates.size() + 1) {
+      ALOGE(TAG, "the snapshot class %zu is the data %zu, not its id + 1",
+            templates.size(), index);
+      return false;
+    }
+    templates.push_back(templ);
+  }
+  return true;
+}
+
+bool JSClassTemplate::ReadSnapshotMarker(Isolate* isolate) {
+  SnapshotRegistry* registry = GetSnapshotRegistry();
+  {
+    // the isolate of a snapshot is made with the external references
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    if (!registry->sealed || registry->classes.empty()) {
+      return false;
+    }
+  }
+
+  // a foreign snapshot may hold anything at the data 0
+  HandleScope handle_scope(isolate);
+  Local<Value> marker;
+  if (!isolate->GetDataFromSnapshotOnce<Value>(0).ToLocal(&marker) ||
+      !marker->IsString()) {
+    return false;
+  }
+
+  String::Utf8Value utf8(isolate, marker);
+  if (*utf8 == nullptr || GetSnapshotMarker() != *utf8) {
+    ALOGE(TAG, "the snapshot was not made with the registered classes");
+    return false;
+  }
+  return true;
 }
 
 Local<Object> JSClassTemplate::NewObject(v8::Local<Context> context) {
@@ -172,19 +605,77 @@ Local<Object> JSClassTemplate::NewObject(v8::Local<Context> context) {
   }
 
   if (!object.IsEmpty() && finalize_ != nullptr) {
-    // Set WeakReference
-    v8::NonCopyablePersistentTraits<Object>::NonCopyablePersistent weak_ref(
-        context->GetIsolate(), object);
-
-    weak_ref.SetWeak(this, &V8FinalizeCallback,
-                     WeakCallbackType::kInternalFields);
-    // ignore the weak handle.
+    AddInstance(context->GetIsolate(), object);
   }
   return object;
 }
 
+int JSClassTemplate::NewObjects(Local<Context> context,
+                                int count,
+                                Local<Object>* objects,
+                                void* const* private_data) {
+  Isolate* isolate = context->GetIsolate();
+  Local<ObjectTemplate> object_template = GetObjectTemplate(isolate);
+
+  if (object_template.IsEmpty()) {
+    ALOGE("JSENV", "Get Null ObjectTemplate");
+    return 0;
+  }
+
+  int made = 0;
+  for (; made < count; made++) {
+    if (!object_template->NewInstance(context).ToLocal(&objects[made])) {
+      ALOGE("JSENV", "Create ObjectTemplate Null object");
+      break;
+    }
+    if (private_data) {
+      objects[made]->SetAlignedPointerInInternalField(0, private_data[made]);
+    }
+  }
+
+  if (finalize_ != nullptr) {
+    for (int i = 0; i < made; i++) {
+      AddInstance(isolate, objects[i]);
+    }
+  }
+  return made;
+}
+
+void JSClassTemplate::AddInstance(Isolate* isolate, Local<Object> object) {
+  WeakInstance* instance = new WeakInstance();
+  instance->self = this;
+  instance->handle.Reset(isolate, object);
+  instance->handle.SetWeak(instance, &V8FinalizeCallback,
+                           WeakCallbackType::kInternalFields);
+  instance->prev = nullptr;
+  instance->next = instances_;
+  if (instances_) {
+    instances_->prev = instance;
+  }
+  instances_ = instance;
+}
+
+void JSClassTemplate::RemoveInstance(WeakInstance* instance) {
+  if (instance->prev) {
+    instance->prev->next = instance->next;
+  } else {
+    instances_ = instance->next;
+  }
+  if (instance->next) {
+    instance->next->prev = instance->prev;
+  }
+  delete instance;
+}
+
+void JSClassTemplate::ReleaseInstances() {
+  while (instances_) {
+    instances_->handle.Reset();
+    RemoveInstance(instances_);
+  }
+}
+
 void JSClassTemplate::V8PropertyGetter(
-    Local<String> property_name,
+    Local<Name> property_name,
     const PropertyCallbackInfo<Value>& info) {
   Isolate* isolate = info.GetIsolate();
   PropertyInfo* pinfo = GetMemberInfo<PropertyInfo>(info.Data());
@@ -193,9 +684,13 @@ void JSClassTemplate::V8PropertyGetter(
 
   JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
 
+  JSENV_PROFILE_SCOPE(pinfo->getter_profile);
   JSValue js_value;
 
-  if (!pinfo->getter(jsenv, pinfo->user_data, self, &js_value)) {
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = pinfo->getter(jsenv, pinfo->user_data, self, &js_value);
+  JSENV_PROFILE_END_CALLBACK();
+  if (!bret) {
     return;
   }
 
@@ -204,7 +699,7 @@ void JSClassTemplate::V8PropertyGetter(
   info.GetReturnValue().Set(v8_value);
 }
 
-void JSClassTemplate::V8PropertySetter(Local<String> property_name,
+void JSClassTemplate::V8PropertySetter(Local<Name> property_name,
                                        Local<Value> value,
                                        const PropertyCallbackInfo<void>& info) {
   Isolate* isolate = info.GetIsolate();
@@ -212,15 +707,20 @@ void JSClassTemplate::V8PropertySetter(Local<String> property_name,
 
   JSObject self = ToJSObject(info.This());
 
-  JSValue js_value;
-
   JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
 
-  if (!ToJSValue(isolate, &js_value, value, pinfo->flags)) {
+  JSENV_PROFILE_SCOPE(pinfo->setter_profile);
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSArena::Scope arena_scope(arena);
+  JSValue js_value;
+
+  if (!ToJSValue(isolate, &js_value, value, pinfo->flags, arena)) {
     return;
   }
 
+  JSENV_PROFILE_BEGIN_CALLBACK();
   pinfo->setter(jsenv, pinfo->user_data, self, &js_value);
+  JSENV_PROFILE_END_CALLBACK();
 }
 
 void JSClassTemplate::V8FunctionCallback(
@@ -232,17 +732,30 @@ void JSClassTemplate::V8FunctionCallback(
   JSObject self = ToJSObject(args.This());
 
   JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
-
-  Arguments<> arguments(args.Length(), finfo->flags);
-
-  for (int i = 0; i < args.Length(); i++) {
-    arguments.Add(isolate, args[i]);
-  }
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSENV_PROFILE_SCOPE(finfo->profile);
 
   JSValue result;
+  bool bret;
+
+  if (finfo->flags & JSEnv::kFlagLazyArgs) {
+    LazyArguments arguments(&args, finfo->flags, arena);
+    JSENV_PROFILE_BEGIN_CALLBACK();
+    bret = finfo->lazy_function(jsenv, finfo->user_data, self,
+                                arguments.ToJSArgs(), &result);
+    JSENV_PROFILE_END_CALLBACK();
+  } else {
+    Arguments<> arguments(args.Length(), finfo->flags, arena);
 
-  bool bret = finfo->function(jsenv, finfo->user_data, self, arguments.args,
-                              arguments.argc, &result);
+    for (int i = 0; i < args.Length(); i++) {
+      arguments.Add(isolate, args[i]);
+    }
+
+    JSENV_PROFILE_BEGIN_CALLBACK();
+    bret = finfo->function(jsenv, finfo->user_data, self, arguments.args,
+                           arguments.argc, &result);
+    JSENV_PROFILE_END_CALLBACK();
+  }
 
   if (jsenv->ThrowExceptionToV8()) {
     return;
@@ -257,13 +770,295 @@ void JSClassTemplate::V8FunctionCallback(
   args.GetReturnValue().Set(v8_result);
 }
 
+// interceptors
+void JSClassTemplate::V8NamedGetter(Local<Name> property,
+                                    const PropertyCallbackInfo<Value>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSNamedPropertyHandler& handler = self->named_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSENV_PROFILE_SCOPE(self->named_profile);
+  JSArena::Scope arena_scope(arena);
+
+  JSValue name;
+  if (!ToJSValue(isolate, &name, property, handler.flags, arena)) {
+    return;
+  }
+
+  JSValue js_value;
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.getter(jsenv, handler.user_data, ToJSObject(info.This()),
+                             &name, &js_value);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(ToV8Value(isolate, &js_value));
+}
+
+void JSClassTemplate::V8NamedSetter(Local<Name> property,
+                                    Local<Value> value,
+                                    const PropertyCallbackInfo<Value>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSNamedPropertyHandler& handler = self->named_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSENV_PROFILE_SCOPE(self->named_profile);
+  JSArena::Scope arena_scope(arena);
+
+  JSValue name;
+  JSValue js_value;
+  if (!ToJSValue(isolate, &name, property, handler.flags, arena) ||
+      !ToJSValue(isolate, &js_value, value, handler.flags, arena)) {
+    return;
+  }
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.setter(jsenv, handler.user_data, ToJSObject(info.This()),
+                             &name, &js_value);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  // intercepted, the object is not changed
+  info.GetReturnValue().Set(value);
+}
+
+void JSClassTemplate::V8NamedQuery(Local<Name> property,
+                                   const PropertyCallbackInfo<Integer>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSNamedPropertyHandler& handler = self->named_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSENV_PROFILE_SCOPE(self->named_profile);
+  JSArena::Scope arena_scope(arena);
+
+  JSValue name;
+  if (!ToJSValue(isolate, &name, property, handler.flags, arena)) {
+    return;
+  }
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.query(jsenv, handler.user_data, ToJSObject(info.This()),
+                            &name);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(v8::None);
+}
+
+void JSClassTemplate::V8NamedDeleter(
+    Local<Name> property,
+    const PropertyCallbackInfo<v8::Boolean>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSNamedPropertyHandler& handler = self->named_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSENV_PROFILE_SCOPE(self->named_profile);
+  JSArena::Scope arena_scope(arena);
+
+  JSValue name;
+  if (!ToJSValue(isolate, &name, property, handler.flags, arena)) {
+    return;
+  }
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.deleter(jsenv, handler.user_data,
+                              ToJSObject(info.This()), &name);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(true);
+}
+
+void JSClassTemplate::V8NamedEnumerator(
+    const PropertyCallbackInfo<v8::Array>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSNamedPropertyHandler& handler = self->named_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSENV_PROFILE_SCOPE(self->named_profile);
+
+  JSValue names;
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.enumerator(jsenv, handler.user_data,
+                                 ToJSObject(info.This()), &names);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  Local<Value> v8_names = ToV8Value(isolate, &names);
+  if (!v8_names.IsEmpty() && v8_names->IsArray()) {
+    info.GetReturnValue().Set(v8_names.As<v8::Array>());
+  }
+}
+
+void JSClassTemplate::V8IndexedGetter(
+    uint32_t index,
+    const PropertyCallbackInfo<Value>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSIndexedPropertyHandler& handler = self->indexed_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSENV_PROFILE_SCOPE(self->indexed_profile);
+
+  JSValue js_value;
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.getter(jsenv, handler.user_data, ToJSObject(info.This()),
+                             index, &js_value);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(ToV8Value(isolate, &js_value));
+}
+
+void JSClassTemplate::V8IndexedSetter(
+    uint32_t index,
+    Local<Value> value,
+    const PropertyCallbackInfo<Value>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSIndexedPropertyHandler& handler = self->indexed_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSArena* arena = jsenv ? jsenv->callback_arena() : nullptr;
+  JSENV_PROFILE_SCOPE(self->indexed_profile);
+  JSArena::Scope arena_scope(arena);
+
+  JSValue js_value;
+  if (!ToJSValue(isolate, &js_value, value, handler.flags, arena)) {
+    return;
+  }
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.setter(jsenv, handler.user_data, ToJSObject(info.This()),
+                             index, &js_value);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(value);
+}
+
+void JSClassTemplate::V8IndexedQuery(
+    uint32_t index,
+    const PropertyCallbackInfo<Integer>& info) {
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSIndexedPropertyHandler& handler = self->indexed_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(info.GetIsolate());
+  JSENV_PROFILE_SCOPE(self->indexed_profile);
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.query(jsenv, handler.user_data, ToJSObject(info.This()),
+                            index);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(v8::None);
+}
+
+void JSClassTemplate::V8IndexedDeleter(
+    uint32_t index,
+    const PropertyCallbackInfo<v8::Boolean>& info) {
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSIndexedPropertyHandler& handler = self->indexed_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(info.GetIsolate());
+  JSENV_PROFILE_SCOPE(self->indexed_profile);
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = handler.deleter(jsenv, handler.user_data,
+                              ToJSObject(info.This()), index);
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8() || !bret) {
+    return;
+  }
+
+  info.GetReturnValue().Set(true);
+}
+
+// the indexes 0 to count - 1, only built when the object is enumerated
+void JSClassTemplate::V8IndexedEnumerator(
+    const PropertyCallbackInfo<v8::Array>& info) {
+  Isolate* isolate = info.GetIsolate();
+  ClassInfo* self = GetMemberInfo<ClassInfo>(info.Data());
+  const JSIndexedPropertyHandler& handler = self->indexed_handler;
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(isolate);
+  JSENV_PROFILE_SCOPE(self->indexed_profile);
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  uint32_t count =
+      handler.enumerator(jsenv, handler.user_data, ToJSObject(info.This()));
+  JSENV_PROFILE_END_CALLBACK();
+
+  if (jsenv->ThrowExceptionToV8()) {
+    return;
+  }
+
+  Local<Context> context = isolate->GetCurrentContext();
+  Local<v8::Array> indexes = v8::Array::New(isolate, count);
+  for (uint32_t i = 0; i < count; i++) {
+    if (indexes->Set(context, i, Integer::NewFromUnsigned(isolate, i))
+            .IsNothing()) {
+      return;
+    }
+  }
+  info.GetReturnValue().Set(indexes);
+}
+
 void JSClassTemplate::V8FinalizeCallback(
-    const WeakCallbackInfo<JSClassTemplate>& info) {
-  JSClassTemplate* self_weak = info.GetParameter();
+    const WeakCallbackInfo<WeakInstance>& info) {
+  WeakInstance* instance = info.GetParameter();
+  JSClassTemplate* self = instance->self;
+
+  // the first pass callback must reset the handle
+  instance->handle.Reset();
+  self->RemoveInstance(instance);
 
-  if (self_weak && self_weak->finalize_) {
-    self_weak->finalize_(info.GetInternalField(0), info.GetInternalField(1));
+  JSEnvImpl* jsenv = JSEnvImpl::From(info.GetIsolate());
+  if (self->finalize_mode_ == 0 || jsenv == nullptr) {
+    self->finalize_(info.GetInternalField(0), info.GetInternalField(1));
+    return;
   }
+
+  FinalizerQueue::Finalizer finalizer = {
+      self->finalize_, info.GetInternalField(0), info.GetInternalField(1),
+      FinalizerQueue::NowNanos()};
+  jsenv->QueueFinalizer(finalizer,
+                        self->finalize_mode_ & JSEnv::kFlagBackgroundFinalize);
 }
 
 }  // namespace hybrid
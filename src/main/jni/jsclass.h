@@ -6,41 +6,58 @@
 #ifndef HYBRID_JSCLASS_H_
 #define HYBRID_JSCLASS_H_
 
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
 #include "v8.h"
 
 #include "j2v8-runtime.h"
+#include "jsarena.h"
+#include "jscallback_profiler.h"
 #include "jsvalue_impl.h"
 
 namespace hybrid {
 
+// the member of the callback union selected by kFlagLazyArgs, of a
+// JSFunctionDefinition or a JSClassTemplate::FunctionInfo
+template <typename T>
+inline bool HasFunction(const T& fd) {
+  return (fd.flags & JSEnv::kFlagLazyArgs) ? fd.lazy_function != nullptr
+                                           : fd.function != nullptr;
+}
+
 class JSClassTemplate {
  public:
-  static JSClassTemplate* Create(v8::Isolate* isolate,
-                                 const JSClassDefinition* class_define,
-                                 JSClassTemplate* parent) {
+  static JSClassTemplate* Create(
+      v8::Isolate* isolate,
+      const JSClassDefinition* class_define,
+      JSClassTemplate* parent,
+      const JSNamedPropertyHandler* named_handler = nullptr,
+      const JSIndexedPropertyHandler* indexed_handler = nullptr) {
     if (class_define == nullptr) {
       return nullptr;
     }
 
     if (parent &&
-        !(parent->IsFunctionTemplate() && class_define->constructor.function)) {
+        !(parent->IsFunctionTemplate() &&
+          HasFunction(class_define->constructor))) {
       return nullptr;
     }
 
-    return new JSClassTemplate(isolate, class_define, parent);
+    return new JSClassTemplate(isolate, class_define, parent, named_handler,
+                               indexed_handler);
   }
 
   ~JSClassTemplate() {
-    if (properties_) {
-      delete[] reinterpret_cast<uint8_t*>(properties_);
-    } else {
-      if (functions_) {
-        delete[] reinterpret_cast<uint8_t*>(functions_);
-      }
+    ReleaseInstances();
+    if (owns_info_) {
+      DeleteClassInfo(info_);
     }
   }
 
-  bool IsFunctionTemplate() const { return constructor_.function != nullptr; }
+  bool IsFunctionTemplate() const { return HasFunction(info_->constructor); }
 
   v8::Local<v8::FunctionTemplate> GetFunctionTemplate(v8::Isolate* isolate) {
     if (IsFunctionTemplate()) {
@@ -74,6 +91,11 @@ class JSClassTemplate {
   }
 
   v8::Local<v8::Object> NewObject(v8::Local<v8::Context> context);
+  // returns the number of the objects made, |private_data| may be null
+  int NewObjects(v8::Local<v8::Context> context,
+                 int count,
+                 v8::Local<v8::Object>* objects,
+                 void* const* private_data);
 
   static inline JSClassTemplate* From(JSClass clazz) {
     return reinterpret_cast<JSClassTemplate*>(clazz);
@@ -87,23 +109,86 @@ class JSClassTemplate {
 
   const std::string& GetName() const { return class_name_; }
 
+  // drops the weak handles of the live instances, they're not finalized
+  void ReleaseInstances();
+
+  // the callbacks of the templates and the member tables of the snapshot
+  // classes, see GetExternalReferences. No class is registered after it.
+  static void AddExternalReferences(std::vector<intptr_t>* prefs);
+
+  // snapshot classes, see JSEnv::RegisterSnapshotClass
+  // returns the id, or -1
+  static int RegisterSnapshotClass(
+      const JSClassDefinition* class_define,
+      int super_id,
+      const JSNamedPropertyHandler* named_handler,
+      const JSIndexedPropertyHandler* indexed_handler);
+  // adds the marker of the registered classes and their templates to
+  // |creator|, the data index of a class is its id + 1: nothing may be added
+  // before them
+  static bool AddSnapshotClasses(v8::SnapshotCreator* creator);
+  // reads the marker of the snapshot of |isolate|, it's consumed: true if
+  // the snapshot was made by AddSnapshotClasses with the classes registered
+  // by this process
+  static bool ReadSnapshotMarker(v8::Isolate* isolate);
+
  private:
   JSClassTemplate(v8::Isolate* isolate,
                   const JSClassDefinition* class_define,
-                  JSClassTemplate* parent);
+                  JSClassTemplate* parent,
+                  const JSNamedPropertyHandler* named_handler,
+                  const JSIndexedPropertyHandler* indexed_handler);
 
-  static void V8PropertyGetter(v8::Local<v8::String> property_name,
+  static void V8PropertyGetter(v8::Local<v8::Name> property_name,
                                const v8::PropertyCallbackInfo<v8::Value>& info);
 
-  static void V8PropertySetter(v8::Local<v8::String> property_name,
+  static void V8PropertySetter(v8::Local<v8::Name> property_name,
                                v8::Local<v8::Value> value,
                                const v8::PropertyCallbackInfo<void>& info);
 
   static void V8FunctionCallback(
       const v8::FunctionCallbackInfo<v8::Value>& info);
 
+  static void V8NamedGetter(v8::Local<v8::Name> property,
+                            const v8::PropertyCallbackInfo<v8::Value>& info);
+  static void V8NamedSetter(v8::Local<v8::Name> property,
+                            v8::Local<v8::Value> value,
+                            const v8::PropertyCallbackInfo<v8::Value>& info);
+  static void V8NamedQuery(v8::Local<v8::Name> property,
+                           const v8::PropertyCallbackInfo<v8::Integer>& info);
+  static void V8NamedDeleter(
+      v8::Local<v8::Name> property,
+      const v8::PropertyCallbackInfo<v8::Boolean>& info);
+  static void V8NamedEnumerator(
+      const v8::PropertyCallbackInfo<v8::Array>& info);
+
+  static void V8IndexedGetter(uint32_t index,
+                              const v8::PropertyCallbackInfo<v8::Value>& info);
+  static void V8IndexedSetter(uint32_t index,
+                              v8::Local<v8::Value> value,
+                              const v8::PropertyCallbackInfo<v8::Value>& info);
+  static void V8IndexedQuery(uint32_t index,
+                             const v8::PropertyCallbackInfo<v8::Integer>& info);
+  static void V8IndexedDeleter(
+      uint32_t index,
+      const v8::PropertyCallbackInfo<v8::Boolean>& info);
+  static void V8IndexedEnumerator(
+      const v8::PropertyCallbackInfo<v8::Array>& info);
+
+  // the weak handle of an instance of a class with a finalizer, it's freed
+  // by the GC callback or by ReleaseInstances
+  struct WeakInstance {
+    JSClassTemplate* self;
+    v8::Global<v8::Object> handle;
+    WeakInstance* prev;
+    WeakInstance* next;
+  };
+
   static void V8FinalizeCallback(
-      const v8::WeakCallbackInfo<JSClassTemplate>& info);
+      const v8::WeakCallbackInfo<WeakInstance>& info);
+
+  void AddInstance(v8::Isolate* isolate, v8::Local<v8::Object> object);
+  void RemoveInstance(WeakInstance* instance);
 
   template <typename T>
   static T* GetMemberInfo(v8::Local<v8::Value> data) {
@@ -114,40 +199,148 @@ class JSClassTemplate {
   }
 
   struct PropertyInfo {
-    JSClassTemplate* self;
     JSPropertyGetCallback getter;
     JSPropertySetCallback setter;
     void* user_data;
     uint32_t flags;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    CallbackProfiler::Entry* getter_profile;
+    CallbackProfiler::Entry* setter_profile;
+#endif
   };
 
   struct FunctionInfo {
-    JSClassTemplate* self;
-    JSFunctionCallback function;
+    // like JSFunctionDefinition, |lazy_function| with kFlagLazyArgs
+    union {
+      JSFunctionCallback function;
+      JSLazyFunctionCallback lazy_function;
+    };
     void* user_data;
     uint32_t flags;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    CallbackProfiler::Entry* profile;
+#endif
+  };
+
+  // The External data of the templates of a class: of the constructor, of
+  // the members and (the ClassInfo itself) of the interceptors. It's owned
+  // by the JSClassTemplate, or it's the one of a registered snapshot class,
+  // shared by the isolates of the process, and its addresses are external
+  // references.
+  struct ClassInfo {
+    PropertyInfo* properties;
+    FunctionInfo* functions;
+    FunctionInfo constructor;
+
+    // the interceptors of the instances, the callbacks are null if unset
+    JSNamedPropertyHandler named_handler;
+    JSIndexedPropertyHandler indexed_handler;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    CallbackProfiler::Entry* named_profile;
+    CallbackProfiler::Entry* indexed_profile;
+#endif
+  };
+
+  // a class registered by RegisterSnapshotClass, the id is its index
+  struct SnapshotClass {
+    const JSClassDefinition* class_define;
+    int super_id;
+    bool has_named_handler;
+    bool has_indexed_handler;
+    ClassInfo* info;
   };
 
-  void InitMemberInfos(const JSClassDefinition* class_define);
+  // the classes aren't changed once it's sealed, they're read without the
+  // lock then
+  struct SnapshotRegistry {
+    std::mutex mutex;
+    std::vector<SnapshotClass> classes;
+    // set by AddExternalReferences
+    bool sealed;
+  };
+
+  static SnapshotRegistry* GetSnapshotRegistry();
+  // the id of the registered |class_define| with these handlers, or -1. The
+  // registry is locked.
+  static int FindSnapshotClass(const JSClassDefinition* class_define,
+                               const JSNamedPropertyHandler* named_handler,
+                               const JSIndexedPropertyHandler* indexed_handler);
+  // FindSnapshotClass with the lock, the class is copied to |psnapshot|
+  static int GetSnapshotClass(const JSClassDefinition* class_define,
+                              const JSNamedPropertyHandler* named_handler,
+                              const JSIndexedPropertyHandler* indexed_handler,
+                              SnapshotClass* psnapshot);
+  // the data 0 of a snapshot of the classes, the registry is sealed
+  static std::string GetSnapshotMarker();
+
+  static ClassInfo* NewClassInfo(
+      const JSClassDefinition* class_define,
+      const JSNamedPropertyHandler* named_handler,
+      const JSIndexedPropertyHandler* indexed_handler);
+  static void DeleteClassInfo(ClassInfo* info);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  void InitProfileEntries(v8::Isolate* isolate,
+                          const JSClassDefinition* class_define);
+#endif
+
+  // |parent| is empty without a super class, the handlers are null if unset
+  static v8::Local<v8::Template> NewTemplate(
+      v8::Isolate* isolate,
+      const JSClassDefinition* class_define,
+      ClassInfo* info,
+      v8::Local<v8::FunctionTemplate> parent,
+      const JSNamedPropertyHandler* named_handler,
+      const JSIndexedPropertyHandler* indexed_handler);
+  // the template of a snapshot class from the snapshot of the isolate, empty
+  // if it has none
+  v8::Local<v8::Template> RestoreTemplate(v8::Isolate* isolate);
+  static bool SetConstantProperty(v8::Isolate* isolate,
+                                  v8::Local<v8::ObjectTemplate> templ,
+                                  v8::Local<v8::String> name,
+                                  const JSPropertyDefinition& pd);
+  static void SetInterceptors(v8::Isolate* isolate,
+                              v8::Local<v8::ObjectTemplate> instance_templ,
+                              ClassInfo* info,
+                              const JSNamedPropertyHandler* named_handler,
+                              const JSIndexedPropertyHandler* indexed_handler);
 
   v8::Persistent<v8::Template> template_;
   JSFinalizeCallback finalize_;
+  // kFlagDeferredFinalize or kFlagBackgroundFinalize, 0 to finalize in the
+  // GC callback
+  uint32_t finalize_mode_;
+  WeakInstance* instances_;
   std::string class_name_;
-  FunctionInfo constructor_;
 
-  PropertyInfo* properties_;
-  FunctionInfo* functions_;
+  ClassInfo* info_;
+  bool owns_info_;
+  // the id of the snapshot class, -1 if it's not registered
+  int snapshot_id_;
+  // the templates are restored from the snapshot of the isolate
+  bool restored_;
 };
 
+// The arguments of a native callback. With an arena the JSValue array (when
+// it does not fit in baseargs) and the strings are allocated from it and are
+// released in one step when the Arguments goes out of scope.
 template <int MAX = 16>
 struct Arguments {
   JSValue* args;
   int argc;
   uint32_t flags;
 
-  Arguments(int max, uint32_t flags) {
+  Arguments(int max, uint32_t flags, JSArena* arena = nullptr)
+      : arena_scope_(arena), arena_(arena), max_(max), args_in_arena_(false) {
     if (max > MAX) {
-      args = new JSValue[max];
+      args = arena ? arena->AllocateArray<JSValue>(max) : nullptr;
+      if (args) {
+        for (int i = 0; i < max; i++) {
+          new (&args[i]) JSValue();
+        }
+        args_in_arena_ = true;
+      } else {
+        args = new JSValue[max];
+      }
     } else {
       args = baseargs;
     }
@@ -157,19 +350,73 @@ struct Arguments {
   }
 
   ~Arguments() {
-    if (args != baseargs) {
+    if (args == baseargs) {
+      return;
+    }
+
+    if (args_in_arena_) {
+      for (int i = 0; i < max_; i++) {
+        args[i].~JSValue();
+      }
+    } else {
       delete[] args;
     }
   }
 
   bool Add(v8::Isolate* isolate, v8::Local<v8::Value> value) {
-    return ToJSValue(isolate, &args[argc++], value, flags);
+    return ToJSValue(isolate, &args[argc++], value, flags, arena_);
   }
 
  private:
+  // declared first, the arena is reset after the values are destroyed
+  JSArena::Scope arena_scope_;
+  JSArena* arena_;
+  int max_;
+  bool args_in_arena_;
   JSValue baseargs[MAX];
 };
 
+// The arguments of a JSLazyFunctionCallback, an argument is converted when
+// it's got. The strings are allocated from the arena until it's destroyed.
+class LazyArguments {
+ public:
+  LazyArguments(const v8::FunctionCallbackInfo<v8::Value>* info,
+                uint32_t flags,
+                JSArena* arena)
+      : arena_scope_(arena), info_(info), flags_(flags), arena_(arena) {}
+
+  static inline LazyArguments* From(JSArgs args) {
+    return reinterpret_cast<LazyArguments*>(args);
+  }
+
+  inline JSArgs ToJSArgs() { return reinterpret_cast<JSArgs>(this); }
+
+  int Length() const { return info_->Length(); }
+
+  // undefined if it's out of range
+  int GetType(int index) const {
+    return GetV8ValueType((*info_)[index], flags_);
+  }
+
+  // an object is typed like GetType, not as a plain kJSObject
+  bool Get(int index, JSValue* pvalue) const {
+    v8::Local<v8::Value> v8_value = (*info_)[index];
+    if (!ToJSValue(info_->GetIsolate(), pvalue, v8_value, flags_, arena_)) {
+      return false;
+    }
+    if (pvalue->IsObject()) {
+      pvalue->type = GetV8ObjectType(v8_value.As<v8::Object>());
+    }
+    return true;
+  }
+
+ private:
+  JSArena::Scope arena_scope_;
+  const v8::FunctionCallbackInfo<v8::Value>* info_;
+  uint32_t flags_;
+  JSArena* arena_;
+};
+
 template <int MAX = 16>
 struct V8Arguments {
   v8::Local<v8::Value>* args;
@@ -186,6 +433,9 @@ struct V8Arguments {
     this->argc = argc;
     for (int i = 0; i < argc; i++) {
       this->args[i] = ToV8Value(isolate, &args[i]);
+      if (this->args[i].IsEmpty()) {
+        this->args[i] = v8::Null(isolate);
+      }
     }
   }
 
@@ -7,13 +7,24 @@
 #include "jsenv-impl.h"
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <libplatform/libplatform.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <type_traits>
 #include <sstream>
 #include <string>
 
+#include "base/time/time.h"
 #include "hybrid-log.h"
 #include "inspector-js-api.h"
 #include "inspector-proxy.h"
+#include "jsserialized_data.h"
 #include "jsvalue_impl.h"
 #include "logcat-console.h"
 
@@ -23,11 +34,13 @@ using v8::BigInt64Array;
 using v8::BigUint64Array;
 using v8::Context;
 using v8::EscapableHandleScope;
+using v8::External;
 using v8::Float32Array;
 using v8::Float64Array;
 using v8::Function;
 using v8::FunctionCallbackInfo;
 using v8::FunctionTemplate;
+using v8::Global;
 using v8::Handle;
 using v8::HandleScope;
 using v8::Int16Array;
@@ -80,6 +93,152 @@ namespace hybrid {
 
 const int kJSEnvIsolateSoltIndex = v8::Isolate::GetNumberOfDataSlots() - 1;
 
+static inline Local<Value> ToV8Key(Isolate* isolate, const JSValue& key) {
+  return ToV8Value(isolate, &key);
+}
+
+static inline Local<Value> ToV8Key(Isolate* isolate, JSPropertyKey key) {
+  return ToV8String(isolate, key);
+}
+
+// the typed array elements converted in place, TValue is the JSValue type
+template <typename T, typename TValue>
+static void GetTypedArrayElements(const void* data,
+                                  uint32_t count,
+                                  JSValue* values) {
+  const T* elements = reinterpret_cast<const T*>(data);
+  for (uint32_t i = 0; i < count; i++) {
+    values[i].Set(static_cast<TValue>(elements[i]));
+  }
+}
+
+static inline double JSValueToDouble(const JSValue& value) {
+  switch (value.Type()) {
+    case JSValue::kInt:
+      return value.IntVal();
+    case JSValue::kUInt:
+      return value.UintVal();
+    case JSValue::kInt64:
+      return static_cast<double>(value.Int64Val());
+    case JSValue::kUint64:
+      return static_cast<double>(value.Uint64Val());
+    case JSValue::kBoolean:
+      return value.Boolean() ? 1 : 0;
+    default:
+      return value.FloatVal();
+  }
+}
+
+// ToInt32/ToUint32 of ecmascript: truncate and wrap modulo 2^32
+template <typename T>
+static inline T DoubleToTypedElement(double d) {
+  if (!std::isfinite(d)) {
+    return 0;
+  }
+  d = std::fmod(std::trunc(d), 4294967296.0);
+  if (d < 0) {
+    d += 4294967296.0;
+  }
+  return static_cast<T>(static_cast<uint32_t>(d));
+}
+
+template <>
+inline float DoubleToTypedElement<float>(double d) {
+  return static_cast<float>(d);
+}
+
+template <>
+inline double DoubleToTypedElement<double>(double d) {
+  return d;
+}
+
+// JSValues which are not numbers are left to V8, returns the count set
+template <typename T>
+static uint32_t SetTypedArrayElements(void* data,
+                                      const JSValue* values,
+                                      uint32_t count) {
+  T* elements = reinterpret_cast<T*>(data);
+  uint32_t i = 0;
+  for (; i < count && (values[i].IsNumber() || values[i].IsBoolean());
+       i++) {
+    elements[i] = DoubleToTypedElement<T>(JSValueToDouble(values[i]));
+  }
+  return i;
+}
+
+// BigInt64Array/BigUint64Array take BigInts only, wrap modulo 2^64
+template <typename T>
+static uint32_t SetBigIntArrayElements(void* data,
+                                       const JSValue* values,
+                                       uint32_t count) {
+  T* elements = reinterpret_cast<T*>(data);
+  uint32_t i = 0;
+  for (; i < count && values[i].IsBigInt(); i++) {
+    elements[i] = static_cast<T>(values[i].Uint64Val());
+  }
+  return i;
+}
+
+// kJSMicrotaskPolicyScoped runs the checkpoint when the outermost
+// ExecuteScript/CallFunction returns. The scope is only made in that policy,
+// an explicit checkpoint is skipped inside a v8::MicrotasksScope.
+class MicrotasksCallScope {
+ public:
+  explicit MicrotasksCallScope(Isolate* isolate)
+      : scoped_(isolate->GetMicrotasksPolicy() ==
+                v8::MicrotasksPolicy::kScoped) {
+    if (scoped_) {
+      new (&storage_)
+          v8::MicrotasksScope(isolate, v8::MicrotasksScope::kRunMicrotasks);
+    }
+  }
+
+  ~MicrotasksCallScope() {
+    if (scoped_) {
+      reinterpret_cast<v8::MicrotasksScope*>(&storage_)->~MicrotasksScope();
+    }
+  }
+
+ private:
+  bool scoped_;
+  std::aligned_storage<sizeof(v8::MicrotasksScope),
+                       alignof(v8::MicrotasksScope)>::type storage_;
+};
+
+template <typename T>
+static void GetBigIntArrayElements(const void* data,
+                                   uint32_t count,
+                                   JSValue* values) {
+  const T* elements = reinterpret_cast<const T*>(data);
+  for (uint32_t i = 0; i < count; i++) {
+    if (std::is_signed<T>::value) {
+      values[i].SetBigInt(static_cast<int64_t>(elements[i]));
+    } else {
+      values[i].SetBigUint(static_cast<uint64_t>(elements[i]));
+    }
+  }
+}
+
+static uint32_t SetUint8ClampedArrayElements(void* data,
+                                             const JSValue* values,
+                                             uint32_t count) {
+  uint8_t* elements = reinterpret_cast<uint8_t*>(data);
+  uint32_t i = 0;
+  for (; i < count && (values[i].IsNumber() || values[i].IsBoolean());
+       i++) {
+    double d = JSValueToDouble(values[i]);
+    if (!(d > 0)) {  // NaN too
+      elements[i] = 0;
+    } else if (d >= 255) {
+      elements[i] = 255;
+    } else {
+      // round half to even
+      elements[i] = static_cast<uint8_t>(std::nearbyint(d));
+    }
+  }
+  return i;
+}
+
 void handle(PromiseRejectMessage message) {
   auto promise = message.GetPromise();
   auto event = message.GetEvent();
@@ -128,12 +287,26 @@ JSEnvImpl::JSEnvImpl(J2V8Runtime* runtime)
     : runtime_(runtime),
       isolate_(nullptr),
       ref_count_(1),
+      async_notify_callback_(nullptr),
+      async_notify_user_data_(nullptr),
+      wakeup_fd_(-1),
+      settled_promises_(0),
+      flushing_batched_calls_(false),
+      has_snapshot_classes_(-1),
       quickapp_jsruntime_handle_(nullptr),
       jsenv_v1000_(this) {
   isolate_ = J2V8RuntimeGetIsolate(runtime_);
 
   isolate_->SetData(kJSEnvIsolateSoltIndex, this);
 
+  isolate_->AddMicrotasksCompletedCallback(OnMicrotasksCompleted, this);
+  isolate_->AddCallCompletedCallback(OnCallCompleted);
+
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_fd_ < 0) {
+    ALOGE(TAG, "create the task wakeup fd failed");
+  }
+
   logcat_console_.reset(LogcatConsole::Create(isolate_));
   logcat_console_->Attach(isolate_);
   // set PromiseRejection
@@ -144,6 +317,10 @@ JSEnvImpl::~JSEnvImpl() {
   if (isolate_) {
     isolate_->SetData(kJSEnvIsolateSoltIndex, nullptr);
   }
+  // the posting threads hold references while they wake up the fd
+  if (wakeup_fd_ >= 0) {
+    close(wakeup_fd_);
+  }
 }
 
 int JSEnvImpl::GetVersion() const {
@@ -151,7 +328,38 @@ int JSEnvImpl::GetVersion() const {
 }
 
 void* JSEnvImpl::DispatchJSEnvCommand(int cmd, void* data) {
-  return nullptr;
+  switch (cmd) {
+    case kJSEnvCommandGetArenaStats:
+      if (data == nullptr) {
+        return nullptr;
+      }
+      callback_arena_.GetStats(reinterpret_cast<JSArenaStats*>(data));
+      return data;
+    case kJSEnvCommandResetArenaStats:
+      callback_arena_.ResetStats();
+      return nullptr;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    case kJSEnvCommandGetCallbackProfile:
+      if (data == nullptr) {
+        return nullptr;
+      }
+      callback_profiler_.GetReport(
+          reinterpret_cast<JSCallbackProfileReport*>(data));
+      return data;
+    case kJSEnvCommandGetCallbackProfileJSON:
+      if (data == nullptr) {
+        return nullptr;
+      }
+      callback_profiler_.GetJSONReport(
+          reinterpret_cast<JSCallbackProfileJSON*>(data));
+      return data;
+    case kJSEnvCommandResetCallbackProfile:
+      callback_profiler_.Reset();
+      return nullptr;
+#endif
+    default:
+      return nullptr;
+  }
 }
 
 bool JSEnvImpl::HasException() const {
@@ -178,7 +386,36 @@ void JSEnvImpl::Detach() {
     }
   }
 
+  // the keys must be reset before the isolate is disposed
+  object_shapes_.clear();
+  property_keys_.clear();
+  FlushBatchedCalls();
+  // the calls queued by the callbacks of the last flush are dropped
+  for (BatchedCallbackInfo* record : batched_records_) {
+    if (record->function.IsEmpty()) {
+      delete record;
+    }
+  }
+  batched_records_.clear();
+  DeleteCallbackRecords();
+  CloseAsyncCompletions();
+  CloseTaskQueues();
+  for (PreparedCall* call : prepared_calls_) {
+    call->Reset();
+  }
+  for (EventChannel* channel : event_channels_) {
+    channel->Reset();
+  }
+  event_channel_template_.Reset();
+  // the live instances are not finalized, the queued finalizers are run
+  for (auto& it : js_classes_) {
+    it.second->ReleaseInstances();
+  }
+  finalizers_.Stop();
+
   if (isolate_) {
+    isolate_->RemoveMicrotasksCompletedCallback(OnMicrotasksCompleted, this);
+    isolate_->RemoveCallCompletedCallback(OnCallCompleted);
     isolate_->SetData(kJSEnvIsolateSoltIndex, nullptr);
   }
   isolate_ = nullptr;
@@ -201,6 +438,14 @@ void JSEnvImpl::ResetLogcat() {
   }
 }
 
+bool JSEnvImpl::HasSnapshotClasses() {
+  // the marker is consumed by the read
+  if (has_snapshot_classes_ < 0) {
+    has_snapshot_classes_ = JSClassTemplate::ReadSnapshotMarker(isolate_);
+  }
+  return has_snapshot_classes_ != 0;
+}
+
 JSInspectorSession* JSEnvImpl::CreateInspectorSession(
     JSInspectorClient* client,
     int context_group_id,
@@ -238,6 +483,7 @@ bool JSEnvImpl::ExecuteScript(const JSValue* code_value,
                               int start_lineno /* = 0 */,
                               uint32_t flags /* = 0*/) {
   HandleScope handle_scope(isolate_);
+  MicrotasksCallScope microtasks_scope(isolate_);
   TryCatch try_catch(isolate_);
   Local<Context> context = J2V8RuntimeGetContext(runtime_);
 
@@ -287,13 +533,17 @@ bool JSEnvImpl::ExecuteScript(const JSValue* code_value,
 }
 
 void JSEnvImpl::ThrowException(v8::TryCatch* ptry_catch) {
+  ThrowExecutionException(runtime_, ptry_catch);
+
+  exception_.Set(JSException::kJSException, FormatException(ptry_catch));
+}
+
+std::string JSEnvImpl::FormatException(v8::TryCatch* ptry_catch) {
   std::ostringstream out;
 
   String::Utf8Value exception(isolate_, ptry_catch->Exception());
   Handle<Message> message = ptry_catch->Message();
 
-  ThrowExecutionException(runtime_, ptry_catch);
-
   if (message.IsEmpty()) {
     out << *exception;
   } else {
@@ -323,7 +573,7 @@ void JSEnvImpl::ThrowException(v8::TryCatch* ptry_catch) {
     }
   }
 
-  exception_.Set(JSException::kJSException, out.str());
+  return out.str();
 }
 
 bool JSEnvImpl::RegisterCallbackOnObject(J2V8ObjectHandle object,
@@ -335,6 +585,46 @@ bool JSEnvImpl::RegisterCallbackOnObject(J2V8ObjectHandle object,
     return false;
   }
 
+  // a JSLazyFunctionCallback is registered by RegisterLazyCallbackOnObject
+  if (flags & kFlagLazyArgs) {
+    ALOGE(TAG, "RegisterCallbackOnObject: %s has kFlagLazyArgs", domain);
+    return false;
+  }
+
+  UserCallbackInfo* record =
+      new UserCallbackInfo(object, domain, callback, user_data, flags);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  record->profile_entry = callback_profiler_.GetEntry(domain);
+#endif
+
+  return RegisterDomainFunction(object, domain, CallUserCallback, record);
+}
+
+bool JSEnvImpl::RegisterLazyCallbackOnObject(J2V8ObjectHandle object,
+                                             const char* domain,
+                                             JSLazyFunctionCallback callback,
+                                             void* user_data,
+                                             uint32_t flags /* = 0 */) {
+  if (domain == nullptr || callback == nullptr) {
+    return false;
+  }
+
+  LazyFunctionCallbackInfo* record =
+      new LazyFunctionCallbackInfo(callback, user_data, flags | kFlagLazyArgs);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  record->profile_entry = callback_profiler_.GetEntry(domain);
+#endif
+
+  return RegisterDomainFunction(object, domain, CallLazyFunctionCallback,
+                                record);
+}
+
+// sets the function of |record| as "owner.name" of |object|, |record| is
+// freed if it fails
+bool JSEnvImpl::RegisterDomainFunction(J2V8ObjectHandle object,
+                                       const char* domain,
+                                       v8::FunctionCallback trampoline,
+                                       CallbackRecord* record) {
   // register function
   Isolate* isolate = J2V8RuntimeGetIsolate(runtime_);
   v8::Locker locker(isolate);
@@ -350,12 +640,6 @@ bool JSEnvImpl::RegisterCallbackOnObject(J2V8ObjectHandle object,
     v8_object = ToV8Object(isolate, object);
   }
 
-  UserCallbackInfo user_callback(object, domain, callback, user_data, flags);
-
-  size_t pos = user_callbacks_.size();
-
-  user_callbacks_.push_back(user_callback);
-
   std::string owner_name;
   std::string func_name;
 
@@ -367,14 +651,13 @@ bool JSEnvImpl::RegisterCallbackOnObject(J2V8ObjectHandle object,
   if (!String::NewFromUtf8(isolate, func_name.c_str(),
                            v8::NewStringType::kNormal)
            .ToLocal(&v8_func_name)) {
-    user_callbacks_.pop_back();
+    delete record;
     return false;
   }
 
   Local<Function> function;
-  if (!Function::New(context, CallUserCallback,
-                     Integer::New(isolate, static_cast<int>(pos)))
-           .ToLocal(&function)) {
+  if (!NewCallbackFunction(context, trampoline, record, 0,
+                           v8::ConstructorBehavior::kAllow, &function)) {
     return false;
   }
 
@@ -396,16 +679,16 @@ void JSEnvImpl::CallUserCallback(
     return;
   }
 
-  Local<Integer> pos_value = Local<Integer>::Cast(args.Data());
-  int pos = static_cast<int>(pos_value->Value());
-  if (pos < 0 || pos >= static_cast<int>(self->user_callbacks_.size())) {
-    ALOGE(TAG, "CallUserCallback failed, pos:%d", pos);
+  CallbackRecord* record = CallbackRecord::From(args.Data());
+  if (record->deleted) {
     return;
   }
 
-  const UserCallbackInfo* pcallback = &(self->user_callbacks_[pos]);
+  const UserCallbackInfo* pcallback = static_cast<UserCallbackInfo*>(record);
+  JSENV_PROFILE_SCOPE(record->profile_entry);
 
-  Arguments<> arguments(args.Length(), pcallback->flags);
+  Arguments<> arguments(args.Length(), pcallback->flags,
+                        self->callback_arena());
 
   for (int i = 0; i < args.Length(); i++) {
     arguments.Add(isolate, args[i]);
@@ -413,9 +696,11 @@ void JSEnvImpl::CallUserCallback(
 
   JSValue result;
 
+  JSENV_PROFILE_BEGIN_CALLBACK();
   bool bret =
       pcallback->callback(self, pcallback->user_data, pcallback->owner_handle,
                           arguments.args, arguments.argc, &result);
+  JSENV_PROFILE_END_CALLBACK();
 
   // Check and throw exception
   if (self->ThrowExceptionToV8()) {
@@ -442,17 +727,17 @@ void JSEnvImpl::CallJSFunctionCallback(
     return;
   }
 
-  Local<Integer> pos_value = Local<Integer>::Cast(args.Data());
-  int pos = static_cast<int>(pos_value->Value());
-  if (pos < 0 || pos >= static_cast<int>(jsenv->jsfunction_callbacks_.size())) {
-    ALOGE(TAG, "CallJSFunctionCallback failed, pos:%d", pos);
+  CallbackRecord* record = CallbackRecord::From(args.Data());
+  if (record->deleted) {
     return;
   }
 
   const JSFunctionCallbackInfo* pcallback =
-      &(jsenv->jsfunction_callbacks_[pos]);
+      static_cast<JSFunctionCallbackInfo*>(record);
+  JSENV_PROFILE_SCOPE(record->profile_entry);
 
-  Arguments<> arguments(args.Length(), pcallback->flags);
+  Arguments<> arguments(args.Length(), pcallback->flags,
+                        jsenv->callback_arena());
 
   for (int i = 0; i < args.Length(); i++) {
     arguments.Add(isolate, args[i]);
@@ -460,8 +745,56 @@ void JSEnvImpl::CallJSFunctionCallback(
 
   JSValue result;
 
+  JSENV_PROFILE_BEGIN_CALLBACK();
   bool bret = pcallback->callback(jsenv, pcallback->user_data, self,
                                   arguments.args, arguments.argc, &result);
+  JSENV_PROFILE_END_CALLBACK();
+
+  // Check and throw exception
+  if (jsenv->ThrowExceptionToV8()) {
+    return;
+  }
+
+  if (!bret) {
+    return;
+  }
+
+  Local<Value> v8_result = ToV8Value(isolate, &result);
+
+  args.GetReturnValue().Set(v8_result);
+}
+
+// |self| is the receiver for NewLazyFunction and for
+// RegisterLazyCallbackOnObject alike, the arguments are converted by GetArg
+void JSEnvImpl::CallLazyFunctionCallback(
+    const v8::FunctionCallbackInfo<v8::Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  JSObject self = ToJSObject(args.This());
+
+  JSEnvImpl* jsenv = From(isolate);
+
+  if (!jsenv) {
+    return;
+  }
+
+  CallbackRecord* record = CallbackRecord::From(args.Data());
+  if (record->deleted) {
+    return;
+  }
+
+  const LazyFunctionCallbackInfo* pcallback =
+      static_cast<LazyFunctionCallbackInfo*>(record);
+  JSENV_PROFILE_SCOPE(record->profile_entry);
+
+  LazyArguments arguments(&args, pcallback->flags, jsenv->callback_arena());
+
+  JSValue result;
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  bool bret = pcallback->callback(jsenv, pcallback->user_data, self,
+                                  arguments.ToJSArgs(), &result);
+  JSENV_PROFILE_END_CALLBACK();
 
   // Check and throw exception
   if (jsenv->ThrowExceptionToV8()) {
@@ -477,6 +810,81 @@ void JSEnvImpl::CallJSFunctionCallback(
   args.GetReturnValue().Set(v8_result);
 }
 
+// No JSValue is made: the arguments are converted by the declared types
+// into JSTypedValues on the stack and the result is set directly.
+void JSEnvImpl::CallTypedFunction(
+    const v8::FunctionCallbackInfo<v8::Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  JSEnvImpl* jsenv = From(isolate);
+
+  if (!jsenv) {
+    return;
+  }
+
+  CallbackRecord* record = CallbackRecord::From(args.Data());
+  if (record->deleted) {
+    return;
+  }
+
+  const TypedFunctionInfo& info = *static_cast<TypedFunctionInfo*>(record);
+  Local<Context> context = isolate->GetCurrentContext();
+
+  JSTypedValue argv[kMaxTypedFunctionArgs];
+  for (int i = 0; i < info.argc; i++) {
+    // args[i] is undefined if it's missed
+    Local<Value> arg = args[i];
+    bool ok = true;
+    switch (info.arg_types[i]) {
+      case kJSTypeInt32:
+        ok = arg->Int32Value(context).To(&argv[i].i32);
+        break;
+      case kJSTypeUint32:
+        ok = arg->Uint32Value(context).To(&argv[i].u32);
+        break;
+      case kJSTypeDouble:
+        ok = arg->NumberValue(context).To(&argv[i].f64);
+        break;
+      case kJSTypeBoolean:
+        argv[i].b = arg->BooleanValue(isolate);
+        break;
+      case kJSTypeInt64:
+        if (arg->IsBigInt()) {
+          argv[i].i64 = arg.As<v8::BigInt>()->Int64Value();
+        } else {
+          ok = arg->IntegerValue(context).To(&argv[i].i64);
+        }
+        break;
+    }
+    // valueOf threw
+    if (!ok) {
+      return;
+    }
+  }
+
+  JSTypedValue result;
+  info.thunk(info.function, argv, &result);
+
+  switch (info.return_type) {
+    case kJSTypeInt32:
+      args.GetReturnValue().Set(result.i32);
+      break;
+    case kJSTypeUint32:
+      args.GetReturnValue().Set(result.u32);
+      break;
+    case kJSTypeDouble:
+      args.GetReturnValue().Set(result.f64);
+      break;
+    case kJSTypeBoolean:
+      args.GetReturnValue().Set(result.b);
+      break;
+    case kJSTypeInt64:
+      // a Number is exact only up to 2^53
+      args.GetReturnValue().Set(v8::BigInt::New(isolate, result.i64));
+      break;
+  }
+}
+
 bool JSEnvImpl::ThrowExceptionToV8() {
   if (!HasException()) {
     return false;
@@ -553,6 +961,15 @@ JSObject JSEnvImpl::J2V8ObjectHandleToJSObject(J2V8ObjectHandle j2v8_handle) {
 // class support
 JSClass JSEnvImpl::CreateClass(const JSClassDefinition* class_definition,
                                JSClass super) {
+  return CreateClassWithInterceptors(class_definition, super, nullptr,
+                                     nullptr);
+}
+
+JSClass JSEnvImpl::CreateClassWithInterceptors(
+    const JSClassDefinition* class_definition,
+    JSClass super,
+    const JSNamedPropertyHandler* named_handler,
+    const JSIndexedPropertyHandler* indexed_handler) {
   if (class_definition == nullptr) {
     return nullptr;
   }
@@ -568,8 +985,10 @@ JSClass JSEnvImpl::CreateClass(const JSClassDefinition* class_definition,
   // register the class
   HandleScope handle_scope(isolate_);
 
-  JSClassTemplate* new_class_tmpl = JSClassTemplate::Create(
-      isolate_, class_definition, JSClassTemplate::From(super));
+  JSClassTemplate* new_class_tmpl =
+      JSClassTemplate::Create(isolate_, class_definition,
+                              JSClassTemplate::From(super), named_handler,
+                              indexed_handler);
 
   if (new_class_tmpl == nullptr) {
     return nullptr;
@@ -610,6 +1029,30 @@ JSObject JSEnvImpl::NewInstance(JSClass clazz) {
   return ToJSObject(escape_handle_scope.Escape(v8_object));
 }
 
+// the objects are made in the handle scope of the caller, like the escaped
+// object of NewInstance
+int JSEnvImpl::NewInstances(JSClass clazz,
+                            int count,
+                            JSObject* objects,
+                            void* const* private_data /* = nullptr */) {
+  JSClassTemplate* class_templ = JSClassTemplate::From(clazz);
+
+  if (class_templ == nullptr || count <= 0 || objects == nullptr) {
+    return 0;
+  }
+
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  std::vector<Local<Object>> v8_objects(count);
+  int made =
+      class_templ->NewObjects(context, count, v8_objects.data(), private_data);
+
+  for (int i = 0; i < made; i++) {
+    objects[i] = ToJSObject(v8_objects[i]);
+  }
+  return made;
+}
+
 JSObject JSEnvImpl::NewInstanceWithConstructor(JSClass clazz,
                                                const JSValue* args,
                                                int argc) {
@@ -670,31 +1113,7 @@ int JSEnvImpl::GetObjectType(JSObject object) {
     return JSValue::kNull;
   }
 
-  if (v8_object->IsFunction()) {
-    return JSValue::kJSFunction;
-  }
-
-  if (v8_object->IsArray()) {
-    return JSValue::kJSArray;
-  }
-
-  if (v8_object->IsTypedArray()) {
-    return JSValue::kJSTypedArray;
-  }
-
-  if (v8_object->IsArrayBuffer()) {
-    return JSValue::kJSArrayBuffer;
-  }
-
-  if (v8_object->IsDataView()) {
-    return JSValue::kJSDataView;
-  }
-
-  if (v8_object->IsPromise()) {
-    return JSValue::kJSPromise;
-  }
-
-  return JSValue::kJSObject;
+  return GetV8ObjectType(v8_object);
 }
 
 int JSEnvImpl::GetTypedArrayType(JSObject object) {
@@ -742,6 +1161,14 @@ int JSEnvImpl::GetTypedArrayType(JSObject object) {
     return JSValue::kJSFloat64Array;
   }
 
+  if (v8_object->IsBigInt64Array()) {
+    return JSValue::kJSInt64Array;
+  }
+
+  if (v8_object->IsBigUint64Array()) {
+    return JSValue::kJSUint64Array;
+  }
+
   return JSValue::kJSNotTypedArray;
 }
 
@@ -1109,16 +1536,18 @@ JSObject JSEnvImpl::NewFunction(JSFunctionCallback callback,
   EscapableHandleScope escape_handle_scope(isolate);
   Local<Context> context = J2V8RuntimeGetContext(runtime_);
 
-  JSFunctionCallbackInfo jsfunction_callback(callback, user_data, flags);
-
-  size_t pos = jsfunction_callbacks_.size();
-
-  jsfunction_callbacks_.push_back(jsfunction_callback);
+  JSFunctionCallbackInfo* record =
+      new JSFunctionCallbackInfo(callback, user_data, flags);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  char profile_name[48];
+  snprintf(profile_name, sizeof(profile_name), "function@%p",
+           reinterpret_cast<void*>(callback));
+  record->profile_entry = callback_profiler_.GetEntry(profile_name);
+#endif
 
   Local<Function> function;
-  if (!Function::New(context, CallJSFunctionCallback,
-                     Integer::New(isolate, static_cast<int>(pos)))
-           .ToLocal(&function)) {
+  if (!NewCallbackFunction(context, CallJSFunctionCallback, record, 0,
+                           v8::ConstructorBehavior::kAllow, &function)) {
     return nullptr;
   }
   return ToJSObject(escape_handle_scope.Escape(function));
@@ -1153,6 +1582,7 @@ bool JSEnvImpl::CallFunction(JSObject function,
     v8_self = context->Global();
   }
 
+  MicrotasksCallScope microtasks_scope(isolate);
   TryCatch try_catch(isolate);
 
   V8Arguments<> arguments(isolate, argv, argc);
@@ -1246,18 +1676,14 @@ JSObject JSEnvImpl::NewArray(size_t length) {
 JSObject JSEnvImpl::NewArrayWithValues(const JSValue* argv, int argc) {
   EscapableHandleScope escape_handle_scope(isolate_);
 
-  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  if (argv == nullptr || argc <= 0) {
+    return ToJSObject(escape_handle_scope.Escape(Array::New(isolate_, 0)));
+  }
 
-  Local<Object> array = Array::New(isolate_, argc);
+  V8Arguments<> elements(isolate_, argv, argc);
 
-  if (argv != nullptr) {
-    for (int i = 0; i < argc; i++) {
-      Local<Value> value = ToV8Value(isolate_, &argv[i]);
-      bool bret;
-      if (array->Set(context, static_cast<uint32_t>(i), value).To(&bret)) {
-      }
-    }
-  }
+  Local<Array> array =
+      Array::New(isolate_, elements.args, static_cast<size_t>(elements.argc));
 
   return ToJSObject(escape_handle_scope.Escape(array));
 }
@@ -1287,7 +1713,7 @@ JSObject JSEnvImpl::NewTypedArray(int array_type, size_t element_count) {
   }
 
   Local<TypedArray> typed_array =
-      CreateTypedArray(isolate, array_type, array_buffer, 0, length);
+      CreateTypedArray(isolate, array_type, array_buffer, 0, element_count);
 
   return ToJSObject(escape_handle_scope.Escape(typed_array));
 }
@@ -1318,10 +1744,14 @@ JSObject JSEnvImpl::NewTypedArrayArrayBuffer(int array_type,
   }
 
   size_t byte_offset = element_size * element_offset;
-  size_t length = element_size * element_count;
+
+  if (byte_offset + element_size * element_count >
+      v8_array_buffer->ByteLength()) {
+    return nullptr;
+  }
 
   Local<TypedArray> typed_array = CreateTypedArray(
-      isolate, array_type, v8_array_buffer, byte_offset, length);
+      isolate, array_type, v8_array_buffer, byte_offset, element_count);
 
   return ToJSObject(escape_handle_scope.Escape(typed_array));
 }
@@ -1524,11 +1954,12 @@ bool JSEnvImpl::Resolve(JSObject resolver, const JSValue* pvalue) {
   Local<Value> v8_value = ToV8Value(isolate_, pvalue);
 
   bool bret = false;
-  if (v8_resolver->Resolve(context, v8_value).To(&bret)) {
-    return bret;
+  if (!v8_resolver->Resolve(context, v8_value).To(&bret) || !bret) {
+    return false;
   }
 
-  return false;
+  settled_promises_++;
+  return true;
 }
 
 bool JSEnvImpl::Reject(JSObject resolver, const JSValue* pvalue) {
@@ -1552,11 +1983,12 @@ bool JSEnvImpl::Reject(JSObject resolver, const JSValue* pvalue) {
   Local<Value> v8_value = ToV8Value(isolate_, pvalue);
 
   bool bret = false;
-  if (v8_resolver->Reject(context, v8_value).To(&bret)) {
-    return bret;
+  if (!v8_resolver->Reject(context, v8_value).To(&bret) || !bret) {
+    return false;
   }
 
-  return false;
+  settled_promises_++;
+  return true;
 }
 
 bool JSEnvImpl::SetPromiseThen(JSObject promise, JSObject function) {
@@ -1720,67 +2152,2069 @@ void JSEnvImpl::PopScope() {
   }
 }
 
-Local<Object> JSEnvImpl::CallConstructor(Local<Function> function,
-                                         const JSValue* args,
-                                         int argc) {
-  Isolate* isolate = isolate_;
-
-  Local<Context> context = J2V8RuntimeGetContext(runtime_);
-
-  TryCatch try_catch(isolate);
-
-  V8Arguments<> arguments(isolate, args, argc);
-
-  Local<Value> result;
-
-  if (!function->NewInstance(context, arguments.argc, arguments.args)
-           .ToLocal(&result)) {
-    return Local<Object>();
+// version 1200
+// external string
+JSExternalString JSEnvImpl::NewExternalString(
+    const void* data,
+    size_t length,
+    int encoding,
+    JSExternalStringReleaseCallback release_callback,
+    void* user_data) {
+  if (data == nullptr || length > static_cast<size_t>(String::kMaxLength)) {
+    return nullptr;
   }
 
-  if (try_catch.HasCaught()) {
-    ThrowException(&try_catch);
-    return Local<Object>();
+  if (encoding != kJSExternalStringLatin1 &&
+      encoding != kJSExternalStringUTF16) {
+    return nullptr;
   }
 
-  return result.As<Object>();
+  ExternalStringData* str = new ExternalStringData(
+      data, length, encoding, release_callback, user_data);
+  return str->ToJSExternalString();
 }
 
-///////////////////////////////////////
-bool RegisterBuiltins(J2V8Runtime* runtime,
-                      Isolate* isolate,
-                      Local<Context> context);
+void JSEnvImpl::DeleteExternalString(JSExternalString str) {
+  if (str) {
+    ExternalStringData::From(str)->Release();
+  }
+}
 
-const StartupData* GetCustomJsSnapshot(const char* nativejs_snapshot_so_name) {
-  if (nativejs_snapshot_so_name == NULL) {
+// property key
+JSPropertyKey JSEnvImpl::CreatePropertyKey(const char* name) {
+  if (name == nullptr) {
     return nullptr;
   }
-  void* nativejs_handle = dlopen(nativejs_snapshot_so_name, RTLD_NOW);
-  if (!nativejs_handle) {
-    ALOGE(TAG, "GetCustomJsSnapshot: dlopen error:%s",
-          nativejs_snapshot_so_name);
-    return nullptr;
+
+  auto it = property_keys_.find(name);
+  if (it != property_keys_.end()) {
+    return ToJSPropertyKey(it->second.get());
   }
-  get_nativejs_blob_cb get_nativejs_blob =
-      reinterpret_cast<get_nativejs_blob_cb>(
-          dlsym(nativejs_handle, NATIVEJS_SNAPSHOT_ENTRY));
-  if (!get_nativejs_blob) {
-    ALOGE(TAG, "GetCustomJsSnapshot: dlsym error:%s", NATIVEJS_SNAPSHOT_ENTRY);
+
+  HandleScope handle_scope(isolate_);
+
+  Local<String> v8_name;
+  if (!String::NewFromUtf8(isolate_, name, NewStringType::kInternalized)
+           .ToLocal(&v8_name)) {
     return nullptr;
   }
-  return reinterpret_cast<const v8::StartupData*>(get_nativejs_blob());
+
+  Global<String>* property_key = new Global<String>(isolate_, v8_name);
+  property_keys_[name].reset(property_key);
+  return ToJSPropertyKey(property_key);
 }
 
-// extern "C" void* QuickAppJSRuntimeInit(void* vm, void* context);
-// extern "C" void QuickAppJSRuntimeDeInit(void* isolate);
+bool JSEnvImpl::GetObjectProperty(JSObject object,
+                                  JSPropertyKey key,
+                                  JSValue* pvalue,
+                                  uint32_t flags /* = 0*/) {
+  if (key == nullptr || pvalue == nullptr) {
+    return false;
+  }
 
-bool OnCreateIsolate(J2V8Runtime* runtime) {
-  Isolate* isolate = J2V8RuntimeGetIsolate(runtime);
-  HandleScope handle_scope(isolate);
-  Local<Context> context = J2V8RuntimeGetContext(runtime);
-  Context::Scope context_scope(context);
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
 
-  JSEnvImpl* jsenv = JSEnvImpl::From(runtime);
+  Local<Object> v8_object = ToV8Object(isolate_, object);
+
+  if (v8_object.IsEmpty()) {
+    return false;
+  }
+
+  Local<Value> value;
+  if (!v8_object->Get(context, ToV8String(isolate_, key)).ToLocal(&value)) {
+    return false;
+  }
+
+  return ToJSValue(isolate_, pvalue, escape_handle_scope.Escape(value), flags);
+}
+
+bool JSEnvImpl::SetObjectProperty(JSObject object,
+                                  JSPropertyKey key,
+                                  const JSValue* pvalue) {
+  if (key == nullptr || pvalue == nullptr) {
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  Local<Object> v8_object = ToV8Object(isolate_, object);
+
+  if (v8_object.IsEmpty()) {
+    return false;
+  }
+
+  Local<Value> v8_value = ToV8Value(isolate_, pvalue);
+  if (v8_value.IsEmpty()) {
+    v8_value = v8::Null(isolate_);
+  }
+
+  return v8_object->Set(context, ToV8String(isolate_, key), v8_value)
+      .FromMaybe(false);
+}
+
+bool JSEnvImpl::GetGlobal(JSPropertyKey key,
+                          JSValue* pvalue,
+                          uint32_t flags /* = 0*/) {
+  if (key == nullptr || pvalue == nullptr) {
+    return false;
+  }
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  Local<Value> value;
+  if (!context->Global()
+           ->Get(context, ToV8String(isolate_, key))
+           .ToLocal(&value)) {
+    return false;
+  }
+
+  return ToJSValue(isolate_, pvalue, escape_handle_scope.Escape(value), flags);
+}
+
+bool JSEnvImpl::SetGlobal(JSPropertyKey key, const JSValue* pvalue) {
+  if (key == nullptr || pvalue == nullptr) {
+    ALOGE("JSENV", "SetGlobal key or value is null");
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  Local<Value> v8_value = ToV8Value(isolate_, pvalue);
+  if (v8_value.IsEmpty()) {
+    v8_value = v8::Null(isolate_);
+  }
+
+  return context->Global()
+      ->Set(context, ToV8String(isolate_, key), v8_value)
+      .FromMaybe(false);
+}
+
+// bulk array access
+bool JSEnvImpl::GetArrayElements(JSObject object,
+                                 uint32_t start,
+                                 uint32_t count,
+                                 JSValue* values,
+                                 uint32_t flags /* = 0*/) {
+  if (values == nullptr) {
+    return false;
+  }
+
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Local<Object> v8_object = ToV8Object(isolate_, object);
+
+  if (v8_object.IsEmpty()) {
+    return false;
+  }
+
+  uint32_t length = 0;
+  if (v8_object->IsArray()) {
+    length = v8_object.As<Array>()->Length();
+  } else if (v8_object->IsTypedArray()) {
+    length = static_cast<uint32_t>(v8_object.As<TypedArray>()->Length());
+  } else {
+    return false;
+  }
+
+  uint32_t end = start < length ? start + std::min(count, length - start)
+                                : start;
+  for (uint32_t i = end - start; i < count; i++) {
+    values[i].SetNull();
+  }
+
+  if (v8_object->IsTypedArray()) {
+    // the buffer handle isn't kept, no element is a V8 value
+    HandleScope handle_scope(isolate_);
+    Local<TypedArray> typed_array = v8_object.As<TypedArray>();
+    uint8_t* data = reinterpret_cast<uint8_t*>(
+        typed_array->Buffer()->GetContents().Data());
+    // detached: the length is 0, the elements are set to null above
+    if (data == nullptr) {
+      return false;
+    }
+    if (end == start) {
+      return true;
+    }
+    data += typed_array->ByteOffset();
+
+    uint32_t n = end - start;
+    switch (GetTypedArrayType(object)) {
+      case JSValue::kJSInt8Array:
+        GetTypedArrayElements<int8_t, int>(data + start, n, values);
+        return true;
+      case JSValue::kJSInt16Array:
+        GetTypedArrayElements<int16_t, int>(data + start * 2, n, values);
+        return true;
+      case JSValue::kJSInt32Array:
+        GetTypedArrayElements<int32_t, int>(data + start * 4, n, values);
+        return true;
+      case JSValue::kJSUint8Array:
+      case JSValue::kJSUint8ClampedArray:
+        GetTypedArrayElements<uint8_t, uint32_t>(data + start, n, values);
+        return true;
+      case JSValue::kJSUint16Array:
+        GetTypedArrayElements<uint16_t, uint32_t>(data + start * 2, n,
+                                                  values);
+        return true;
+      case JSValue::kJSUint32Array:
+        GetTypedArrayElements<uint32_t, uint32_t>(data + start * 4, n,
+                                                  values);
+        return true;
+      case JSValue::kJSFloat32Array:
+        GetTypedArrayElements<float, double>(data + start * 4, n, values);
+        return true;
+      case JSValue::kJSFloat64Array:
+        GetTypedArrayElements<double, double>(data + start * 8, n, values);
+        return true;
+      case JSValue::kJSInt64Array:
+        GetBigIntArrayElements<int64_t>(data + start * 8, n, values);
+        return true;
+      case JSValue::kJSUint64Array:
+        GetBigIntArrayElements<uint64_t>(data + start * 8, n, values);
+        return true;
+    }
+  }
+
+  return GetValues(end - start, values, flags,
+                   [&](uint32_t i, Local<Value>* pvalue) {
+                     return v8_object->Get(context, start + i)
+                         .ToLocal(pvalue);
+                   });
+}
+
+bool JSEnvImpl::SetArrayElements(JSObject object,
+                                 uint32_t start,
+                                 const JSValue* values,
+                                 uint32_t count) {
+  if (values == nullptr) {
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Local<Object> v8_object = ToV8Object(isolate_, object);
+
+  if (v8_object.IsEmpty()) {
+    return false;
+  }
+
+  uint32_t done = 0;
+  if (v8_object->IsTypedArray()) {
+    Local<TypedArray> typed_array = v8_object.As<TypedArray>();
+    size_t length = typed_array->Length();
+    if (start > length || count > length - start) {
+      return false;
+    }
+
+    uint8_t* data = reinterpret_cast<uint8_t*>(
+        typed_array->Buffer()->GetContents().Data());
+    if (data == nullptr) {
+      return count == 0;
+    }
+    data += typed_array->ByteOffset();
+
+    switch (GetTypedArrayType(object)) {
+      case JSValue::kJSInt8Array:
+        done = SetTypedArrayElements<int8_t>(data + start, values, count);
+        break;
+      case JSValue::kJSInt16Array:
+        done =
+            SetTypedArrayElements<int16_t>(data + start * 2, values, count);
+        break;
+      case JSValue::kJSInt32Array:
+        done =
+            SetTypedArrayElements<int32_t>(data + start * 4, values, count);
+        break;
+      case JSValue::kJSUint8Array:
+        done = SetTypedArrayElements<uint8_t>(data + start, values, count);
+        break;
+      case JSValue::kJSUint8ClampedArray:
+        done = SetUint8ClampedArrayElements(data + start, values, count);
+        break;
+      case JSValue::kJSUint16Array:
+        done =
+            SetTypedArrayElements<uint16_t>(data + start * 2, values, count);
+        break;
+      case JSValue::kJSUint32Array:
+        done =
+            SetTypedArrayElements<uint32_t>(data + start * 4, values, count);
+        break;
+      case JSValue::kJSFloat32Array:
+        done = SetTypedArrayElements<float>(data + start * 4, values, count);
+        break;
+      case JSValue::kJSFloat64Array:
+        done = SetTypedArrayElements<double>(data + start * 8, values, count);
+        break;
+      case JSValue::kJSInt64Array:
+        done =
+            SetBigIntArrayElements<int64_t>(data + start * 8, values, count);
+        break;
+      case JSValue::kJSUint64Array:
+        done =
+            SetBigIntArrayElements<uint64_t>(data + start * 8, values, count);
+        break;
+    }
+  } else if (!v8_object->IsArray()) {
+    return false;
+  }
+
+  // the rest, or the values need a conversion by V8
+  bool bret = true;
+  for (uint32_t i = done; i < count; i++) {
+    Local<Value> value = ToV8Value(isolate_, &values[i]);
+    if (value.IsEmpty()) {
+      value = v8::Null(isolate_);
+    }
+    if (!v8_object->Set(context, start + i, value).FromMaybe(false)) {
+      bret = false;
+    }
+  }
+
+  return bret;
+}
+
+// object shape
+JSObjectShape JSEnvImpl::CreateObjectShape(const char* const* names,
+                                           int count) {
+  if (names == nullptr || count <= 0) {
+    return nullptr;
+  }
+
+  HandleScope handle_scope(isolate_);
+
+  std::unique_ptr<ObjectShape> shape(new ObjectShape());
+  Local<ObjectTemplate> object_template = ObjectTemplate::New(isolate_);
+
+  for (int i = 0; i < count; i++) {
+    JSPropertyKey key = CreatePropertyKey(names[i]);
+    // the keys are interned, a duplicate name has the same key
+    if (key == nullptr || std::find(shape->keys.begin(), shape->keys.end(),
+                                    key) != shape->keys.end()) {
+      return nullptr;
+    }
+    object_template->Set(ToV8String(isolate_, key), v8::Null(isolate_));
+    shape->keys.push_back(key);
+  }
+
+  shape->object_template.Reset(isolate_, object_template);
+  object_shapes_.push_back(std::move(shape));
+  return reinterpret_cast<JSObjectShape>(object_shapes_.back().get());
+}
+
+JSObject JSEnvImpl::NewObjectWithShape(JSObjectShape shape,
+                                       const JSValue* values,
+                                       int count) {
+  if (shape == nullptr) {
+    return nullptr;
+  }
+
+  ObjectShape* object_shape = reinterpret_cast<ObjectShape*>(shape);
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  Local<Object> object;
+  if (!object_shape->object_template.Get(isolate_)
+           ->NewInstance(context)
+           .ToLocal(&object)) {
+    return nullptr;
+  }
+
+  int n = std::min(count, static_cast<int>(object_shape->keys.size()));
+  for (int i = 0; values != nullptr && i < n; i++) {
+    Local<Value> value = ToV8Value(isolate_, &values[i]);
+    if (value.IsEmpty()) {
+      continue;
+    }
+    // the property is an own data property already, so the map is kept
+    if (object
+            ->CreateDataProperty(
+                context, ToV8String(isolate_, object_shape->keys[i]), value)
+            .IsNothing()) {
+      return nullptr;
+    }
+  }
+
+  return ToJSObject(escape_handle_scope.Escape(object));
+}
+
+// structured clone
+JSSerializedData JSEnvImpl::SerializeValue(const JSValue* pvalue,
+                                           const JSObject* transfers,
+                                           int transfer_count) {
+  if (pvalue == nullptr || (transfers == nullptr && transfer_count > 0)) {
+    return nullptr;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(isolate_);
+
+  Local<Value> value = ToV8Value(isolate_, pvalue);
+  if (value.IsEmpty()) {
+    value = v8::Null(isolate_);
+  }
+
+  SerializerDelegate delegate(isolate_);
+  v8::ValueSerializer serializer(isolate_, &delegate);
+
+  std::vector<Local<ArrayBuffer>> array_buffers;
+  for (int i = 0; i < transfer_count; i++) {
+    Local<Object> object = ToV8Object(isolate_, transfers[i]);
+    // only an ArrayBuffer can be transferred, and not an external one: its
+    // memory is released by its creator
+    if (object.IsEmpty() || !object->IsArrayBuffer() ||
+        !object.As<ArrayBuffer>()->IsDetachable() ||
+        object.As<ArrayBuffer>()->IsExternal()) {
+      ALOGE(TAG, "SerializeValue: transfer %d is not a transferable", i);
+      return nullptr;
+    }
+    array_buffers.push_back(object.As<ArrayBuffer>());
+    serializer.TransferArrayBuffer(i, object.As<ArrayBuffer>());
+  }
+
+  serializer.WriteHeader();
+  if (!serializer.WriteValue(context, value).FromMaybe(false)) {
+    if (try_catch.HasCaught()) {
+      ThrowException(&try_catch);
+    }
+    return nullptr;
+  }
+
+  std::pair<uint8_t*, size_t> buffer = serializer.Release();
+  SerializedData* data = new SerializedData(buffer.first, buffer.second);
+
+  for (Local<ArrayBuffer>& array_buffer : array_buffers) {
+    data->AddArrayBuffer(array_buffer->GetBackingStore());
+    array_buffer->Detach();
+  }
+
+  return data->ToJSSerializedData();
+}
+
+bool JSEnvImpl::DeserializeValue(JSSerializedData data,
+                                 JSValue* pvalue,
+                                 uint32_t flags /* = 0*/) {
+  if (data == nullptr || pvalue == nullptr) {
+    return false;
+  }
+
+  SerializedData* serialized_data = SerializedData::From(data);
+  if (serialized_data->consumed()) {
+    ALOGE(TAG, "DeserializeValue: the transfers are moved already");
+    return false;
+  }
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(isolate_);
+
+  v8::ValueDeserializer deserializer(isolate_, serialized_data->data(),
+                                     serialized_data->size());
+
+  if (!deserializer.ReadHeader(context).FromMaybe(false)) {
+    if (try_catch.HasCaught()) {
+      ThrowException(&try_catch);
+    }
+    return false;
+  }
+
+  const std::vector<std::shared_ptr<v8::BackingStore>>& array_buffers =
+      serialized_data->array_buffers();
+  for (size_t i = 0; i < array_buffers.size(); i++) {
+    deserializer.TransferArrayBuffer(
+        static_cast<uint32_t>(i), ArrayBuffer::New(isolate_, array_buffers[i]));
+  }
+
+  // the backing stores are handed out already, a failed read consumes them
+  // as well: a retry would alias a store into two ArrayBuffers
+  Local<Value> value;
+  if (!deserializer.ReadValue(context).ToLocal(&value)) {
+    serialized_data->Consume();
+    if (try_catch.HasCaught()) {
+      ThrowException(&try_catch);
+    }
+    return false;
+  }
+
+  serialized_data->Consume();
+
+  return ToJSValue(isolate_, pvalue, escape_handle_scope.Escape(value), flags);
+}
+
+const void* JSEnvImpl::GetSerializedDataBuffer(JSSerializedData data,
+                                               size_t* psize) {
+  if (data == nullptr) {
+    return nullptr;
+  }
+
+  SerializedData* serialized_data = SerializedData::From(data);
+
+  // the transfers can't be saved
+  if (serialized_data->HasTransfers()) {
+    return nullptr;
+  }
+
+  if (psize) {
+    *psize = serialized_data->size();
+  }
+  return serialized_data->data();
+}
+
+JSSerializedData JSEnvImpl::NewSerializedData(const void* buffer,
+                                              size_t size) {
+  if (buffer == nullptr || size == 0) {
+    return nullptr;
+  }
+
+  uint8_t* data = reinterpret_cast<uint8_t*>(malloc(size));
+  if (data == nullptr) {
+    return nullptr;
+  }
+  memcpy(data, buffer, size);
+
+  return (new SerializedData(data, size))->ToJSSerializedData();
+}
+
+void JSEnvImpl::DeleteSerializedData(JSSerializedData data) {
+  delete SerializedData::From(data);
+}
+
+// JSON
+bool JSEnvImpl::ParseJSON(const JSValue* json,
+                          JSValue* presult,
+                          uint32_t flags /* = 0*/) {
+  if (json == nullptr || presult == nullptr) {
+    return false;
+  }
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(isolate_);
+
+  Local<Value> v8_json = ToV8Value(isolate_, json);
+  if (v8_json.IsEmpty() || !v8_json->IsString()) {
+    ALOGE(TAG, "ParseJSON: json must be a string");
+    return false;
+  }
+
+  Local<Value> result;
+  if (!v8::JSON::Parse(context, v8_json.As<String>()).ToLocal(&result)) {
+    if (try_catch.HasCaught()) {
+      ThrowException(&try_catch);
+    }
+    return false;
+  }
+
+  return ToJSValue(isolate_, presult, escape_handle_scope.Escape(result),
+                   flags);
+}
+
+bool JSEnvImpl::StringifyJSON(const JSValue* pvalue,
+                              JSValue* presult,
+                              uint32_t flags /* = 0*/) {
+  if (pvalue == nullptr || presult == nullptr) {
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(isolate_);
+
+  Local<Value> value = ToV8Value(isolate_, pvalue);
+  if (value.IsEmpty()) {
+    value = v8::Null(isolate_);
+  }
+
+  Local<String> result;
+  if (!v8::JSON::Stringify(context, value).ToLocal(&result)) {
+    if (try_catch.HasCaught()) {
+      ThrowException(&try_catch);
+    }
+    return false;
+  }
+
+  // a string is copied out, it needs no handle
+  return ToJSValue(isolate_, presult, result, flags);
+}
+
+// lazy arguments
+JSObject JSEnvImpl::NewLazyFunction(JSLazyFunctionCallback callback,
+                                    void* user_data,
+                                    uint32_t flags /* = 0 */) {
+  if (callback == nullptr) {
+    return nullptr;
+  }
+  Isolate* isolate = isolate_;
+  v8::Locker locker(isolate);
+  EscapableHandleScope escape_handle_scope(isolate);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  LazyFunctionCallbackInfo* record =
+      new LazyFunctionCallbackInfo(callback, user_data, flags | kFlagLazyArgs);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  char profile_name[48];
+  snprintf(profile_name, sizeof(profile_name), "function@%p",
+           reinterpret_cast<void*>(callback));
+  record->profile_entry = callback_profiler_.GetEntry(profile_name);
+#endif
+
+  Local<Function> function;
+  if (!NewCallbackFunction(context, CallLazyFunctionCallback, record, 0,
+                           v8::ConstructorBehavior::kAllow, &function)) {
+    return nullptr;
+  }
+  return ToJSObject(escape_handle_scope.Escape(function));
+}
+
+int JSEnvImpl::GetArgsLength(JSArgs args) {
+  return args ? LazyArguments::From(args)->Length() : 0;
+}
+
+int JSEnvImpl::GetArgType(JSArgs args, int index) {
+  return args ? LazyArguments::From(args)->GetType(index) : JSValue::kNull;
+}
+
+bool JSEnvImpl::GetArg(JSArgs args, int index, JSValue* pvalue) {
+  if (args == nullptr || pvalue == nullptr) {
+    return false;
+  }
+  return LazyArguments::From(args)->Get(index, pvalue);
+}
+
+// typed function
+JSObject JSEnvImpl::NewTypedFunctionWithSignature(JSTypedFunctionThunk thunk,
+                                                  void* function,
+                                                  int return_type,
+                                                  const int* arg_types,
+                                                  int argc) {
+  if (thunk == nullptr || function == nullptr || argc < 0 ||
+      argc > kMaxTypedFunctionArgs || (argc > 0 && arg_types == nullptr)) {
+    return nullptr;
+  }
+
+  for (int i = 0; i < argc; i++) {
+    if (arg_types[i] <= kJSTypeVoid || arg_types[i] > kJSTypeInt64) {
+      return nullptr;
+    }
+  }
+
+  TypedFunctionInfo* info = new TypedFunctionInfo();
+  info->thunk = thunk;
+  info->function = function;
+  info->return_type = return_type;
+  info->argc = argc;
+  for (int i = 0; i < argc; i++) {
+    info->arg_types[i] = static_cast<uint8_t>(arg_types[i]);
+  }
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  Local<Function> v8_function;
+  if (!NewCallbackFunction(context, CallTypedFunction, info, argc,
+                           v8::ConstructorBehavior::kThrow, &v8_function)) {
+    return nullptr;
+  }
+  return ToJSObject(escape_handle_scope.Escape(v8_function));
+}
+
+bool JSEnvImpl::DeleteFunction(JSObject function) {
+  HandleScope handle_scope(isolate_);
+
+  Local<Object> v8_object = ToV8Object(isolate_, function);
+  if (v8_object.IsEmpty() || !v8_object->IsFunction()) {
+    return false;
+  }
+
+  auto range = callback_records_.equal_range(v8_object->GetIdentityHash());
+  for (auto it = range.first; it != range.second; ++it) {
+    CallbackRecord* record = it->second;
+    if (!record->deleted && record->function == v8_object) {
+      record->deleted = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool JSEnvImpl::NewCallbackFunction(Local<Context> context,
+                                    v8::FunctionCallback callback,
+                                    CallbackRecord* record,
+                                    int length,
+                                    v8::ConstructorBehavior behavior,
+                                    Local<Function>* pfunction) {
+  Local<Function> function;
+  if (!Function::New(context, callback, External::New(isolate_, record),
+                     length, behavior)
+           .ToLocal(&function)) {
+    delete record;
+    return false;
+  }
+
+  record->jsenv = this;
+  record->identity_hash = function->GetIdentityHash();
+  record->function.Reset(isolate_, function);
+  record->function.SetWeak(record, OnCallbackFunctionCollected,
+                           v8::WeakCallbackType::kParameter);
+  callback_records_.emplace(record->identity_hash, record);
+
+  *pfunction = function;
+  return true;
+}
+
+void JSEnvImpl::OnCallbackFunctionCollected(
+    const v8::WeakCallbackInfo<CallbackRecord>& info) {
+  CallbackRecord* record = info.GetParameter();
+  // left by DeleteCallbackRecords, the JSEnv may be freed
+  if (record->jsenv == nullptr) {
+    record->function.Reset();
+    delete record;
+    return;
+  }
+  record->jsenv->DeleteCallbackRecord(record);
+}
+
+void JSEnvImpl::DeleteCallbackRecord(CallbackRecord* record) {
+  auto range = callback_records_.equal_range(record->identity_hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == record) {
+      callback_records_.erase(it);
+      break;
+    }
+  }
+  record->function.Reset();
+  if (!record->flush_pending) {
+    delete record;
+  }
+}
+
+// The functions may outlive the JSEnv and hold the records as External
+// data, a JSEnv made later for the isolate would reach them. The records are
+// marked deleted, which the trampolines check, and are freed by the weak
+// callback when the functions are collected.
+void JSEnvImpl::DeleteCallbackRecords() {
+  for (auto& entry : callback_records_) {
+    CallbackRecord* record = entry.second;
+    record->deleted = true;
+    record->flush_pending = false;
+    record->jsenv = nullptr;
+  }
+  callback_records_.clear();
+}
+
+// async function
+JSObject JSEnvImpl::NewAsyncFunction(JSAsyncFunctionCallback callback,
+                                     void* user_data,
+                                     uint32_t flags /* = 0 */) {
+  if (callback == nullptr) {
+    return nullptr;
+  }
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  AsyncFunctionInfo* record = new AsyncFunctionInfo(callback, user_data, flags);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  char profile_name[48];
+  snprintf(profile_name, sizeof(profile_name), "async@%p",
+           reinterpret_cast<void*>(callback));
+  record->profile_entry = callback_profiler_.GetEntry(profile_name);
+#endif
+
+  Local<Function> function;
+  if (!NewCallbackFunction(context, CallAsyncFunction, record, 0,
+                           v8::ConstructorBehavior::kThrow, &function)) {
+    return nullptr;
+  }
+  return ToJSObject(escape_handle_scope.Escape(function));
+}
+
+void JSEnvImpl::CallAsyncFunction(
+    const v8::FunctionCallbackInfo<v8::Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  JSEnvImpl* jsenv = From(isolate);
+
+  if (!jsenv) {
+    return;
+  }
+
+  CallbackRecord* record = CallbackRecord::From(args.Data());
+  if (record->deleted) {
+    return;
+  }
+
+  const AsyncFunctionInfo* pcallback = static_cast<AsyncFunctionInfo*>(record);
+  JSENV_PROFILE_SCOPE(record->profile_entry);
+
+  Local<Promise::Resolver> resolver;
+  if (!Promise::Resolver::New(isolate->GetCurrentContext())
+           .ToLocal(&resolver)) {
+    return;
+  }
+
+  // the completing thread holds its own reference, the token holds none
+  AsyncCompletion* completion = new AsyncCompletion(jsenv);
+  completion->resolver.Reset(isolate, resolver);
+  jsenv->pending_async_.insert(completion);
+
+  Arguments<> arguments(args.Length(), pcallback->flags,
+                        jsenv->callback_arena());
+
+  for (int i = 0; i < args.Length(); i++) {
+    arguments.Add(isolate, args[i]);
+  }
+
+  JSENV_PROFILE_BEGIN_CALLBACK();
+  pcallback->callback(jsenv, pcallback->user_data, ToJSObject(args.This()),
+                      arguments.args, arguments.argc,
+                      completion->ToJSAsyncToken());
+  JSENV_PROFILE_END_CALLBACK();
+
+  args.GetReturnValue().Set(resolver->GetPromise());
+
+  if (!jsenv->HasException()) {
+    return;
+  }
+
+  // a throwing callback consumes the token: the promise is rejected with
+  // the exception instead of the call throwing, unless it's completed
+  // already
+  if (completion->completed.exchange(true)) {
+    jsenv->ClearException();
+    return;
+  }
+  JSValue message(jsenv->exception_.message.c_str());
+  Local<Value> reason = ToV8Value(isolate, &message);
+  jsenv->ClearException();
+  if (resolver->Reject(isolate->GetCurrentContext(), reason)
+          .FromMaybe(false)) {
+    jsenv->settled_promises_++;
+  }
+  jsenv->pending_async_.erase(completion);
+  completion->resolver.Reset();
+  jsenv->DeleteAsyncCompletion(completion);
+}
+
+bool JSEnvImpl::CompleteAsync(JSAsyncToken token,
+                              bool resolve,
+                              const JSValue* pvalue) {
+  // the objects belong to the isolate thread
+  if (token == nullptr || (pvalue && pvalue->IsObject())) {
+    return false;
+  }
+
+  AsyncCompletion* completion = AsyncCompletion::From(token);
+  if (completion->completed.exchange(true)) {
+    ALOGE(TAG, "CompleteAsync: the token is completed already");
+    return false;
+  }
+
+  completion->resolve = resolve;
+  if (pvalue) {
+    completion->value.CopyFrom(*pvalue);
+    if (pvalue->IsExternalString()) {
+      ExternalStringData::From(pvalue->ExternalString())->AddReference();
+    }
+  }
+
+  QueueAsyncCompletion(completion);
+  return true;
+}
+
+bool JSEnvImpl::CompleteAsyncWithSerializedData(JSAsyncToken token,
+                                                bool resolve,
+                                                JSSerializedData data) {
+  if (token == nullptr || data == nullptr) {
+    return false;
+  }
+
+  AsyncCompletion* completion = AsyncCompletion::From(token);
+  if (completion->completed.exchange(true)) {
+    ALOGE(TAG, "CompleteAsync: the token is completed already");
+    return false;
+  }
+
+  completion->resolve = resolve;
+  completion->serialized_data = data;
+
+  QueueAsyncCompletion(completion);
+  return true;
+}
+
+void JSEnvImpl::SetAsyncNotifyCallback(JSAsyncNotifyCallback callback,
+                                       void* user_data) {
+  async_notify_callback_ = callback;
+  async_notify_user_data_ = user_data;
+}
+
+// called on the completing thread, which holds its own reference like the
+// posters of PostTask: the JSEnv outlives the push and WakeUp
+void JSEnvImpl::QueueAsyncCompletion(AsyncCompletion* completion) {
+  switch (async_completions_.Push(completion)) {
+    case AsyncCompletionQueue::kPushedFirst:
+      WakeUp();
+      if (async_notify_callback_) {
+        async_notify_callback_(this, async_notify_user_data_);
+      }
+      break;
+    case AsyncCompletionQueue::kClosed:
+      // detached, the resolver is reset already
+      DeleteAsyncCompletion(completion);
+      break;
+    default:
+      break;
+  }
+}
+
+int JSEnvImpl::RunAsyncCompletions() {
+  if (isolate_ == nullptr) {
+    return 0;
+  }
+
+  AsyncCompletion* completion = async_completions_.TakeAll();
+  if (completion == nullptr) {
+    return 0;
+  }
+
+  v8::Locker locker(isolate_);
+  Isolate::Scope isolate_scope(isolate_);
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Context::Scope context_scope(context);
+
+  int count = 0;
+  while (completion) {
+    AsyncCompletion* next = completion->next;
+    SettleAsyncCompletion(context, completion);
+    pending_async_.erase(completion);
+    completion->resolver.Reset();
+    DeleteAsyncCompletion(completion);
+    completion = next;
+    count++;
+  }
+
+  // one checkpoint for the batch
+  PerformMicrotaskCheckpoint();
+  return count;
+}
+
+void JSEnvImpl::SettleAsyncCompletion(Local<Context> context,
+                                      AsyncCompletion* completion) {
+  HandleScope handle_scope(isolate_);
+
+  Local<Promise::Resolver> resolver = completion->resolver.Get(isolate_);
+  bool resolve = completion->resolve;
+  Local<Value> value;
+
+  if (completion->serialized_data) {
+    JSValue js_value;
+    if (DeserializeValue(completion->serialized_data, &js_value)) {
+      value = ToV8Value(isolate_, &js_value);
+    } else {
+      // reject with the deserialization error
+      resolve = false;
+      JSValue message(exception_.message.c_str());
+      value = ToV8Value(isolate_, &message);
+      ClearException();
+    }
+  } else {
+    value = ToV8Value(isolate_, &completion->value);
+  }
+
+  v8::Maybe<bool> settled = resolve ? resolver->Resolve(context, value)
+                                    : resolver->Reject(context, value);
+  if (settled.FromMaybe(false)) {
+    settled_promises_++;
+  } else {
+    ALOGE(TAG, "RunAsyncCompletions: settle the promise failed");
+  }
+}
+
+void JSEnvImpl::DeleteAsyncCompletion(AsyncCompletion* completion) {
+  if (completion->value.IsExternalString()) {
+    ExternalStringData::From(completion->value.ExternalString())->Release();
+  }
+  if (completion->serialized_data) {
+    DeleteSerializedData(completion->serialized_data);
+  }
+  delete completion;
+}
+
+// The promises of the pending tokens are dropped. The tokens completed
+// later are deleted by their completing threads.
+void JSEnvImpl::CloseAsyncCompletions() {
+  for (AsyncCompletion* completion : pending_async_) {
+    completion->resolver.Reset();
+  }
+  pending_async_.clear();
+
+  AsyncCompletion* completion = async_completions_.Close();
+  while (completion) {
+    AsyncCompletion* next = completion->next;
+    DeleteAsyncCompletion(completion);
+    completion = next;
+  }
+}
+
+// tasks
+bool JSEnvImpl::PostTask(JSTaskCallback callback,
+                         void* user_data,
+                         int priority /* = kJSTaskPriorityNormal */) {
+  if (callback == nullptr || priority < 0 ||
+      priority >= kJSTaskPriorityCount) {
+    return false;
+  }
+
+  // the caller holds a reference, the JSEnv outlives the push and WakeUp
+  PendingTask* task = new PendingTask{callback, user_data, nullptr};
+
+  switch (task_queues_[priority].Push(task)) {
+    case MPSCQueue<PendingTask>::kPushedFirst:
+      WakeUp();
+      return true;
+    case MPSCQueue<PendingTask>::kClosed:
+      delete task;
+      return false;
+    default:
+      return true;
+  }
+}
+
+int JSEnvImpl::GetTaskWakeupFd() {
+  return wakeup_fd_;
+}
+
+void JSEnvImpl::WakeUp() {
+  if (wakeup_fd_ < 0) {
+    return;
+  }
+
+  uint64_t value = 1;
+  ssize_t written;
+  do {
+    written = write(wakeup_fd_, &value, sizeof(value));
+  } while (written < 0 && errno == EINTR);
+  // EAGAIN: the counter is saturated, the fd is readable anyway
+  if (written < 0 && errno != EAGAIN) {
+    ALOGE(TAG, "WakeUp: write the wakeup fd failed: %d", errno);
+  }
+}
+
+int JSEnvImpl::RunPendingTasks(int64_t budget_us /* = -1 */) {
+  if (isolate_ == nullptr) {
+    return 0;
+  }
+
+  // clear the fd before the queues are taken, a task posted later wakes it
+  // up again
+  if (wakeup_fd_ >= 0) {
+    uint64_t value;
+    ssize_t got;
+    do {
+      got = read(wakeup_fd_, &value, sizeof(value));
+    } while (got < 0 && errno == EINTR);
+    // EAGAIN: nothing was posted since the last run
+    if (got < 0 && errno != EAGAIN) {
+      ALOGE(TAG, "RunPendingTasks: read the wakeup fd failed: %d", errno);
+    }
+  }
+
+  RunAsyncCompletions();
+
+  for (int i = 0; i < kJSTaskPriorityCount; i++) {
+    for (PendingTask* task = task_queues_[i].TakeAll(); task;) {
+      PendingTask* next = task->next;
+      ready_tasks_[i].push_back(task);
+      task = next;
+    }
+  }
+
+  v8::Locker locker(isolate_);
+  Isolate::Scope isolate_scope(isolate_);
+  HandleScope handle_scope(isolate_);
+  Context::Scope context_scope(J2V8RuntimeGetContext(runtime_));
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  int count = 0;
+  bool has_more = false;
+
+  for (int i = 0; i < kJSTaskPriorityCount; i++) {
+    std::deque<PendingTask*>& tasks = ready_tasks_[i];
+    while (!tasks.empty()) {
+      if (count > 0 && budget_us >= 0 &&
+          (base::TimeTicks::Now() - start).InMicroseconds() >= budget_us) {
+        has_more = true;
+        break;
+      }
+
+      PendingTask* task = tasks.front();
+      tasks.pop_front();
+      task->callback(this, task->user_data);
+      delete task;
+      count++;
+    }
+    if (has_more) {
+      break;
+    }
+  }
+
+  if (count > 0) {
+    PerformMicrotaskCheckpoint();
+  }
+
+  if (finalizers_.HasDeferred()) {
+    int64_t elapsed_us = (base::TimeTicks::Now() - start).InMicroseconds();
+    finalizers_.RunDeferred(
+        budget_us >= 0 ? std::max<int64_t>(budget_us - elapsed_us, 0) : -1);
+  }
+
+  if (has_more || finalizers_.HasDeferred()) {
+    WakeUp();
+  }
+  return count;
+}
+
+// the tasks left are called with a null JSEnv to free their user data
+void JSEnvImpl::CloseTaskQueues() {
+  for (int i = 0; i < kJSTaskPriorityCount; i++) {
+    for (PendingTask* task = task_queues_[i].Close(); task;) {
+      PendingTask* next = task->next;
+      ready_tasks_[i].push_back(task);
+      task = next;
+    }
+
+    for (PendingTask* task : ready_tasks_[i]) {
+      task->callback(nullptr, task->user_data);
+      delete task;
+    }
+    ready_tasks_[i].clear();
+  }
+}
+
+// microtasks
+static_assert(kJSMicrotaskPolicyExplicit ==
+                      static_cast<int>(v8::MicrotasksPolicy::kExplicit) &&
+                  kJSMicrotaskPolicyScoped ==
+                      static_cast<int>(v8::MicrotasksPolicy::kScoped) &&
+                  kJSMicrotaskPolicyAuto ==
+                      static_cast<int>(v8::MicrotasksPolicy::kAuto),
+              "the microtask policies must match v8::MicrotasksPolicy");
+
+bool JSEnvImpl::SetMicrotaskPolicy(int policy) {
+  if (policy < kJSMicrotaskPolicyExplicit || policy > kJSMicrotaskPolicyAuto) {
+    return false;
+  }
+  isolate_->SetMicrotasksPolicy(static_cast<v8::MicrotasksPolicy>(policy));
+  return true;
+}
+
+int JSEnvImpl::GetMicrotaskPolicy() {
+  return static_cast<int>(isolate_->GetMicrotasksPolicy());
+}
+
+void JSEnvImpl::PerformMicrotaskCheckpoint() {
+  HandleScope handle_scope(isolate_);
+  Context::Scope context_scope(J2V8RuntimeGetContext(runtime_));
+  isolate_->PerformMicrotaskCheckpoint();
+}
+
+int JSEnvImpl::GetSettledPromiseCount() {
+  return settled_promises_;
+}
+
+// called after every checkpoint, the automatic ones too
+void JSEnvImpl::OnMicrotasksCompleted(Isolate* isolate, void* data) {
+  JSEnvImpl* jsenv = reinterpret_cast<JSEnvImpl*>(data);
+  jsenv->settled_promises_ = 0;
+  jsenv->FlushBatchedCalls();
+}
+
+// called when the outermost call into V8 returns. The auto policy skips the
+// checkpoint when the microtask queue is empty, the batched calls are
+// flushed here then; the explicit policy keeps them for its checkpoint.
+void JSEnvImpl::OnCallCompleted(Isolate* isolate) {
+  JSEnvImpl* jsenv = From(isolate);
+  if (jsenv == nullptr ||
+      isolate->GetMicrotasksPolicy() == v8::MicrotasksPolicy::kExplicit) {
+    return;
+  }
+  jsenv->FlushBatchedCalls();
+}
+
+// prepared call
+JSPreparedCall JSEnvImpl::PrepareCall(JSObject function,
+                                      JSObject self,
+                                      int argc) {
+  if (argc < 0) {
+    return nullptr;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  Local<Object> v8_function_object = ToV8Object(isolate_, function);
+  if (v8_function_object.IsEmpty() || !v8_function_object->IsFunction()) {
+    return nullptr;
+  }
+
+  Local<Object> v8_self = ToV8Object(isolate_, self);
+  if (v8_self.IsEmpty()) {
+    v8_self = context->Global();
+  } else if (!v8_self->IsObject()) {
+    return nullptr;
+  }
+
+  PreparedCall* call = new PreparedCall(
+      isolate_, v8_function_object.As<Function>(), v8_self, argc);
+  prepared_calls_.insert(call);
+  return call->ToJSPreparedCall();
+}
+
+bool JSEnvImpl::InvokePreparedCall(JSPreparedCall call,
+                                   const JSValue* argv,
+                                   JSValue* presult,
+                                   uint32_t flags /* = 0*/) {
+  if (call == nullptr) {
+    return false;
+  }
+
+  PreparedCall* prepared_call = PreparedCall::From(call);
+  if (prepared_call->IsEmpty()) {
+    return false;
+  }
+
+  EscapableHandleScope escape_handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  int argc = prepared_call->argc();
+  Local<Value>* args = prepared_call->args();
+  for (int i = 0; i < argc; i++) {
+    args[i] = ToV8Value(isolate_, &argv[i]);
+    if (args[i].IsEmpty()) {
+      args[i] = v8::Null(isolate_);
+    }
+  }
+
+  MicrotasksCallScope microtasks_scope(isolate_);
+  TryCatch try_catch(isolate_);
+
+  Local<Value> result;
+  if (!prepared_call->function(isolate_)
+           ->Call(context, prepared_call->self(isolate_), argc, args)
+           .ToLocal(&result)) {
+    // the exception is only formatted on this path
+    if (try_catch.HasCaught()) {
+      ThrowException(&try_catch);
+    }
+    return false;
+  }
+
+  if (presult) {
+    return ToJSValue(isolate_, presult, escape_handle_scope.Escape(result),
+                     flags);
+  }
+  return true;
+}
+
+void JSEnvImpl::DeletePreparedCall(JSPreparedCall call) {
+  if (call == nullptr) {
+    return;
+  }
+
+  PreparedCall* prepared_call = PreparedCall::From(call);
+  prepared_calls_.erase(prepared_call);
+  delete prepared_call;
+}
+
+// event channel
+JSEventChannel JSEnvImpl::CreateEventChannel() {
+  EventChannel* channel = new EventChannel();
+  event_channels_.insert(channel);
+  return channel->ToJSEventChannel();
+}
+
+void JSEnvImpl::DeleteEventChannel(JSEventChannel channel) {
+  if (channel == nullptr) {
+    return;
+  }
+
+  EventChannel* event_channel = EventChannel::From(channel);
+  // the JS object may outlive the channel, its methods do nothing then
+  if (isolate_ && !event_channel->object().IsEmpty()) {
+    HandleScope handle_scope(isolate_);
+    event_channel->object().Get(isolate_)->SetAlignedPointerInInternalField(
+        0, nullptr);
+  }
+  event_channels_.erase(event_channel);
+  // called by a listener, the emit loop still reads the channel
+  if (event_channel->emitting()) {
+    event_channel->MarkDeleted();
+    return;
+  }
+  event_channel->Reset();
+  delete event_channel;
+}
+
+Local<FunctionTemplate> JSEnvImpl::GetEventChannelTemplate() {
+  if (!event_channel_template_.IsEmpty()) {
+    return event_channel_template_.Get(isolate_);
+  }
+
+  Local<FunctionTemplate> templ = FunctionTemplate::New(isolate_);
+  templ->SetClassName(ToV8String(isolate_, "EventChannel"));
+  templ->InstanceTemplate()->SetInternalFieldCount(1);
+
+  // the methods throw if they're called on another object
+  Local<v8::Signature> signature = v8::Signature::New(isolate_, templ);
+  Local<ObjectTemplate> prototype = templ->PrototypeTemplate();
+  prototype->Set(ToV8String(isolate_, "addListener"),
+                 FunctionTemplate::New(isolate_, EventChannelAddListener,
+                                       Local<Value>(), signature, 1));
+  prototype->Set(ToV8String(isolate_, "removeListener"),
+                 FunctionTemplate::New(isolate_, EventChannelRemoveListener,
+                                       Local<Value>(), signature, 1));
+
+  event_channel_template_.Reset(isolate_, templ);
+  return templ;
+}
+
+JSObject JSEnvImpl::GetEventChannelObject(JSEventChannel channel) {
+  if (channel == nullptr) {
+    return nullptr;
+  }
+
+  EventChannel* event_channel = EventChannel::From(channel);
+  EscapableHandleScope escape_handle_scope(isolate_);
+
+  if (!event_channel->object().IsEmpty()) {
+    return ToJSObject(
+        escape_handle_scope.Escape(event_channel->object().Get(isolate_)));
+  }
+
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Local<Function> constructor;
+  Local<Object> object;
+  if (!GetEventChannelTemplate()->GetFunction(context).ToLocal(&constructor) ||
+      !constructor->NewInstance(context).ToLocal(&object)) {
+    return nullptr;
+  }
+
+  object->SetAlignedPointerInInternalField(0, event_channel);
+  event_channel->object().Reset(isolate_, object);
+  event_channel->object().SetWeak();
+
+  return ToJSObject(escape_handle_scope.Escape(object));
+}
+
+void JSEnvImpl::EventChannelAddListener(
+    const v8::FunctionCallbackInfo<v8::Value>& args) {
+  EventChannel* channel = reinterpret_cast<EventChannel*>(
+      args.Holder()->GetAlignedPointerFromInternalField(0));
+  if (channel == nullptr || args.Length() < 1 || !args[0]->IsFunction()) {
+    return;
+  }
+
+  args.GetReturnValue().Set(
+      channel->AddListener(args.GetIsolate(), args[0].As<Function>()));
+}
+
+void JSEnvImpl::EventChannelRemoveListener(
+    const v8::FunctionCallbackInfo<v8::Value>& args) {
+  EventChannel* channel = reinterpret_cast<EventChannel*>(
+      args.Holder()->GetAlignedPointerFromInternalField(0));
+  if (channel == nullptr || args.Length() < 1 || !args[0]->IsFunction()) {
+    return;
+  }
+
+  args.GetReturnValue().Set(channel->RemoveListener(args[0].As<Function>()));
+}
+
+bool JSEnvImpl::AddEventListener(JSEventChannel channel, JSObject listener) {
+  if (channel == nullptr) {
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Object> v8_listener = ToV8Object(isolate_, listener);
+  if (v8_listener.IsEmpty() || !v8_listener->IsFunction()) {
+    return false;
+  }
+
+  return EventChannel::From(channel)->AddListener(isolate_,
+                                                  v8_listener.As<Function>());
+}
+
+bool JSEnvImpl::RemoveEventListener(JSEventChannel channel,
+                                    JSObject listener) {
+  if (channel == nullptr) {
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Object> v8_listener = ToV8Object(isolate_, listener);
+  if (v8_listener.IsEmpty() || !v8_listener->IsFunction()) {
+    return false;
+  }
+
+  return EventChannel::From(channel)->RemoveListener(
+      v8_listener.As<Function>());
+}
+
+int JSEnvImpl::GetEventListenerCount(JSEventChannel channel) {
+  return channel ? EventChannel::From(channel)->ListenerCount() : 0;
+}
+
+int JSEnvImpl::EmitEvent(JSEventChannel channel,
+                         const JSValue* argv,
+                         int argc) {
+  if (channel == nullptr) {
+    return -1;
+  }
+
+  EventChannel* event_channel = EventChannel::From(channel);
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Context::Scope context_scope(context);
+
+  // the payload is converted once for all the listeners
+  V8Arguments<> arguments(isolate_, argv, argc);
+  Local<Value> receiver = v8::Undefined(isolate_);
+
+  MicrotasksCallScope microtasks_scope(isolate_);
+  TryCatch try_catch(isolate_);
+
+  std::string errors;
+  int count = 0;
+
+  event_channel->BeginEmit();
+  size_t size = event_channel->size();
+  for (size_t i = 0; i < size; i++) {
+    Local<Function> listener = event_channel->listener(isolate_, i);
+    if (listener.IsEmpty()) {
+      continue;
+    }
+
+    count++;
+    if (!listener->Call(context, receiver, arguments.argc, arguments.args)
+             .IsEmpty()) {
+      continue;
+    }
+
+    if (try_catch.HasCaught()) {
+      if (!errors.empty()) {
+        errors += '\n';
+      }
+      errors += FormatException(&try_catch);
+    }
+    // TerminateExecution
+    if (!try_catch.CanContinue()) {
+      break;
+    }
+    try_catch.Reset();
+  }
+  event_channel->EndEmit();
+  // deleted by a listener
+  if (event_channel->deleted() && !event_channel->emitting()) {
+    delete event_channel;
+  }
+
+  if (!errors.empty()) {
+    exception_.Set(JSException::kJSException, errors);
+  }
+  return count;
+}
+
+// batched domain calls
+bool JSEnvImpl::RegisterBatchedCallback(J2V8ObjectHandle object,
+                                        const char* domain,
+                                        JSBatchedCallsCallback callback,
+                                        void* user_data) {
+  if (domain == nullptr || callback == nullptr) {
+    return false;
+  }
+
+  BatchedCallbackInfo* record = new BatchedCallbackInfo(callback, user_data);
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  record->profile_entry = callback_profiler_.GetEntry(domain);
+#endif
+
+  return RegisterDomainFunction(object, domain, CallBatchedCallback, record);
+}
+
+// A batched call in the buffer is a kind byte and the uint32 argc, then
+//   kBatchedNative: |argc| arguments of a tag byte and the value, a string
+//                   is the uint32 length, the utf8 bytes and '\0'
+//   kBatchedClone: the structured clone of the Array of the arguments
+enum : uint8_t {
+  kBatchedNative,
+  kBatchedClone,
+  kBatchedNull,
+  kBatchedTrue,
+  kBatchedFalse,
+  kBatchedInt,
+  kBatchedDouble,
+  kBatchedBigInt64,
+  kBatchedBigUint64,
+  kBatchedString,
+};
+
+template <typename T>
+static inline void AppendBatched(std::vector<uint8_t>* buffer, T value) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  buffer->insert(buffer->end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static inline const uint8_t* ReadBatched(const uint8_t* data, T* pvalue) {
+  memcpy(pvalue, data, sizeof(T));
+  return data + sizeof(T);
+}
+
+// false if |value| needs the structured clone
+static bool EncodeBatchedArgument(Isolate* isolate,
+                                  Local<Value> value,
+                                  std::vector<uint8_t>* buffer) {
+  if (value->IsNullOrUndefined()) {
+    buffer->push_back(kBatchedNull);
+  } else if (value->IsTrue()) {
+    buffer->push_back(kBatchedTrue);
+  } else if (value->IsFalse()) {
+    buffer->push_back(kBatchedFalse);
+  } else if (value->IsInt32()) {
+    buffer->push_back(kBatchedInt);
+    AppendBatched(buffer, value.As<v8::Int32>()->Value());
+  } else if (value->IsNumber()) {
+    buffer->push_back(kBatchedDouble);
+    AppendBatched(buffer, value.As<v8::Number>()->Value());
+  } else if (value->IsBigInt()) {
+    Local<v8::BigInt> big_int = value.As<v8::BigInt>();
+    bool lossless = false;
+    int64_t i64 = big_int->Int64Value(&lossless);
+    if (lossless) {
+      buffer->push_back(kBatchedBigInt64);
+      AppendBatched(buffer, i64);
+      return true;
+    }
+    uint64_t u64 = big_int->Uint64Value(&lossless);
+    if (!lossless) {
+      return false;
+    }
+    buffer->push_back(kBatchedBigUint64);
+    AppendBatched(buffer, u64);
+  } else if (value->IsString()) {
+    // written in place, a utf16 code unit takes at most 3 bytes in utf8
+    Local<String> str = value.As<String>();
+    int capacity = (str->IsOneByte() ? 2 : 3) * str->Length();
+    size_t start = buffer->size();
+    buffer->resize(start + 1 + sizeof(uint32_t) + capacity + 1);
+    char* chars = reinterpret_cast<char*>(buffer->data() + start + 1 +
+                                          sizeof(uint32_t));
+    uint32_t length = static_cast<uint32_t>(str->WriteUtf8(
+        isolate, chars, capacity, nullptr,
+        String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8));
+    chars[length] = '\0';
+    (*buffer)[start] = kBatchedString;
+    memcpy(buffer->data() + start + 1, &length, sizeof(length));
+    buffer->resize(start + 1 + sizeof(uint32_t) + length + 1);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// returns the arguments read into |argv|
+static uint32_t DecodeBatchedCall(const uint8_t* data,
+                                  size_t size,
+                                  JSValue* argv,
+                                  JSBatchedCall* call) {
+  uint8_t kind = data[0];
+  uint32_t argc;
+  const uint8_t* p = ReadBatched(data + 1, &argc);
+  call->argc = static_cast<int>(argc);
+
+  if (kind == kBatchedClone) {
+    call->argv = nullptr;
+    call->data = p;
+    call->size = size - (p - data);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < argc; i++) {
+    switch (*p++) {
+      case kBatchedTrue:
+        argv[i].Set(true);
+        break;
+      case kBatchedFalse:
+        argv[i].Set(false);
+        break;
+      case kBatchedInt: {
+        int32_t ival;
+        p = ReadBatched(p, &ival);
+        argv[i].Set(static_cast<int>(ival));
+        break;
+      }
+      case kBatchedDouble: {
+        double dval;
+        p = ReadBatched(p, &dval);
+        argv[i].Set(dval);
+        break;
+      }
+      case kBatchedBigInt64: {
+        int64_t i64;
+        p = ReadBatched(p, &i64);
+        argv[i].SetBigInt(i64);
+        break;
+      }
+      case kBatchedBigUint64: {
+        uint64_t u64;
+        p = ReadBatched(p, &u64);
+        argv[i].SetBigUint(u64);
+        break;
+      }
+      case kBatchedString: {
+        uint32_t length;
+        p = ReadBatched(p, &length);
+        argv[i].Set(reinterpret_cast<const char*>(p),
+                    static_cast<int>(length), false);
+        p += length + 1;
+        break;
+      }
+      case kBatchedNull:
+      default:
+        argv[i].SetNull();
+        break;
+    }
+  }
+
+  call->argv = argv;
+  call->data = nullptr;
+  call->size = 0;
+  return argc;
+}
+
+void JSEnvImpl::CallBatchedCallback(
+    const v8::FunctionCallbackInfo<v8::Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  JSEnvImpl* jsenv = From(isolate);
+
+  if (!jsenv) {
+    return;
+  }
+
+  CallbackRecord* record = CallbackRecord::From(args.Data());
+  if (record->deleted) {
+    return;
+  }
+
+  BatchedCallbackInfo* pcallback = static_cast<BatchedCallbackInfo*>(record);
+  JSENV_PROFILE_SCOPE(record->profile_entry);
+
+  // the primitives and the strings are encoded without V8 objects, the
+  // consumer reads them without entering the isolate
+  std::vector<uint8_t>& buffer = pcallback->buffer;
+  size_t call_start = buffer.size();
+  uint32_t argc = static_cast<uint32_t>(args.Length());
+  buffer.push_back(kBatchedNative);
+  AppendBatched(&buffer, argc);
+  bool native = true;
+  for (int i = 0; native && i < args.Length(); i++) {
+    native = EncodeBatchedArgument(isolate, args[i], &buffer);
+  }
+
+  if (native) {
+    pcallback->arg_count += argc;
+  } else {
+    buffer.resize(call_start);
+    if (!SerializeBatchedCall(args, &buffer)) {
+      return;
+    }
+  }
+
+  if (pcallback->call_ends.empty()) {
+    pcallback->flush_pending = true;
+    jsenv->batched_records_.push_back(pcallback);
+  }
+  pcallback->call_ends.push_back(buffer.size());
+}
+
+// the structured clone fallback of CallBatchedCallback
+bool JSEnvImpl::SerializeBatchedCall(
+    const v8::FunctionCallbackInfo<v8::Value>& args,
+    std::vector<uint8_t>* pbuffer) {
+  Isolate* isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  Local<Value> base_values[8];
+  std::unique_ptr<Local<Value>[]> heap_values;
+  Local<Value>* values = base_values;
+  if (args.Length() > 8) {
+    heap_values.reset(new Local<Value>[args.Length()]);
+    values = heap_values.get();
+  }
+  for (int i = 0; i < args.Length(); i++) {
+    values[i] = args[i];
+  }
+  Local<Array> arguments = Array::New(isolate, values, args.Length());
+
+  // a DataCloneError is thrown to the caller
+  SerializerDelegate delegate(isolate);
+  v8::ValueSerializer serializer(isolate, &delegate);
+  serializer.WriteHeader();
+  if (!serializer.WriteValue(context, arguments).FromMaybe(false)) {
+    return false;
+  }
+
+  std::pair<uint8_t*, size_t> buffer = serializer.Release();
+  pbuffer->push_back(kBatchedClone);
+  AppendBatched(pbuffer, static_cast<uint32_t>(args.Length()));
+  pbuffer->insert(pbuffer->end(), buffer.first, buffer.first + buffer.second);
+  free(buffer.first);
+  return true;
+}
+
+void JSEnvImpl::FlushBatchedCalls() {
+  // the calls queued by a callback, or by a checkpoint in a callback, wait
+  // for the next flush
+  if (flushing_batched_calls_ || batched_records_.empty() ||
+      isolate_ == nullptr) {
+    return;
+  }
+  flushing_batched_calls_ = true;
+
+  // the host may flush outside of any JS callback, the callbacks use V8
+  v8::Locker locker(isolate_);
+  Isolate::Scope isolate_scope(isolate_);
+  HandleScope handle_scope(isolate_);
+  Context::Scope context_scope(J2V8RuntimeGetContext(runtime_));
+
+  std::vector<BatchedCallbackInfo*> records;
+  records.swap(batched_records_);
+
+  std::vector<JSBatchedCall> calls;
+  std::vector<JSValue> argv;
+  for (BatchedCallbackInfo* record : records) {
+    std::vector<uint8_t> buffer;
+    std::vector<size_t> call_ends;
+    buffer.swap(record->buffer);
+    call_ends.swap(record->call_ends);
+
+    calls.resize(call_ends.size());
+    argv.resize(record->arg_count);
+    record->arg_count = 0;
+    size_t start = 0;
+    size_t arg_start = 0;
+    for (size_t i = 0; i < call_ends.size(); i++) {
+      arg_start += DecodeBatchedCall(buffer.data() + start,
+                                     call_ends[i] - start,
+                                     argv.data() + arg_start, &calls[i]);
+      start = call_ends[i];
+    }
+
+    record->callback(this, record->user_data, calls.data(),
+                     static_cast<int>(calls.size()));
+
+    // queued again by the callback, it's kept for the next flush
+    if (!record->call_ends.empty()) {
+      continue;
+    }
+    record->flush_pending = false;
+    if (record->function.IsEmpty()) {
+      delete record;
+      continue;
+    }
+    // the capacity is reused by the next batch
+    buffer.clear();
+    record->buffer.swap(buffer);
+  }
+
+  flushing_batched_calls_ = false;
+}
+
+// queued finalizers
+int JSEnvImpl::RunPendingFinalizers(int64_t budget_us /* = -1 */) {
+  return finalizers_.RunDeferred(budget_us);
+}
+
+void JSEnvImpl::GetFinalizeStats(JSFinalizeStats* pstats) {
+  if (pstats) {
+    finalizers_.GetStats(pstats);
+  }
+}
+
+void JSEnvImpl::ResetFinalizeStats() {
+  finalizers_.ResetStats();
+}
+
+void JSEnvImpl::QueueFinalizer(const FinalizerQueue::Finalizer& finalizer,
+                               bool background) {
+  if (background) {
+    finalizers_.PushBackground(finalizer);
+  } else if (finalizers_.PushDeferred(finalizer)) {
+    WakeUp();
+  }
+}
+
+// batched property access
+bool JSEnvImpl::GetObjectProperties(JSObject object,
+                                    const JSValue* keys,
+                                    int count,
+                                    JSValue* values,
+                                    uint32_t flags /* = 0*/) {
+  return GetProperties(object, keys, count, values, flags);
+}
+
+bool JSEnvImpl::GetObjectProperties(JSObject object,
+                                    const JSPropertyKey* keys,
+                                    int count,
+                                    JSValue* values,
+                                    uint32_t flags /* = 0*/) {
+  return GetProperties(object, keys, count, values, flags);
+}
+
+bool JSEnvImpl::SetObjectProperties(JSObject object,
+                                    const JSValue* keys,
+                                    const JSValue* values,
+                                    int count) {
+  return SetProperties(object, keys, values, count);
+}
+
+bool JSEnvImpl::SetObjectProperties(JSObject object,
+                                    const JSPropertyKey* keys,
+                                    const JSValue* values,
+                                    int count) {
+  return SetProperties(object, keys, values, count);
+}
+
+template <typename TKey>
+bool JSEnvImpl::GetProperties(JSObject object,
+                              const TKey* keys,
+                              int count,
+                              JSValue* values,
+                              uint32_t flags) {
+  if (keys == nullptr || values == nullptr || count <= 0) {
+    return false;
+  }
+
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Local<Object> v8_object = ToV8Object(isolate_, object);
+
+  if (v8_object.IsEmpty()) {
+    return false;
+  }
+
+  return GetValues(static_cast<uint32_t>(count), values, flags,
+                   [&](uint32_t i, Local<Value>* pvalue) {
+                     Local<Value> key = ToV8Key(isolate_, keys[i]);
+                     return !key.IsEmpty() &&
+                            v8_object->Get(context, key).ToLocal(pvalue);
+                   });
+}
+
+// The keys and the primitive results are released with a per-iteration
+// scope. An object result must outlive the call: it's escaped to the
+// caller's scope, there's no scope between them.
+template <typename TGet>
+bool JSEnvImpl::GetValues(uint32_t count,
+                          JSValue* values,
+                          uint32_t flags,
+                          const TGet& get) {
+  bool bret = true;
+  for (uint32_t i = 0; i < count; i++) {
+    EscapableHandleScope item_scope(isolate_);
+    Local<Value> value;
+    if (!get(i, &value)) {
+      values[i].SetNull();
+      bret = false;
+      continue;
+    }
+    if (value->IsObject()) {
+      value = item_scope.Escape(value);
+    }
+    if (!ToJSValue(isolate_, &values[i], value, flags)) {
+      values[i].SetNull();
+      bret = false;
+    }
+  }
+  return bret;
+}
+
+template <typename TKey>
+bool JSEnvImpl::SetProperties(JSObject object,
+                              const TKey* keys,
+                              const JSValue* values,
+                              int count) {
+  if (keys == nullptr || values == nullptr || count <= 0) {
+    return false;
+  }
+
+  HandleScope handle_scope(isolate_);
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+  Local<Object> v8_object = ToV8Object(isolate_, object);
+
+  if (v8_object.IsEmpty()) {
+    return false;
+  }
+
+  bool bret = true;
+  for (int i = 0; i < count; i++) {
+    Local<Value> key = ToV8Key(isolate_, keys[i]);
+    Local<Value> value = ToV8Value(isolate_, &values[i]);
+    if (value.IsEmpty()) {
+      value = v8::Null(isolate_);
+    }
+    if (key.IsEmpty() || !v8_object->Set(context, key, value).FromMaybe(false)) {
+      bret = false;
+    }
+  }
+
+  return bret;
+}
+
+Local<Object> JSEnvImpl::CallConstructor(Local<Function> function,
+                                         const JSValue* args,
+                                         int argc) {
+  Isolate* isolate = isolate_;
+
+  Local<Context> context = J2V8RuntimeGetContext(runtime_);
+
+  MicrotasksCallScope microtasks_scope(isolate);
+  TryCatch try_catch(isolate);
+
+  V8Arguments<> arguments(isolate, args, argc);
+
+  Local<Value> result;
+
+  if (!function->NewInstance(context, arguments.argc, arguments.args)
+           .ToLocal(&result)) {
+    return Local<Object>();
+  }
+
+  if (try_catch.HasCaught()) {
+    ThrowException(&try_catch);
+    return Local<Object>();
+  }
+
+  return result.As<Object>();
+}
+
+///////////////////////////////////////
+bool RegisterBuiltins(J2V8Runtime* runtime,
+                      Isolate* isolate,
+                      Local<Context> context);
+
+const StartupData* GetCustomJsSnapshot(const char* nativejs_snapshot_so_name) {
+  if (nativejs_snapshot_so_name == NULL) {
+    return nullptr;
+  }
+  void* nativejs_handle = dlopen(nativejs_snapshot_so_name, RTLD_NOW);
+  if (!nativejs_handle) {
+    ALOGE(TAG, "GetCustomJsSnapshot: dlopen error:%s",
+          nativejs_snapshot_so_name);
+    return nullptr;
+  }
+  get_nativejs_blob_cb get_nativejs_blob =
+      reinterpret_cast<get_nativejs_blob_cb>(
+          dlsym(nativejs_handle, NATIVEJS_SNAPSHOT_ENTRY));
+  if (!get_nativejs_blob) {
+    ALOGE(TAG, "GetCustomJsSnapshot: dlsym error:%s", NATIVEJS_SNAPSHOT_ENTRY);
+    return nullptr;
+  }
+  return reinterpret_cast<const v8::StartupData*>(get_nativejs_blob());
+}
+
+void JSEnvImpl::AddExternalReferences(std::vector<intptr_t>* prefs) {
+  const intptr_t refs[] = {
+      reinterpret_cast<intptr_t>(CallUserCallback),
+      reinterpret_cast<intptr_t>(CallJSFunctionCallback),
+      reinterpret_cast<intptr_t>(CallTypedFunction),
+      reinterpret_cast<intptr_t>(CallAsyncFunction),
+      reinterpret_cast<intptr_t>(CallBatchedCallback),
+      reinterpret_cast<intptr_t>(EventChannelAddListener),
+      reinterpret_cast<intptr_t>(EventChannelRemoveListener),
+      reinterpret_cast<intptr_t>(CallLazyFunctionCallback),
+  };
+  prefs->insert(prefs->end(), std::begin(refs), std::end(refs));
+}
+
+// The table is appended to, never reordered: a snapshot holds the indexes,
+// the snapshot and the library must be built with the same table.
+const intptr_t* GetExternalReferences() {
+  static const std::vector<intptr_t>* references = [] {
+    std::vector<intptr_t>* refs = new std::vector<intptr_t>();
+    JSEnvImpl::AddExternalReferences(refs);
+    JSClassTemplate::AddExternalReferences(refs);
+    refs->push_back(0);
+    return refs;
+  }();
+  return references->data();
+}
+
+// JSEnv::CreateSnapshot
+static bool CreateSnapshot(const char* script,
+                           JSSnapshotWriteCallback write_callback,
+                           void* user_data) {
+  if (write_callback == nullptr) {
+    return false;
+  }
+
+  v8::SnapshotCreator creator(GetExternalReferences());
+  Isolate* isolate = creator.GetIsolate();
+  StartupData blob;
+  bool ok = true;
+  {
+    Locker locker(isolate);
+    {
+      HandleScope handle_scope(isolate);
+      Local<Context> context = Context::New(isolate);
+      if (script) {
+        Context::Scope context_scope(context);
+        TryCatch try_catch(isolate);
+        Local<String> source;
+        Local<Script> compiled;
+        ok = String::NewFromUtf8(isolate, script).ToLocal(&source) &&
+             Script::Compile(context, source).ToLocal(&compiled) &&
+             !compiled->Run(context).IsEmpty();
+        if (!ok) {
+          ALOGE(TAG, "CreateSnapshot: the script failed");
+        }
+      }
+      creator.SetDefaultContext(context);
+      ok = ok && JSClassTemplate::AddSnapshotClasses(&creator);
+    }
+    // the blob is made even if it's dropped, the creator requires it
+    blob = creator.CreateBlob(
+        v8::SnapshotCreator::FunctionCodeHandling::kClear);
+  }
+
+  ok = ok && blob.data != nullptr;
+  if (ok) {
+    write_callback(blob.data, blob.raw_size, user_data);
+  }
+  delete[] blob.data;
+  return ok;
+}
+
+// extern "C" void* QuickAppJSRuntimeInit(void* vm, void* context);
+// extern "C" void QuickAppJSRuntimeDeInit(void* isolate);
+
+bool OnCreateIsolate(J2V8Runtime* runtime) {
+  Isolate* isolate = J2V8RuntimeGetIsolate(runtime);
+  HandleScope handle_scope(isolate);
+  Local<Context> context = J2V8RuntimeGetContext(runtime);
+  Context::Scope context_scope(context);
+
+  JSEnvImpl* jsenv = JSEnvImpl::From(runtime);
 
   // Init native api for js
   JSBindingConnection::Init(jsenv);
@@ -1829,14 +4263,42 @@ static void TestPrint(const FunctionCallbackInfo<Value>& args) {
   ALOGD("JSENV PRINT", "%s", oss.str().c_str());
 }
 
+// JSENV_TEST_SNAPSHOT names a blob file of JSEnv::CreateSnapshot, the
+// runtime is made from it. The blob is kept.
+static StartupData* LoadTestSnapshot() {
+  const char* file_name = getenv("JSENV_TEST_SNAPSHOT");
+  FILE* fp = file_name ? fopen(file_name, "rb") : nullptr;
+  if (fp == nullptr) {
+    return nullptr;
+  }
+
+  std::string* data = new std::string();
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    data->append(buffer, size);
+  }
+  fclose(fp);
+
+  StartupData* blob = new StartupData();
+  blob->data = data->data();
+  blob->raw_size = static_cast<int>(data->size());
+  return blob;
+}
+
 static J2V8Handle create_test_j2v8handle() {
-  std::unique_ptr<v8::Platform> v8Platform;
+  // a test may make more than one runtime
+  static std::unique_ptr<v8::Platform> v8Platform;
 
-  v8::V8::InitializeICUDefaultLocation("", nullptr);
-  v8Platform = v8::platform::NewDefaultPlatform();
+  if (!v8Platform) {
+    // the finalizer tests collect by gc()
+    v8::V8::SetFlagsFromString("--expose-gc");
+    v8::V8::InitializeICUDefaultLocation("", nullptr);
+    v8Platform = v8::platform::NewDefaultPlatform();
 
-  v8::V8::InitializePlatform(v8Platform.get());
-  v8::V8::Initialize();
+    v8::V8::InitializePlatform(v8Platform.get());
+    v8::V8::Initialize();
+  }
 
   V8Runtime* runtime = new V8Runtime();
   runtime->globalObject = nullptr;
@@ -1844,8 +4306,13 @@ static J2V8Handle create_test_j2v8handle() {
   Isolate::CreateParams create_params;
   create_params.array_buffer_allocator =
       ArrayBuffer::Allocator::NewDefaultAllocator();
+  create_params.snapshot_blob = LoadTestSnapshot();
+  if (create_params.snapshot_blob) {
+    create_params.external_references = GetExternalReferences();
+  }
   runtime->isolate = Isolate::New(create_params);
 
+  Locker locker(runtime->isolate);
   Isolate::Scope isolate_scope(runtime->isolate);
   HandleScope handle_scope(runtime->isolate);
   Local<ObjectTemplate> globalObject = ObjectTemplate::New(runtime->isolate);
@@ -1856,6 +4323,9 @@ static J2V8Handle create_test_j2v8handle() {
       Context::New(runtime->isolate, nullptr, globalObject);
   runtime->context.Reset(runtime->isolate, context);
 
+  // with the isolate locked, like OnCreateIsolate
+  JSEnvImpl::From(reinterpret_cast<J2V8Runtime*>(runtime));
+
   return reinterpret_cast<J2V8Handle>(runtime);
 }
 
@@ -1879,6 +4349,23 @@ __attribute__((visibility("default"))) extern "C" void* get_jsenv(
   return jsenv_impl;
 }
 
+// export register_jsenv_snapshot_class and create_jsenv_snapshot
+__attribute__((visibility("default"))) extern "C" int
+register_jsenv_snapshot_class(const JSClassDefinition* class_definition,
+                              int super_id,
+                              const JSNamedPropertyHandler* named_handler,
+                              const JSIndexedPropertyHandler* indexed_handler) {
+  return JSClassTemplate::RegisterSnapshotClass(
+      class_definition, super_id, named_handler, indexed_handler);
+}
+
+__attribute__((visibility("default"))) extern "C" bool create_jsenv_snapshot(
+    const char* script,
+    JSSnapshotWriteCallback write_callback,
+    void* user_data) {
+  return CreateSnapshot(script, write_callback, user_data);
+}
+
 #if defined(SUPPORT_J2V8RUNTIME)
 extern "C" void GetJ2V8PlatformHandles(J2V8Runtime* runtime,
                                        void** pvm,
@@ -8,15 +8,26 @@
 
 #include "JSEnv.h"
 
+#include <atomic>
+#include <deque>
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "v8.h"
 
 #include "inspector-proxy.h"
 #include "j2v8-runtime.h"
+#include "jsarena.h"
+#include "jsasync.h"
+#include "jscallback_profiler.h"
 #include "jsclass.h"
+#include "jsevent_channel.h"
+#include "jsfinalizer.h"
+#include "jsmpsc_queue.h"
+#include "jsprepared_call.h"
 
 #include "jsenv-impl-v1000.h"
 
@@ -182,12 +193,195 @@ class JSEnvImpl : public JSEnv {
   void PushScope() override;
   void PopScope() override;
 
+  // version 1200
+  // external string
+  JSExternalString NewExternalString(
+      const void* data,
+      size_t length,
+      int encoding,
+      JSExternalStringReleaseCallback release_callback,
+      void* user_data) override;
+  void DeleteExternalString(JSExternalString str) override;
+
+  // property key
+  JSPropertyKey CreatePropertyKey(const char* name) override;
+  bool GetObjectProperty(JSObject object,
+                         JSPropertyKey key,
+                         JSValue* pvalue,
+                         uint32_t flags = 0) override;
+  bool SetObjectProperty(JSObject object,
+                         JSPropertyKey key,
+                         const JSValue* pvalue) override;
+  bool GetGlobal(JSPropertyKey key,
+                 JSValue* pvalue,
+                 uint32_t flags = 0) override;
+  bool SetGlobal(JSPropertyKey key, const JSValue* pvalue) override;
+  bool GetObjectProperties(JSObject object,
+                           const JSValue* keys,
+                           int count,
+                           JSValue* values,
+                           uint32_t flags = 0) override;
+  bool GetObjectProperties(JSObject object,
+                           const JSPropertyKey* keys,
+                           int count,
+                           JSValue* values,
+                           uint32_t flags = 0) override;
+  bool SetObjectProperties(JSObject object,
+                           const JSValue* keys,
+                           const JSValue* values,
+                           int count) override;
+  bool SetObjectProperties(JSObject object,
+                           const JSPropertyKey* keys,
+                           const JSValue* values,
+                           int count) override;
+
+  // bulk array access
+  bool GetArrayElements(JSObject object,
+                        uint32_t start,
+                        uint32_t count,
+                        JSValue* values,
+                        uint32_t flags = 0) override;
+  bool SetArrayElements(JSObject object,
+                        uint32_t start,
+                        const JSValue* values,
+                        uint32_t count) override;
+
+  // object shape
+  JSObjectShape CreateObjectShape(const char* const* names,
+                                  int count) override;
+  JSObject NewObjectWithShape(JSObjectShape shape,
+                              const JSValue* values,
+                              int count) override;
+
+  // structured clone
+  JSSerializedData SerializeValue(const JSValue* pvalue,
+                                  const JSObject* transfers = nullptr,
+                                  int transfer_count = 0) override;
+  bool DeserializeValue(JSSerializedData data,
+                        JSValue* pvalue,
+                        uint32_t flags = 0) override;
+  const void* GetSerializedDataBuffer(JSSerializedData data,
+                                      size_t* psize) override;
+  JSSerializedData NewSerializedData(const void* buffer, size_t size) override;
+  void DeleteSerializedData(JSSerializedData data) override;
+
+  // JSON
+  bool ParseJSON(const JSValue* json,
+                 JSValue* presult,
+                 uint32_t flags = 0) override;
+  bool StringifyJSON(const JSValue* pvalue,
+                     JSValue* presult,
+                     uint32_t flags = 0) override;
+
+  // lazy arguments
+  JSObject NewLazyFunction(JSLazyFunctionCallback callback,
+                           void* user_data,
+                           uint32_t flags = 0) override;
+  int GetArgsLength(JSArgs args) override;
+  int GetArgType(JSArgs args, int index) override;
+  bool GetArg(JSArgs args, int index, JSValue* pvalue) override;
+
+  // typed function
+  JSObject NewTypedFunctionWithSignature(JSTypedFunctionThunk thunk,
+                                         void* function,
+                                         int return_type,
+                                         const int* arg_types,
+                                         int argc) override;
+
+  bool DeleteFunction(JSObject function) override;
+
+  // async function
+  JSObject NewAsyncFunction(JSAsyncFunctionCallback callback,
+                            void* user_data,
+                            uint32_t flags = 0) override;
+  bool CompleteAsync(JSAsyncToken token,
+                     bool resolve,
+                     const JSValue* pvalue) override;
+  bool CompleteAsyncWithSerializedData(JSAsyncToken token,
+                                       bool resolve,
+                                       JSSerializedData data) override;
+  void SetAsyncNotifyCallback(JSAsyncNotifyCallback callback,
+                              void* user_data) override;
+  int RunAsyncCompletions() override;
+
+  // tasks
+  bool PostTask(JSTaskCallback callback,
+                void* user_data,
+                int priority = kJSTaskPriorityNormal) override;
+  int GetTaskWakeupFd() override;
+  int RunPendingTasks(int64_t budget_us = -1) override;
+
+  // microtasks
+  bool SetMicrotaskPolicy(int policy) override;
+  int GetMicrotaskPolicy() override;
+  void PerformMicrotaskCheckpoint() override;
+  int GetSettledPromiseCount() override;
+
+  // prepared call
+  JSPreparedCall PrepareCall(JSObject function,
+                             JSObject self,
+                             int argc) override;
+  bool InvokePreparedCall(JSPreparedCall call,
+                          const JSValue* argv,
+                          JSValue* presult,
+                          uint32_t flags = 0) override;
+  void DeletePreparedCall(JSPreparedCall call) override;
+
+  // event channel
+  JSEventChannel CreateEventChannel() override;
+  void DeleteEventChannel(JSEventChannel channel) override;
+  JSObject GetEventChannelObject(JSEventChannel channel) override;
+  bool AddEventListener(JSEventChannel channel, JSObject listener) override;
+  bool RemoveEventListener(JSEventChannel channel, JSObject listener) override;
+  int GetEventListenerCount(JSEventChannel channel) override;
+  int EmitEvent(JSEventChannel channel,
+                const JSValue* argv,
+                int argc) override;
+
+  // batched domain calls
+  bool RegisterBatchedCallback(J2V8ObjectHandle object,
+                               const char* domain,
+                               JSBatchedCallsCallback callback,
+                               void* user_data) override;
+  void FlushBatchedCalls() override;
+
+  // class interceptors
+  JSClass CreateClassWithInterceptors(
+      const JSClassDefinition* class_definition,
+      JSClass super,
+      const JSNamedPropertyHandler* named_handler,
+      const JSIndexedPropertyHandler* indexed_handler) override;
+
+  // queued finalizers
+  int RunPendingFinalizers(int64_t budget_us = -1) override;
+  void GetFinalizeStats(JSFinalizeStats* pstats) override;
+  void ResetFinalizeStats() override;
+
+  // bulk instances
+  int NewInstances(JSClass clazz,
+                   int count,
+                   JSObject* objects,
+                   void* const* private_data = nullptr) override;
+  bool RegisterLazyCallbackOnObject(J2V8ObjectHandle object,
+                                    const char* domain,
+                                    JSLazyFunctionCallback callback,
+                                    void* user_data,
+                                    uint32_t flags = 0) override;
+  // the native callbacks of the functions and templates made by JSEnv, see
+  // GetExternalReferences
+  static void AddExternalReferences(std::vector<intptr_t>* prefs);
+
+  // called by the GC callback of a JSClassTemplate instance
+  void QueueFinalizer(const FinalizerQueue::Finalizer& finalizer,
+                      bool background);
+
   static JSEnvImpl* From(J2V8Runtime* runtime);
   static JSEnvImpl* From(v8::Isolate* isolate);
 
   void Detach();
 
   void ThrowException(v8::TryCatch* ptry_catch);
+  std::string FormatException(v8::TryCatch* ptry_catch);
 
   bool ThrowExceptionToV8();
 
@@ -202,6 +396,17 @@ class JSEnvImpl : public JSEnv {
     return J2V8RuntimeGetContext(runtime_);
   }
 
+  // the native callbacks convert their arguments in this arena
+  inline JSArena* callback_arena() { return &callback_arena_; }
+
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  inline CallbackProfiler* callback_profiler() { return &callback_profiler_; }
+#endif
+
+  // the snapshot of the isolate has the templates of the snapshot classes,
+  // its marker is read by the first call
+  bool HasSnapshotClasses();
+
   void ResetLogcat();
 
   inline void SetQuickAppJSRuntimeHandle(void* handle) {
@@ -213,7 +418,37 @@ class JSEnvImpl : public JSEnv {
   }
 
  private:
-  struct UserCallbackInfo {
+  // Every native function has a heap record, passed to V8 as the External
+  // data of the function. It's freed by the weak callback when the function
+  // is collected, after Detach too: Detach only marks it deleted.
+  struct CallbackRecord {
+    CallbackRecord()
+        : jsenv(nullptr),
+          identity_hash(0),
+          deleted(false),
+          flush_pending(false) {}
+    virtual ~CallbackRecord() {}
+
+    static CallbackRecord* From(v8::Local<v8::Value> data) {
+      return reinterpret_cast<CallbackRecord*>(
+          data.As<v8::External>()->Value());
+    }
+
+    // null after Detach
+    JSEnvImpl* jsenv;
+    int identity_hash;
+    // set by DeleteFunction and Detach
+    bool deleted;
+    // a batched function with queued calls: if it's collected, the record
+    // is freed by FlushBatchedCalls after the calls are delivered
+    bool flush_pending;
+    v8::Global<v8::Function> function;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+    CallbackProfiler::Entry* profile_entry = nullptr;
+#endif
+  };
+
+  struct UserCallbackInfo : public CallbackRecord {
     UserCallbackInfo(J2V8ObjectHandle handle,
                      const char* domain,
                      UserFunctionCallback callback,
@@ -232,7 +467,7 @@ class JSEnvImpl : public JSEnv {
     uint32_t flags;
   };
 
-  struct JSFunctionCallbackInfo {
+  struct JSFunctionCallbackInfo : public CallbackRecord {
     JSFunctionCallbackInfo(JSFunctionCallback callback,
                            void* user_data,
                            uint32_t flags)
@@ -243,6 +478,62 @@ class JSEnvImpl : public JSEnv {
     uint32_t flags;
   };
 
+  // NewLazyFunction and RegisterLazyCallbackOnObject
+  struct LazyFunctionCallbackInfo : public CallbackRecord {
+    LazyFunctionCallbackInfo(JSLazyFunctionCallback callback,
+                             void* user_data,
+                             uint32_t flags)
+        : callback(callback), user_data(user_data), flags(flags) {}
+
+    JSLazyFunctionCallback callback;
+    void* user_data;
+    uint32_t flags;
+  };
+
+  // JSObjectShape, the template has the properties in order
+  struct ObjectShape {
+    v8::Global<v8::ObjectTemplate> object_template;
+    std::vector<JSPropertyKey> keys;
+  };
+
+  struct AsyncFunctionInfo : public CallbackRecord {
+    AsyncFunctionInfo(JSAsyncFunctionCallback callback,
+                      void* user_data,
+                      uint32_t flags)
+        : callback(callback), user_data(user_data), flags(flags) {}
+
+    JSAsyncFunctionCallback callback;
+    void* user_data;
+    uint32_t flags;
+  };
+
+  struct BatchedCallbackInfo : public CallbackRecord {
+    BatchedCallbackInfo(JSBatchedCallsCallback callback, void* user_data)
+        : callback(callback), user_data(user_data), arg_count(0) {}
+
+    JSBatchedCallsCallback callback;
+    void* user_data;
+    // the encoded calls, and the end offset of each one in |buffer|
+    std::vector<uint8_t> buffer;
+    std::vector<size_t> call_ends;
+    // the arguments of the calls which aren't structured clones
+    size_t arg_count;
+  };
+
+  struct TypedFunctionInfo : public CallbackRecord {
+    JSTypedFunctionThunk thunk;
+    void* function;
+    int return_type;
+    int argc;
+    uint8_t arg_types[kMaxTypedFunctionArgs];
+  };
+
+  struct PendingTask {
+    JSTaskCallback callback;
+    void* user_data;
+    PendingTask* next;
+  };
+
   struct JSExceptionImpl {
     JSExceptionImpl() : type(JSException::kNoneException) {}
 
@@ -271,6 +562,49 @@ class JSEnvImpl : public JSEnv {
   static void CallUserCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
   static void CallJSFunctionCallback(
       const v8::FunctionCallbackInfo<v8::Value>& args);
+  static void CallLazyFunctionCallback(
+      const v8::FunctionCallbackInfo<v8::Value>& args);
+  static void CallTypedFunction(
+      const v8::FunctionCallbackInfo<v8::Value>& args);
+  static void CallAsyncFunction(
+      const v8::FunctionCallbackInfo<v8::Value>& args);
+  static void CallBatchedCallback(
+      const v8::FunctionCallbackInfo<v8::Value>& args);
+  static bool SerializeBatchedCall(
+      const v8::FunctionCallbackInfo<v8::Value>& args,
+      std::vector<uint8_t>* pbuffer);
+  static void OnCallbackFunctionCollected(
+      const v8::WeakCallbackInfo<CallbackRecord>& info);
+  // takes the ownership of |record|
+  bool NewCallbackFunction(v8::Local<v8::Context> context,
+                           v8::FunctionCallback callback,
+                           CallbackRecord* record,
+                           int length,
+                           v8::ConstructorBehavior behavior,
+                           v8::Local<v8::Function>* pfunction);
+  void DeleteCallbackRecord(CallbackRecord* record);
+  void DeleteCallbackRecords();
+  void QueueAsyncCompletion(AsyncCompletion* completion);
+  void SettleAsyncCompletion(v8::Local<v8::Context> context,
+                             AsyncCompletion* completion);
+  // any thread, the resolver must be reset already
+  void DeleteAsyncCompletion(AsyncCompletion* completion);
+  void CloseAsyncCompletions();
+  // any thread, makes the wakeup fd readable
+  void WakeUp();
+  void CloseTaskQueues();
+  static void OnMicrotasksCompleted(v8::Isolate* isolate, void* data);
+  static void OnCallCompleted(v8::Isolate* isolate);
+  v8::Local<v8::FunctionTemplate> GetEventChannelTemplate();
+  static void EventChannelAddListener(
+      const v8::FunctionCallbackInfo<v8::Value>& args);
+  static void EventChannelRemoveListener(
+      const v8::FunctionCallbackInfo<v8::Value>& args);
+  // takes the ownership of |record|
+  bool RegisterDomainFunction(J2V8ObjectHandle object,
+                              const char* domain,
+                              v8::FunctionCallback trampoline,
+                              CallbackRecord* record);
   static void ParseDomain(const char* domain,
                           std::string* powner_name,
                           std::string* pfunc_name);
@@ -280,18 +614,69 @@ class JSEnvImpl : public JSEnv {
   v8::Local<v8::Object> CallConstructor(v8::Local<v8::Function> function,
                                         const JSValue* args,
                                         int argc);
+  template <typename TKey>
+  bool GetProperties(JSObject object,
+                     const TKey* keys,
+                     int count,
+                     JSValue* values,
+                     uint32_t flags);
+  template <typename TKey>
+  bool SetProperties(JSObject object,
+                     const TKey* keys,
+                     const JSValue* values,
+                     int count);
+  // the |count| values read by |get|(i, &value), for GetProperties and
+  // GetArrayElements
+  template <typename TGet>
+  bool GetValues(uint32_t count,
+                 JSValue* values,
+                 uint32_t flags,
+                 const TGet& get);
   void* GetJSObjectPrivateData(JSObject object, int index);
   bool SetJSObjectPrivateData(JSObject object, int index, void* pdata);
 
   J2V8Runtime* runtime_;
   v8::Isolate* isolate_;
   std::unique_ptr<LogcatConsole> logcat_console_;
-  int ref_count_;
-  std::vector<UserCallbackInfo> user_callbacks_;
-  std::vector<JSFunctionCallbackInfo> jsfunction_callbacks_;
+  // the pending async tokens hold references, they're released on any thread
+  std::atomic<int> ref_count_;
+  // the records of the live native functions, by the identity hash of the
+  // function
+  std::unordered_multimap<int, CallbackRecord*> callback_records_;
   std::map<std::string, std::unique_ptr<JSClassTemplate>> js_classes_;
   JSExceptionImpl exception_;
   std::vector<JSEnvHandleScope*> handle_scopes_;
+  JSArena callback_arena_;
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  CallbackProfiler callback_profiler_;
+#endif
+  // NewAsyncFunction, the tokens not settled yet are in |pending_async_|
+  AsyncCompletionQueue async_completions_;
+  std::unordered_set<AsyncCompletion*> pending_async_;
+  JSAsyncNotifyCallback async_notify_callback_;
+  void* async_notify_user_data_;
+  // PostTask pushes to |task_queues_|, RunPendingTasks moves the tasks to
+  // |ready_tasks_| and keeps there the ones out of the budget
+  MPSCQueue<PendingTask> task_queues_[kJSTaskPriorityCount];
+  std::deque<PendingTask*> ready_tasks_[kJSTaskPriorityCount];
+  int wakeup_fd_;
+  // the promises settled by the JSEnv since the last microtask checkpoint
+  int settled_promises_;
+  // reset at Detach, deleted by DeletePreparedCall
+  std::unordered_set<PreparedCall*> prepared_calls_;
+  // reset at Detach, deleted by DeleteEventChannel
+  std::unordered_set<EventChannel*> event_channels_;
+  v8::Global<v8::FunctionTemplate> event_channel_template_;
+  // the batched functions with queued calls, in the order of the first call
+  std::vector<BatchedCallbackInfo*> batched_records_;
+  bool flushing_batched_calls_;
+  FinalizerQueue finalizers_;
+  // CreatePropertyKey, the key is the address of the Global
+  std::map<std::string, std::unique_ptr<v8::Global<v8::String>>>
+      property_keys_;
+  std::vector<std::unique_ptr<ObjectShape>> object_shapes_;
+  // HasSnapshotClasses, -1 until the marker is read
+  int has_snapshot_classes_;
 
   // QuickAppJSRuntime handle
   void* quickapp_jsruntime_handle_;
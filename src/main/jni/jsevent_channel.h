@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSEVENT_CHANNEL_H_
+#define HYBRID_JSEVENT_CHANNEL_H_
+
+#include <v8.h>
+#include <algorithm>
+#include <vector>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+// JSEventChannel: the listeners are kept in the order they're added. A
+// listener removed while an event is emitted is only reset, the list is
+// compacted when the outermost emit returns, so the indexes stay valid. A
+// channel deleted while an event is emitted is freed by that emit.
+class EventChannel {
+ public:
+  EventChannel() : emit_depth_(0), deleted_(false) {}
+
+  static EventChannel* From(JSEventChannel channel) {
+    return reinterpret_cast<EventChannel*>(channel);
+  }
+
+  JSEventChannel ToJSEventChannel() {
+    return reinterpret_cast<JSEventChannel>(this);
+  }
+
+  // a listener is added once
+  bool AddListener(v8::Isolate* isolate, v8::Local<v8::Function> listener) {
+    if (IndexOf(listener) >= 0) {
+      return false;
+    }
+    listeners_.emplace_back(isolate, listener);
+    return true;
+  }
+
+  bool RemoveListener(v8::Local<v8::Function> listener) {
+    int index = IndexOf(listener);
+    if (index < 0) {
+      return false;
+    }
+    listeners_[index].Reset();
+    if (emit_depth_ == 0) {
+      Compact();
+    }
+    return true;
+  }
+
+  int ListenerCount() const {
+    int count = 0;
+    for (const v8::Global<v8::Function>& listener : listeners_) {
+      if (!listener.IsEmpty()) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  // the listeners added during an emit are called by the next one
+  size_t size() const { return listeners_.size(); }
+
+  // empty if it's removed
+  v8::Local<v8::Function> listener(v8::Isolate* isolate, size_t index) const {
+    return listeners_[index].Get(isolate);
+  }
+
+  void BeginEmit() { emit_depth_++; }
+
+  void EndEmit() {
+    if (--emit_depth_ == 0) {
+      Compact();
+    }
+  }
+
+  bool emitting() const { return emit_depth_ > 0; }
+
+  // DeleteEventChannel while emitting: the listeners left aren't called,
+  // the channel is freed when the outermost emit returns
+  void MarkDeleted() {
+    for (v8::Global<v8::Function>& listener : listeners_) {
+      listener.Reset();
+    }
+    object_.Reset();
+    deleted_ = true;
+  }
+
+  bool deleted() const { return deleted_; }
+
+  // the JS object of GetEventChannelObject, it's weak
+  v8::Global<v8::Object>& object() { return object_; }
+
+  // the Globals must be reset before the isolate is disposed
+  void Reset() {
+    listeners_.clear();
+    object_.Reset();
+  }
+
+ private:
+  int IndexOf(v8::Local<v8::Function> listener) const {
+    for (size_t i = 0; i < listeners_.size(); i++) {
+      if (listeners_[i] == listener) {
+        return static_cast<int>(i);
+      }
+    }
+    return -1;
+  }
+
+  void Compact() {
+    listeners_.erase(
+        std::remove_if(listeners_.begin(), listeners_.end(),
+                       [](const v8::Global<v8::Function>& listener) {
+                         return listener.IsEmpty();
+                       }),
+        listeners_.end());
+  }
+
+  std::vector<v8::Global<v8::Function>> listeners_;
+  v8::Global<v8::Object> object_;
+  int emit_depth_;
+  bool deleted_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSEVENT_CHANNEL_H_
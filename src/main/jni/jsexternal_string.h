@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSEXTERNAL_STRING_H_
+#define HYBRID_JSEXTERNAL_STRING_H_
+
+#include <v8.h>
+#include <atomic>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+// Native buffer shared by the external V8 strings made from one
+// JSExternalString. The native side holds one reference (dropped by
+// DeleteExternalString) and every V8 string holds one, the release callback
+// is called when the last one is dropped.
+class ExternalStringData {
+ public:
+  // shorter strings are copied into the V8 heap, it's cheaper than an
+  // external resource
+  static const size_t kMinExternalLength = 256;
+
+  ExternalStringData(const void* data,
+                     size_t length,
+                     int encoding,
+                     JSExternalStringReleaseCallback release_callback,
+                     void* user_data)
+      : data_(data),
+        length_(length),
+        encoding_(encoding),
+        release_callback_(release_callback),
+        user_data_(user_data),
+        ref_count_(1),
+        string_count_(0) {}
+
+  static ExternalStringData* From(JSExternalString str) {
+    return reinterpret_cast<ExternalStringData*>(str);
+  }
+
+  JSExternalString ToJSExternalString() {
+    return reinterpret_cast<JSExternalString>(this);
+  }
+
+  void AddReference() { ref_count_.fetch_add(1); }
+
+  void Release() {
+    if (ref_count_.fetch_sub(1) == 1) {
+      if (release_callback_) {
+        release_callback_(user_data_, data_);
+      }
+      delete this;
+    }
+  }
+
+  size_t byte_length() const {
+    return encoding_ == kJSExternalStringUTF16 ? length_ * sizeof(uint16_t)
+                                               : length_;
+  }
+
+  v8::MaybeLocal<v8::String> NewString(v8::Isolate* isolate) {
+    if (encoding_ == kJSExternalStringUTF16) {
+      const uint16_t* data = reinterpret_cast<const uint16_t*>(data_);
+      if (length_ < kMinExternalLength) {
+        return v8::String::NewFromTwoByte(isolate, data,
+                                          v8::NewStringType::kNormal,
+                                          static_cast<int>(length_));
+      }
+      TwoByteResource* resource = new TwoByteResource(isolate, this);
+      v8::MaybeLocal<v8::String> str =
+          v8::String::NewExternalTwoByte(isolate, resource);
+      if (str.IsEmpty()) {
+        // too long, V8 didn't take the resource
+        delete resource;
+      }
+      return str;
+    }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(data_);
+    if (length_ < kMinExternalLength) {
+      return v8::String::NewFromOneByte(isolate, data,
+                                        v8::NewStringType::kNormal,
+                                        static_cast<int>(length_));
+    }
+    OneByteResource* resource = new OneByteResource(isolate, this);
+    v8::MaybeLocal<v8::String> str =
+        v8::String::NewExternalOneByte(isolate, resource);
+    if (str.IsEmpty()) {
+      delete resource;
+    }
+    return str;
+  }
+
+ private:
+  // one resource per V8 string, V8 deletes it by Dispose when the string is
+  // collected or the isolate is disposed
+  template <typename TBase, typename TCHAR>
+  class Resource : public TBase {
+   public:
+    Resource(v8::Isolate* isolate, ExternalStringData* data)
+        : isolate_(isolate), data_(data) {
+      data_->AddReference();
+      data_->OnStringCreated(isolate_);
+    }
+
+    ~Resource() override {
+      data_->OnStringDisposed(isolate_);
+      data_->Release();
+    }
+
+    const TCHAR* data() const override {
+      return reinterpret_cast<const TCHAR*>(data_->data_);
+    }
+
+    size_t length() const override { return data_->length_; }
+
+   private:
+    v8::Isolate* isolate_;
+    ExternalStringData* data_;
+  };
+
+  typedef Resource<v8::String::ExternalOneByteStringResource, char>
+      OneByteResource;
+  typedef Resource<v8::String::ExternalStringResource, uint16_t>
+      TwoByteResource;
+
+  ~ExternalStringData() {}
+
+  // the buffer is reported to V8 once, however many strings share it
+  void OnStringCreated(v8::Isolate* isolate) {
+    if (string_count_++ == 0) {
+      isolate->AdjustAmountOfExternalAllocatedMemory(
+          static_cast<int64_t>(byte_length()));
+    }
+  }
+
+  void OnStringDisposed(v8::Isolate* isolate) {
+    if (--string_count_ == 0) {
+      isolate->AdjustAmountOfExternalAllocatedMemory(
+          -static_cast<int64_t>(byte_length()));
+    }
+  }
+
+  const void* data_;
+  size_t length_;
+  int encoding_;
+  JSExternalStringReleaseCallback release_callback_;
+  void* user_data_;
+  std::atomic<int> ref_count_;
+  // live V8 strings, only touched on the isolate thread
+  int string_count_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSEXTERNAL_STRING_H_
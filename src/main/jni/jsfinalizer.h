@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSFINALIZER_H_
+#define HYBRID_JSFINALIZER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+// The finalizers of the classes with kFlagDeferredFinalize or
+// kFlagBackgroundFinalize: the GC callback only queues them. The deferred
+// ones run on the isolate thread by RunPendingFinalizers, the background
+// ones on a worker thread started by the first one.
+class FinalizerQueue {
+ public:
+  struct Finalizer {
+    JSFinalizeCallback finalize;
+    void* private_data;
+    void* extra_data;
+    uint64_t queued_ns;
+  };
+
+  FinalizerQueue() : stopping_(false) { memset(&stats_, 0, sizeof(stats_)); }
+
+  ~FinalizerQueue() { Stop(); }
+
+  // isolate thread, returns true if the deferred queue was empty
+  bool PushDeferred(const Finalizer& finalizer) {
+    deferred_.push_back(finalizer);
+    OnPushed();
+    return deferred_.size() == 1;
+  }
+
+  // isolate thread
+  void PushBackground(const Finalizer& finalizer) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!worker_.joinable()) {
+        worker_ = std::thread(&FinalizerQueue::WorkerMain, this);
+      }
+      background_.push_back(finalizer);
+    }
+    OnPushed();
+    condition_.notify_one();
+  }
+
+  // isolate thread, at least one finalizer runs if any is queued
+  int RunDeferred(int64_t budget_us) {
+    uint64_t start = NowNanos();
+    int count = 0;
+    while (!deferred_.empty()) {
+      if (count > 0 && budget_us >= 0 &&
+          NowNanos() - start >= static_cast<uint64_t>(budget_us) * 1000) {
+        break;
+      }
+      Finalizer finalizer = deferred_.front();
+      deferred_.pop_front();
+      Run(finalizer);
+      count++;
+    }
+    return count;
+  }
+
+  bool HasDeferred() const { return !deferred_.empty(); }
+
+  // runs the deferred finalizers, the worker finishes its queue and exits
+  void Stop() {
+    RunDeferred(-1);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    condition_.notify_one();
+    if (worker_.joinable()) {
+      worker_.join();
+    }
+  }
+
+  void GetStats(JSFinalizeStats* pstats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *pstats = stats_;
+  }
+
+  void ResetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t pending = stats_.pending;
+    memset(&stats_, 0, sizeof(stats_));
+    stats_.pending = pending;
+    stats_.max_pending = pending;
+  }
+
+  static uint64_t NowNanos() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+ private:
+  void OnPushed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.pending++;
+    stats_.max_pending = std::max(stats_.max_pending, stats_.pending);
+  }
+
+  void Run(const Finalizer& finalizer) {
+    uint64_t begin = NowNanos();
+    finalizer.finalize(finalizer.private_data, finalizer.extra_data);
+    uint64_t end = NowNanos();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t latency = end - finalizer.queued_ns;
+    stats_.pending--;
+    stats_.finalize_count++;
+    stats_.total_finalize_ns += end - begin;
+    stats_.total_latency_ns += latency;
+    stats_.max_latency_ns = std::max(stats_.max_latency_ns, latency);
+  }
+
+  void WorkerMain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      condition_.wait(lock,
+                      [this] { return stopping_ || !background_.empty(); });
+      if (background_.empty()) {
+        return;
+      }
+
+      std::deque<Finalizer> batch;
+      batch.swap(background_);
+      lock.unlock();
+      for (const Finalizer& finalizer : batch) {
+        Run(finalizer);
+      }
+      lock.lock();
+    }
+  }
+
+  // isolate thread only
+  std::deque<Finalizer> deferred_;
+
+  // guards the rest
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<Finalizer> background_;
+  std::thread worker_;
+  bool stopping_;
+  JSFinalizeStats stats_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSFINALIZER_H_
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSMPSC_QUEUE_H_
+#define HYBRID_JSMPSC_QUEUE_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace hybrid {
+
+// Multi-producer single-consumer queue of the nodes linked by T::next: any
+// thread pushes without a lock, the isolate thread takes the whole list.
+// Close makes the later pushes fail, the producers free their nodes then.
+template <typename T>
+class MPSCQueue {
+ public:
+  MPSCQueue() : head_(nullptr) {}
+
+  enum PushResult { kPushed, kPushedFirst, kClosed };
+
+  PushResult Push(T* node) {
+    T* head = head_.load(std::memory_order_relaxed);
+    do {
+      if (head == Closed()) {
+        return kClosed;
+      }
+      node->next = head;
+    } while (!head_.compare_exchange_weak(head, node,
+                                          std::memory_order_release,
+                                          std::memory_order_acquire));
+    return head == nullptr ? kPushedFirst : kPushed;
+  }
+
+  // the nodes in the order they were pushed
+  T* TakeAll() { return Reverse(Exchange(nullptr)); }
+
+  T* Close() { return Reverse(Exchange(Closed())); }
+
+ private:
+  static T* Closed() {
+    return reinterpret_cast<T*>(static_cast<intptr_t>(1));
+  }
+
+  T* Exchange(T* value) {
+    T* head = head_.exchange(value, std::memory_order_acq_rel);
+    return head == Closed() ? nullptr : head;
+  }
+
+  static T* Reverse(T* head) {
+    T* reversed = nullptr;
+    while (head) {
+      T* next = head->next;
+      head->next = reversed;
+      reversed = head;
+      head = next;
+    }
+    return reversed;
+  }
+
+  std::atomic<T*> head_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSMPSC_QUEUE_H_
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSPREPARED_CALL_H_
+#define HYBRID_JSPREPARED_CALL_H_
+
+#include <v8.h>
+#include <memory>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+// JSPreparedCall: the function and the receiver are pinned by Globals and the
+// argument buffer is reused by every call. The buffer only holds the Locals
+// while they're passed to Function::Call, so a nested call of the same
+// prepared call is safe.
+class PreparedCall {
+ public:
+  PreparedCall(v8::Isolate* isolate,
+               v8::Local<v8::Function> function,
+               v8::Local<v8::Object> self,
+               int argc)
+      : function_(isolate, function),
+        self_(isolate, self),
+        argc_(argc),
+        args_(new v8::Local<v8::Value>[argc > 0 ? argc : 1]) {}
+
+  static PreparedCall* From(JSPreparedCall call) {
+    return reinterpret_cast<PreparedCall*>(call);
+  }
+
+  JSPreparedCall ToJSPreparedCall() {
+    return reinterpret_cast<JSPreparedCall>(this);
+  }
+
+  bool IsEmpty() const { return function_.IsEmpty(); }
+
+  v8::Local<v8::Function> function(v8::Isolate* isolate) const {
+    return function_.Get(isolate);
+  }
+
+  v8::Local<v8::Object> self(v8::Isolate* isolate) const {
+    return self_.Get(isolate);
+  }
+
+  int argc() const { return argc_; }
+  v8::Local<v8::Value>* args() { return args_.get(); }
+
+  // the Globals must be reset before the isolate is disposed
+  void Reset() {
+    function_.Reset();
+    self_.Reset();
+  }
+
+ private:
+  v8::Global<v8::Function> function_;
+  v8::Global<v8::Object> self_;
+  int argc_;
+  std::unique_ptr<v8::Local<v8::Value>[]> args_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSPREPARED_CALL_H_
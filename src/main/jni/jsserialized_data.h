@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2021, the hapjs-platform Project Contributors
+ * SPDX-License-Identifier: EPL-1.0
+ */
+
+#ifndef HYBRID_JSSERIALIZED_DATA_H_
+#define HYBRID_JSSERIALIZED_DATA_H_
+
+#include <v8.h>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "JSEnv.h"
+
+namespace hybrid {
+
+// JSSerializedData: the ValueSerializer output and the backing stores of the
+// transferred ArrayBuffers, it doesn't depend on an isolate.
+class SerializedData {
+ public:
+  // |data| is malloc'ed, it's owned by SerializedData
+  SerializedData(uint8_t* data, size_t size)
+      : data_(data), size_(size), consumed_(false) {}
+
+  ~SerializedData() { free(data_); }
+
+  static SerializedData* From(JSSerializedData data) {
+    return reinterpret_cast<SerializedData*>(data);
+  }
+
+  JSSerializedData ToJSSerializedData() {
+    return reinterpret_cast<JSSerializedData>(this);
+  }
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  void AddArrayBuffer(std::shared_ptr<v8::BackingStore> backing_store) {
+    array_buffers_.push_back(std::move(backing_store));
+  }
+
+  const std::vector<std::shared_ptr<v8::BackingStore>>& array_buffers() const {
+    return array_buffers_;
+  }
+
+  bool HasTransfers() const { return !array_buffers_.empty() || consumed_; }
+
+  // the transferred ArrayBuffers are moved to one isolate only
+  bool consumed() const { return consumed_; }
+  void Consume() {
+    if (!array_buffers_.empty()) {
+      array_buffers_.clear();
+      consumed_ = true;
+    }
+  }
+
+ private:
+  uint8_t* data_;
+  size_t size_;
+  bool consumed_;
+  std::vector<std::shared_ptr<v8::BackingStore>> array_buffers_;
+};
+
+class SerializerDelegate : public v8::ValueSerializer::Delegate {
+ public:
+  explicit SerializerDelegate(v8::Isolate* isolate) : isolate_(isolate) {}
+
+  void ThrowDataCloneError(v8::Local<v8::String> message) override {
+    isolate_->ThrowException(v8::Exception::Error(message));
+  }
+
+ private:
+  v8::Isolate* isolate_;
+};
+
+}  // namespace hybrid
+
+#endif  // HYBRID_JSSERIALIZED_DATA_H_
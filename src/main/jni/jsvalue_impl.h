@@ -10,6 +10,8 @@
 #include <string>
 
 #include "JSEnv.h"
+#include "jsarena.h"
+#include "jsexternal_string.h"
 
 namespace hybrid {
 
@@ -31,6 +33,19 @@ static inline v8::Local<v8::String> ToV8String(v8::Isolate* isolate,
   return ToV8String(isolate, str.c_str());
 }
 
+static inline JSPropertyKey ToJSPropertyKey(
+    v8::Global<v8::String>* property_key) {
+  return reinterpret_cast<JSPropertyKey>(property_key);
+}
+
+static inline v8::Local<v8::String> ToV8String(v8::Isolate* isolate,
+                                               JSPropertyKey key) {
+  if (key == nullptr) {
+    return v8::Local<v8::String>();
+  }
+  return reinterpret_cast<v8::Global<v8::String>*>(key)->Get(isolate);
+}
+
 static inline v8::Local<v8::Object> ToV8Object(v8::Isolate* isolate,
                                                J2V8ObjectHandle handle) {
   return v8::Local<v8::Object>::New(
@@ -78,10 +93,171 @@ static inline bool IsPersistentObject(JSObject object) {
   return (val & 1) == 1;
 }
 
+// a Number got as kInt64 with kFlagUseInt64, in [-2^63, 2^63)
+static inline bool IsInt64Number(double dval) {
+  return dval >= -9223372036854775808.0 && dval < 9223372036854775808.0 &&
+         dval == static_cast<double>(static_cast<int64_t>(dval));
+}
+
+static inline int GetV8ObjectType(v8::Local<v8::Object> v8_object) {
+  if (v8_object->IsFunction()) {
+    return JSValue::kJSFunction;
+  }
+
+  if (v8_object->IsArray()) {
+    return JSValue::kJSArray;
+  }
+
+  if (v8_object->IsTypedArray()) {
+    return JSValue::kJSTypedArray;
+  }
+
+  if (v8_object->IsArrayBuffer()) {
+    return JSValue::kJSArrayBuffer;
+  }
+
+  if (v8_object->IsDataView()) {
+    return JSValue::kJSDataView;
+  }
+
+  if (v8_object->IsPromise()) {
+    return JSValue::kJSPromise;
+  }
+
+  return JSValue::kJSObject;
+}
+
+// the type ToJSValue converts |v8_value| to, objects are classified like
+// JSEnv::GetObjectType
+static inline int GetV8ValueType(v8::Local<v8::Value> v8_value,
+                                 uint32_t flags) {
+  if (v8_value.IsEmpty() || v8_value->IsNullOrUndefined()) {
+    return JSValue::kNull;
+  }
+
+  if (v8_value->IsBoolean()) {
+    return JSValue::kBoolean;
+  }
+
+  if (v8_value->IsString()) {
+    return (flags & JSEnv::kFlagUseUTF8) ? JSValue::kUTF8String
+                                          : JSValue::kUTF16String;
+  }
+
+  if (v8_value->IsInt32()) {
+    return JSValue::kInt;
+  }
+
+  // like ToJSValue, a BigInt out of 64 bits can't be got: kNull
+  if (v8_value->IsBigInt()) {
+    v8::Local<v8::BigInt> big_int = v8_value.As<v8::BigInt>();
+    bool lossless = false;
+    big_int->Int64Value(&lossless);
+    if (lossless) {
+      return JSValue::kBigInt64;
+    }
+    big_int->Uint64Value(&lossless);
+    return lossless ? JSValue::kBigUint64 : JSValue::kNull;
+  }
+
+  if (v8_value->IsNumber()) {
+    return (flags & JSEnv::kFlagUseInt64) &&
+                   IsInt64Number(v8_value.As<v8::Number>()->Value())
+               ? JSValue::kInt64
+               : JSValue::kFloat;
+  }
+
+  if (v8_value->IsObject()) {
+    return GetV8ObjectType(v8_value.As<v8::Object>());
+  }
+
+  return JSValue::kNull;
+}
+
+static inline bool IsAsciiString(const char* str, int length) {
+  for (int i = 0; i < length; i++) {
+    if (static_cast<uint8_t>(str[i]) & 0x80) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write a string into the arena with a single copy. With kFlagBorrowString
+// external strings are referenced directly instead.
+static inline bool ArenaV8String(v8::Isolate* isolate,
+                                 JSValue* pjs_value,
+                                 v8::Local<v8::String> v8_str,
+                                 uint32_t flags,
+                                 JSArena* arena) {
+  int length = v8_str->Length();
+  bool borrow = (flags & JSEnv::kFlagBorrowString) != 0;
+
+  if (!(flags & JSEnv::kFlagUseUTF8)) {
+    if (borrow && v8_str->IsExternal() && !v8_str->IsExternalOneByte()) {
+      const v8::String::ExternalStringResource* resource =
+          v8_str->GetExternalStringResource();
+      pjs_value->Set(reinterpret_cast<const jschar_t*>(resource->data()),
+                     length, false);
+      return true;
+    }
+
+    uint16_t* buffer = arena->AllocateArray<uint16_t>(length + 1);
+    if (buffer == nullptr) {
+      return false;
+    }
+    v8_str->Write(isolate, buffer, 0, length,
+                  v8::String::NO_NULL_TERMINATION);
+    buffer[length] = 0;
+    pjs_value->Set(reinterpret_cast<const jschar_t*>(buffer), length, false);
+    return true;
+  }
+
+  if (borrow && v8_str->IsExternalOneByte()) {
+    const v8::String::ExternalOneByteStringResource* resource =
+        v8_str->GetExternalOneByteStringResource();
+    if (IsAsciiString(resource->data(), length)) {
+      pjs_value->Set(resource->data(), length, false);
+      return true;
+    }
+  }
+
+  // Latin-1 fast path: an ascii one byte string is already utf8
+  if (v8_str->IsOneByte()) {
+    JSArena::Mark mark = arena->GetMark();
+    char* buffer = arena->AllocateArray<char>(length + 1);
+    if (buffer == nullptr) {
+      return false;
+    }
+    v8_str->WriteOneByte(isolate, reinterpret_cast<uint8_t*>(buffer), 0,
+                         length, v8::String::NO_NULL_TERMINATION);
+    if (IsAsciiString(buffer, length)) {
+      buffer[length] = '\0';
+      pjs_value->Set(buffer, length, false);
+      return true;
+    }
+    arena->Reset(mark);
+  }
+
+  // a utf16 code unit takes at most 3 bytes in utf8
+  int capacity = (v8_str->IsOneByte() ? 2 : 3) * length;
+  char* buffer = arena->AllocateArray<char>(capacity + 1);
+  if (buffer == nullptr) {
+    return false;
+  }
+  int utf8_length = v8_str->WriteUtf8(
+      isolate, buffer, capacity, nullptr,
+      v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+  buffer[utf8_length] = '\0';
+  pjs_value->Set(buffer, utf8_length, false);
+  return true;
+}
+
 static inline bool ToJSValue(v8::Isolate* isolate,
                              JSValue* pjs_value,
                              v8::Local<v8::Value> v8_value,
-                             uint32_t flags = 0) {
+                             uint32_t flags = 0,
+                             JSArena* arena = nullptr) {
   if (v8_value.IsEmpty() || v8_value->IsNullOrUndefined()) {
     pjs_value->SetNull();
     return true;
@@ -96,7 +272,10 @@ static inline bool ToJSValue(v8::Isolate* isolate,
     return true;
   }
   if (v8_value->IsString()) {
-    if (flags & JSEnv::kFlagUseUTF8) {
+    if (arena) {
+      return ArenaV8String(isolate, pjs_value, v8_value.As<v8::String>(),
+                           flags, arena);
+    } else if (flags & JSEnv::kFlagUseUTF8) {
       v8::String::Utf8Value str_val(isolate,
                                     v8::Local<v8::String>::Cast(v8_value));
       pjs_value->Set(*str_val, str_val.length(), true);
@@ -113,13 +292,35 @@ static inline bool ToJSValue(v8::Isolate* isolate,
     return true;
   }
 
+  if (v8_value->IsBigInt()) {
+    v8::Local<v8::BigInt> big_int = v8_value.As<v8::BigInt>();
+    bool lossless = false;
+    int64_t i64 = big_int->Int64Value(&lossless);
+    if (lossless) {
+      pjs_value->SetBigInt(i64);
+      return true;
+    }
+    uint64_t u64 = big_int->Uint64Value(&lossless);
+    if (lossless) {
+      pjs_value->SetBigUint(u64);
+      return true;
+    }
+    // out of 64 bits
+    return false;
+  }
+
   if (v8_value->IsBoolean()) {
     pjs_value->Set(v8::Local<v8::Boolean>::Cast(v8_value)->Value());
     return true;
   }
 
   if (v8_value->IsNumber()) {
-    pjs_value->Set(v8::Local<v8::Number>::Cast(v8_value)->Value());
+    double dval = v8::Local<v8::Number>::Cast(v8_value)->Value();
+    if ((flags & JSEnv::kFlagUseInt64) && IsInt64Number(dval)) {
+      pjs_value->Set(static_cast<int64_t>(dval));
+    } else {
+      pjs_value->Set(dval);
+    }
     return true;
   }
 
@@ -140,6 +341,16 @@ static inline v8::Local<v8::Value> ToV8Value(v8::Isolate* isolate,
       return v8::Integer::New(isolate, pjs_value->UintVal());
     case JSValue::kFloat:
       return v8::Number::New(isolate, pjs_value->FloatVal());
+    case JSValue::kInt64:
+      return v8::Number::New(isolate,
+                             static_cast<double>(pjs_value->Int64Val()));
+    case JSValue::kUint64:
+      return v8::Number::New(isolate,
+                             static_cast<double>(pjs_value->Uint64Val()));
+    case JSValue::kBigInt64:
+      return v8::BigInt::New(isolate, pjs_value->Int64Val());
+    case JSValue::kBigUint64:
+      return v8::BigInt::NewFromUnsigned(isolate, pjs_value->Uint64Val());
     case JSValue::kBoolean:
       return v8::Boolean::New(isolate, pjs_value->Boolean());
     case JSValue::kUTF8String:
@@ -155,6 +366,13 @@ static inline v8::Local<v8::Value> ToV8Value(v8::Isolate* isolate,
                  static_cast<int>(pjs_value->Length()))
           .ToLocalChecked();
       break;
+    case JSValue::kExternalString:
+      if (pjs_value->ExternalString() == nullptr) {
+        break;
+      }
+      return ExternalStringData::From(pjs_value->ExternalString())
+          ->NewString(isolate)
+          .FromMaybe(v8::Local<v8::String>());
     case JSValue::kJSObject:
     case JSValue::kJSFunction:
     case JSValue::kJSArray:
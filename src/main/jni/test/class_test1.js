@@ -10,6 +10,38 @@ gtest.eq(test1.mirror(200), 200, "test mirror 200");
 gtest.eq(test1.mirror(3.1415), 3.1415, "test mirror 3.1415");
 gtest.eq(test1.mirror("hello world"), "hello world", "test mirror hello world");
 
+const borrow_long_str = "mi quickapp ".repeat(1000);
+gtest.eq(test1.borrow_string("hello world", 11), "hello world", "test borrow ascii string");
+gtest.eq(test1.borrow_string("caf\u00e9", 5), "caf\u00e9", "test borrow latin1 string");
+gtest.eq(test1.borrow_string("\u5feb\u5e94\u7528", 9), "\u5feb\u5e94\u7528", "test borrow two byte string");
+gtest.eq(test1.borrow_string(borrow_long_str, borrow_long_str.length), borrow_long_str, "test borrow long string");
+
+gtest.eq(test1.lazy_dispatch("count", 1, "two", {}), 3, "test lazy args count");
+gtest.eq(test1.lazy_dispatch("type", [1]), 9, "test lazy args type kJSArray");
+gtest.eq(test1.lazy_dispatch("type", -1n), 18, "test lazy args type kBigInt64");
+gtest.eq(test1.lazy_dispatch("type", 2n ** 64n - 1n), 19, "test lazy args type kBigUint64");
+gtest.eq(test1.lazy_dispatch("type", 2n ** 64n), 0, "test lazy args BigInt out of 64 bits");
+gtest.eq(test1.lazy_dispatch("second", "hello", 2), "hello", "test lazy args get");
+const lazy_array = [1, 2];
+gtest.eq(test1.lazy_dispatch("second", lazy_array), lazy_array, "test lazy args get array");
+const lazy_self = test1.test_lazy_callback();
+const lazy_receiver = {};
+gtest.eq(lazy_self.call(lazy_receiver), lazy_receiver, "test lazy function receiver");
+gtest.eq(lazy.self(1, 2), lazy, "test lazy callback on object receiver");
+gtest.eq(typeof lazy.eager, "undefined", "test eager callback with kFlagLazyArgs rejected");
+
+const arena_args = [...Array(20).keys()].map(String);
+test1.arena_stats(...arena_args);
+gtest.eq(test1.arena_stats(...arena_args), 0, "test arena reused without heap allocation");
+
+// -1 if the callback profiling isn't built
+test1.callback_profile();
+test1.mirror(1);
+test1.mirror(2);
+test1.mirror(3);
+const mirror_calls = test1.callback_profile();
+gtest.eq(mirror_calls == 3 || mirror_calls == -1, true, "test callback profile count");
+
 test1.user_data_100();
 test1.user_data_200();
 
@@ -84,6 +116,29 @@ gtest.eq(test_driver.superProp, 3.1415926, "test_driver get super prop");
 gtest.eq(test_driver.driverProp, 2.78128, "test_driver get driver prop");
 
 
+$TEST(JSEnvTest, InterceptorTest)$
+gtest.eq(native_rows.length, 5, "native_rows length");
+gtest.eq(native_rows[2], 20, "native_rows indexed get");
+gtest.eq(native_rows[7], undefined, "native_rows out of range");
+native_rows[1] = 15;
+gtest.eq(native_rows[1], 15, "native_rows indexed set");
+gtest.eq(3 in native_rows, true, "native_rows indexed query");
+gtest.eq(9 in native_rows, false, "native_rows indexed query out of range");
+gtest.eq(Object.keys(native_rows).join(), "0,1,2,3,4", "native_rows keys");
+gtest.eq(native_rows.row3, 30, "native_rows named get");
+gtest.eq(native_rows.other, undefined, "native_rows named not handled");
+gtest.eq(Array.prototype.slice.call(native_rows, 3).join(), "30,40",
+         "native_rows as array-like");
+
+gtest.eq(native_rows.kind, "rows", "constant property");
+native_rows.kind = "other";
+gtest.eq(native_rows.kind, "rows", "constant property is read-only");
+gtest.eq(native_rows.stamp, 1, "lazy property first read");
+gtest.eq(native_rows.stamp, 1, "lazy property is cached");
+gtest.eq(Object.getOwnPropertyDescriptor(native_rows, "stamp").value, 1,
+         "lazy property is a data property");
+
+
 $TEST(JSEnvTest, GetObjectPropertiesTest)$
 const test_get_properties_obj = {
   'ival' : 100,
@@ -105,6 +160,23 @@ print("test_set_properties_obj:" + JSON.stringify(test_set_properties_obj));
 
 test1.test_foreach_object(test_set_properties_obj);
 
+const test_key_obj = {'id' : 7};
+test1.test_property_key(test_key_obj);
+gtest.eq(test_key_obj.type, "widget", "test_property_key type");
+gtest.eq(id, 8, "test_property_key global id");
+
+test1.test_batch_properties(test_get_properties_obj);
+gtest.eq(test_get_properties_obj.x, 10, "test_batch_properties x");
+gtest.eq(test_get_properties_obj.y, 2.5, "test_batch_properties y");
+
+const shape_obj1 = test1.test_object_shape(1);
+const shape_obj2 = test1.test_object_shape(2);
+gtest.eq(Object.keys(shape_obj1).join(), "type,x,y", "test_object_shape keys");
+gtest.eq(shape_obj1.type, "touch", "test_object_shape type");
+gtest.eq(shape_obj1.x, 1, "test_object_shape x");
+gtest.eq(shape_obj1.y, null, "test_object_shape y");
+gtest.eq(shape_obj2.x, 2, "test_object_shape x of another");
+
 
 $TEST(JSEnvTest, ArrayTest)$
 
@@ -124,6 +196,21 @@ gtest.eq(test_set_array_with_values[1], 2.71828, "test_set_array_with_values 1")
 gtest.eq(test_set_array_with_values[2], "hello from native mi quickapp", "test_set_array_with_values 2");
 gtest.eq(test_set_array_with_values[3], true, "test_set_array_with_values 3");
 
+const test_elements_array = [1, 2, 3.5, "four"];
+const test_elements_clamped = new Uint8ClampedArray(3);
+test1.test_array_elements(test_elements_array,
+    new Float64Array([1.5, -2.25]), test_elements_clamped);
+gtest.eq(test_elements_clamped[0], 255, "test_array_elements clamped 0");
+gtest.eq(test_elements_clamped[1], 0, "test_array_elements clamped 1");
+gtest.eq(test_elements_clamped[2], 128, "test_array_elements clamped 2");
+gtest.eq(test_elements_array.length, 7, "test_array_elements length");
+gtest.eq(test_elements_array[6], 127.5, "test_array_elements set 6");
+
+const test_int64_result = test1.test_int64(2 ** 40 + 1, 2n ** 63n, -5n,
+    new BigInt64Array([-7n]));
+gtest.eq(test_int64_result[0], Number.MAX_SAFE_INTEGER, "test_int64 number");
+gtest.eq(test_int64_result[1], -(2n ** 63n), "test_int64 BigInt");
+
 
 $TEST(JSEnvTest, FunctionTest)$
 
@@ -251,6 +338,107 @@ gtest.eq(int8_arr_external[1], 2, "array_buffer_external 1");
 gtest.eq(int8_arr_external[2], 3, "array_buffer_external 2");
 gtest.eq(int8_arr_external[4], 4, "array_buffer_external 3");
 
+const external_str = test1.new_external_string();
+gtest.eq(external_str.length, 4096, "external_string length");
+gtest.eq(external_str.substr(0, 3), "abc", "external_string head");
+gtest.eq(external_str.charAt(4095), "n", "external_string tail");
+gtest.eq(test1.new_external_string(), external_str, "external_string reuse");
+test1.delete_external_string();
+gtest.eq(external_str.charAt(26), "a", "external_string after delete");
+
+const serialize_buffer = new Uint8Array([5, 6, 7]).buffer;
+const serialize_view = new Uint8Array(serialize_buffer);
+const [serialize_clone, serialize_moved] = test1.test_serialize(
+    {'a' : [1, 'two', {'b' : 3n}], 'm' : new Map([[1, 2]])}, serialize_buffer);
+gtest.eq(serialize_clone.a[1], "two", "test_serialize clone array");
+gtest.eq(serialize_clone.a[2].b, 3n, "test_serialize clone BigInt");
+gtest.eq(serialize_clone.m.get(1), 2, "test_serialize clone Map");
+gtest.eq(serialize_buffer.byteLength, 0, "test_serialize detached");
+gtest.eq(test1.test_detached_elements(serialize_view), true,
+         "test_detached_elements");
+gtest.eq(new Uint8Array(serialize_moved)[2], 7, "test_serialize moved");
+
+gtest.eq(test1.test_json().tags[1], "b", "test_json tags");
+
+const typed_functions = test1.new_typed_functions();
+gtest.eq(typed_functions.hypot(3, 4), 5, "typed_function hypot");
+gtest.eq(typed_functions.hypot(3.9, "4"), 5, "typed_function ToInt32");
+gtest.eq(typed_functions.hypot(3), 3, "typed_function missed argument");
+gtest.eq(typed_functions.is_even(2n ** 40n), true, "typed_function BigInt");
+gtest.eq(typed_functions.is_even(7), false, "typed_function int64");
+gtest.eq(typed_functions.negate(2n ** 62n + 1n), -(2n ** 62n) - 1n,
+         "typed_function int64 result");
+
+const async_square = test1.new_async_square();
+let async_resolved;
+let async_rejected;
+async_square(7).then((v) => { async_resolved = v; });
+async_square(-1).catch((e) => { async_rejected = e; });
+gtest.eq(async_resolved, undefined, "async function pending");
+gtest.eq(test1.run_async_completions(), 2, "async completions settled in one batch");
+gtest.eq(async_resolved, 49, "async function resolved");
+gtest.eq(async_rejected, "negative", "async function rejected");
+gtest.eq(test1.run_async_completions(), 0, "async completions drained");
+let async_thrown;
+async_square("x").catch((e) => { async_thrown = e; });
+gtest.eq(test1.run_async_completions(), 0, "async throwing callback queues nothing");
+
+const async_clone = test1.new_async_clone();
+const async_clone_input = {name: "point", xy: [3, 4]};
+let async_cloned;
+async_clone(async_clone_input).then((v) => { async_cloned = v; });
+gtest.eq(test1.run_async_completions(), 1, "async serialized completion");
+gtest.eq(async_cloned !== async_clone_input, true, "async serialized copy");
+gtest.eq(async_cloned.name, "point", "async serialized string");
+gtest.eq(async_cloned.xy[1], 4, "async serialized array");
+// the reaction ran by the checkpoint of the batch above
+gtest.eq(async_thrown, "not an int", "async throwing callback rejects");
+
+gtest.eq(test1.post_tasks(), true, "post_tasks wakeup fd readable");
+gtest.eq(test1.run_pending_tasks(0), "h", "run_pending_tasks budget 0 runs one task");
+gtest.eq(test1.task_fd_readable(), true, "wakeup fd readable while tasks are left");
+gtest.eq(test1.run_pending_tasks(), "nNl", "run_pending_tasks by priority");
+gtest.eq(test1.task_fd_readable(), false, "wakeup fd cleared");
+gtest.eq(test1.run_pending_tasks(), "", "run_pending_tasks drained");
+
+let microtask_count = 0;
+test1.test_microtask_policy(() => microtask_count++);
+gtest.eq(microtask_count, 3, "microtasks run by the explicit checkpoint");
+
+gtest.eq(test1.test_prepared_call(function(x) { return x * this.base; }, {base: 2}),
+         9900, "prepared call on the receiver");
+
+let event_sum = 0;
+const event_calls = test1.test_event_channel((channel) => {
+  const once = (a, b) => {
+    event_sum += a * 100;
+    channel.removeListener(once);
+  };
+  channel.addListener((a, b) => { throw new Error("listener error"); });
+  channel.addListener(once);
+  channel.addListener((a, b) => { event_sum += a + b; });
+});
+gtest.eq(event_calls, 5, "event channel listeners called");
+gtest.eq(event_sum, 106, "event channel payload and removal");
+
+let deleted_channel_sum = 0;
+gtest.eq(test1.test_delete_emitting_channel((channel, delete_channel) => {
+  channel.addListener((a) => { deleted_channel_sum += a; });
+  channel.addListener(delete_channel);
+  channel.addListener((a) => { deleted_channel_sum += a * 10; });
+}), 2, "event channel deleted by a listener");
+gtest.eq(deleted_channel_sum, 3, "event channel listeners after the delete");
+
+gtest.eq(test1.test_batched_calls(() => {
+  for (let i = 0; i < 100; i++) {
+    batch.post(i, i % 10 ? "call" + i : {name: "call" + i});
+  }
+}), 91004950, "batched calls delivered at once, 90 without structured clone");
+
+gtest.eq(test1.test_finalize_stats(), true, "collected instances finalized deferred and in background");
+
+gtest.eq(test1.test_new_instances(1000), 1000, "bulk instances made and finalized");
+
 
 $TEST(JSEnvTest, PromiseTest)$
 const promise_from_native1 = test1.create_promise();
@@ -304,3 +492,10 @@ function new_func3_callback() {
 const new_func3 = test1.new_func(new_func3_callback)
 gtest.eq(new_func3(new_func3_callback) == new_func3_callback,
     true, 'pass func as param')
+
+const deleted_func = test1.new_func()
+gtest.eq(test1.delete_function(deleted_func), true, 'delete_function')
+gtest.eq(deleted_func(100), undefined, 'deleted function is unbound')
+gtest.eq(test1.delete_function(deleted_func), false, 'delete_function twice')
+gtest.eq(test1.delete_function(new_func3_callback), false,
+    'delete_function not a native function')
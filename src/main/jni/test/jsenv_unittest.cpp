@@ -10,7 +10,16 @@
 #include "hybrid-log.h"
 #include "test_help.h"
 
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <initializer_list>
+#include <string>
+#include <thread>
+#include <vector>
 
 using hybrid::JSEnv;
 
@@ -62,6 +71,169 @@ static bool mirror_func(JSEnv* env,
   return true;
 }
 
+static bool borrow_string_func(JSEnv* env,
+                               void* user_data,
+                               JSObject self,
+                               const JSValue* argv,
+                               int argc,
+                               JSValue* presult) {
+  if (argc < 2 || !argv[0].IsUTF8String() || !argv[1].IsInt()) {
+    return false;
+  }
+
+  EXPECT_EQ(static_cast<int>(argv[0].Length()), argv[1].IntVal())
+      << "borrow_string utf8 length";
+
+  // the borrowed string is released after return, keep a copy
+  presult->CopyFrom(argv[0]);
+  return true;
+}
+
+static bool test_arena_stats(JSEnv* env,
+                             void* user_data,
+                             JSObject self,
+                             const JSValue* argv,
+                             int argc,
+                             JSValue* presult) {
+  EXPECT_EQ(argc, 20) << "test_arena_stats argc";
+  for (int i = 0; i < argc; i++) {
+    EXPECT_EQ(argv[i].IsUTF8String(), true) << "test_arena_stats arg " << i;
+    EXPECT_EQ(std::string(argv[i].UTF8Str()), std::to_string(i))
+        << "test_arena_stats arg " << i;
+  }
+
+  JSArenaStats stats;
+  EXPECT_NE(env->DispatchJSEnvCommand(kJSEnvCommandGetArenaStats, &stats),
+            nullptr)
+      << "test_arena_stats get stats";
+  EXPECT_GT(stats.used, 0u) << "test_arena_stats arguments in arena";
+  EXPECT_GE(stats.high_water_mark, stats.used) << "test_arena_stats hwm";
+  EXPECT_GE(stats.capacity, stats.used) << "test_arena_stats capacity";
+
+  env->DispatchJSEnvCommand(kJSEnvCommandResetArenaStats, nullptr);
+
+  presult->Set(static_cast<int>(stats.heap_allocation_count));
+  return true;
+}
+
+static bool test_callback_profile(JSEnv* env,
+                                  void* user_data,
+                                  JSObject self,
+                                  const JSValue* argv,
+                                  int argc,
+                                  JSValue* presult) {
+  JSCallbackProfileEntry entries[64];
+  JSCallbackProfileReport report = {entries, 64, 0};
+#ifdef JSENV_ENABLE_CALLBACK_PROFILING
+  EXPECT_NE(env->DispatchJSEnvCommand(kJSEnvCommandGetCallbackProfile, &report),
+            nullptr)
+      << "test_callback_profile get profile";
+  int mirror_calls = 0;
+  for (int i = 0; i < report.count && i < report.capacity; i++) {
+    EXPECT_GE(entries[i].total_ns, entries[i].callback_ns)
+        << "test_callback_profile " << entries[i].name;
+    if (std::string(entries[i].name) == "test1.mirror") {
+      mirror_calls = static_cast<int>(entries[i].call_count);
+    }
+  }
+
+  char buffer[16];
+  JSCallbackProfileJSON json = {buffer, sizeof(buffer), 0};
+  env->DispatchJSEnvCommand(kJSEnvCommandGetCallbackProfileJSON, &json);
+  EXPECT_GT(json.length, sizeof(buffer)) << "test_callback_profile json";
+  EXPECT_EQ(strlen(buffer), sizeof(buffer) - 1)
+      << "test_callback_profile json truncated";
+
+  env->DispatchJSEnvCommand(kJSEnvCommandResetCallbackProfile, nullptr);
+  presult->Set(mirror_calls);
+#else
+  EXPECT_EQ(env->DispatchJSEnvCommand(kJSEnvCommandGetCallbackProfile, &report),
+            nullptr)
+      << "test_callback_profile disabled";
+  presult->Set(-1);
+#endif
+  return true;
+}
+
+// dispatch on argument 0, the others are converted when they are used
+static bool lazy_dispatch_func(JSEnv* env,
+                               void* user_data,
+                               JSObject self,
+                               JSArgs args,
+                               JSValue* presult) {
+  int argc = env->GetArgsLength(args);
+  EXPECT_GE(argc, 1) << "lazy_dispatch argc";
+  EXPECT_EQ(env->GetArgType(args, 0), JSValue::kUTF8String)
+      << "lazy_dispatch arg 0 type";
+  EXPECT_EQ(env->GetArgType(args, argc), JSValue::kNull)
+      << "lazy_dispatch out of range";
+
+  JSValue op;
+  env->GetArg(args, 0, &op);
+  if (std::string(op.UTF8Str()) == "count") {
+    presult->Set(argc - 1);
+    return true;
+  }
+
+  if (std::string(op.UTF8Str()) == "type") {
+    int type = env->GetArgType(args, 1);
+    JSValue value;
+    if (env->GetArg(args, 1, &value)) {
+      EXPECT_EQ(value.type, type) << "lazy_dispatch GetArg type";
+    }
+    presult->Set(type);
+    return true;
+  }
+
+  // "second"
+  JSValue value;
+  env->GetArg(args, 1, &value);
+  presult->CopyFrom(value);
+  return true;
+}
+
+// returns the receiver, which is |self| for both registrations
+static bool lazy_self_func(JSEnv* env,
+                           void* user_data,
+                           JSObject self,
+                           JSArgs args,
+                           JSValue* presult) {
+  presult->Set(self);
+  return true;
+}
+
+static bool unused_user_func(JSEnv* env,
+                             void* user_data,
+                             J2V8ObjectHandle handle,
+                             const JSValue* argv,
+                             int argc,
+                             JSValue* presult) {
+  return false;
+}
+
+// registers lazy.self and returns a lazy function
+static bool test_lazy_callback(JSEnv* env,
+                               void* user_data,
+                               JSObject self,
+                               const JSValue* argv,
+                               int argc,
+                               JSValue* presult) {
+  EXPECT_EQ(env->RegisterLazyCallbackOnObject(nullptr, "lazy.self",
+                                              lazy_self_func, nullptr),
+            true)
+      << "test_lazy_callback register";
+  EXPECT_EQ(env->RegisterCallbackOnObject(nullptr, "lazy.eager",
+                                          unused_user_func, nullptr,
+                                          JSEnv::kFlagLazyArgs),
+            false)
+      << "test_lazy_callback eager callback with kFlagLazyArgs";
+
+  JSObject function = env->NewLazyFunction(lazy_self_func, nullptr);
+  EXPECT_NE(function, nullptr) << "test_lazy_callback new function";
+  presult->Set(function);
+  return true;
+}
+
 template <int N>
 static bool user_data_func(JSEnv* env,
                            void* user_data,
@@ -230,6 +402,102 @@ static bool test_set_object_properties(JSEnv* jsenv,
   return true;
 }
 
+static bool test_property_key(JSEnv* jsenv,
+                              void* user_data,
+                              JSObject self,
+                              const JSValue* argv,
+                              int argc,
+                              JSValue* presult) {
+  if (argc <= 0 || !argv[0].IsObject()) {
+    ALOGE("JSENV", "test_property_key args 0 must be a object");
+    return false;
+  }
+
+  JSObject object = argv[0].Object();
+
+  JSPropertyKey id_key = jsenv->CreatePropertyKey("id");
+  JSPropertyKey type_key = jsenv->CreatePropertyKey("type");
+  EXPECT_NE(id_key, nullptr) << "test_property_key create";
+  EXPECT_EQ(jsenv->CreatePropertyKey("id"), id_key) << "test_property_key same";
+  EXPECT_NE(type_key, id_key) << "test_property_key different";
+
+  JSValue value;
+  bool bret = jsenv->GetObjectProperty(object, id_key, &value);
+  EXPECT_EQ(bret, true) << "test_property_key get id";
+  EXPECT_EQ(value.IntVal(), 7) << "test_property_key get id 7";
+
+  bret = jsenv->SetObjectPropertyValue(object, type_key, "widget");
+  EXPECT_EQ(bret, true) << "test_property_key set type";
+
+  bret = jsenv->SetGlobalValue(id_key, 8);
+  EXPECT_EQ(bret, true) << "test_property_key set global id";
+  bret = jsenv->GetGlobal(id_key, &value);
+  EXPECT_EQ(bret, true) << "test_property_key get global id";
+  EXPECT_EQ(value.IntVal(), 8) << "test_property_key get global id 8";
+
+  return true;
+}
+
+static bool test_batch_properties(JSEnv* jsenv,
+                                  void* user_data,
+                                  JSObject self,
+                                  const JSValue* argv,
+                                  int argc,
+                                  JSValue* presult) {
+  if (argc <= 0 || !argv[0].IsObject()) {
+    ALOGE("JSENV", "test_batch_properties args 0 must be a object");
+    return false;
+  }
+
+  JSObject object = argv[0].Object();
+
+  JSValue keys[3] = {JSValue("ival"), JSValue("strval"), JSValue("bval")};
+  JSValue values[3];
+  bool bret = jsenv->GetObjectProperties(object, keys, 3, values,
+                                         JSEnv::kFlagUseUTF8);
+  EXPECT_EQ(bret, true) << "test_batch_properties get";
+  EXPECT_EQ(values[0].IntVal(), 100) << "test_batch_properties get ival";
+  EXPECT_EQ(std::string(values[1].UTF8Str()), std::string("mi quickapp"))
+      << "test_batch_properties get strval";
+  EXPECT_EQ(values[2].Boolean(), true) << "test_batch_properties get bval";
+
+  JSPropertyKey prop_keys[2] = {jsenv->CreatePropertyKey("x"),
+                                jsenv->CreatePropertyKey("y")};
+  JSValue prop_values[2] = {JSValue(10), JSValue(2.5)};
+  bret = jsenv->SetObjectProperties(object, prop_keys, prop_values, 2);
+  EXPECT_EQ(bret, true) << "test_batch_properties set";
+
+  bret = jsenv->GetObjectProperties(object, prop_keys, 2, values);
+  EXPECT_EQ(bret, true) << "test_batch_properties get by keys";
+  EXPECT_EQ(values[0].IntVal(), 10) << "test_batch_properties get x";
+  EXPECT_EQ(values[1].FloatVal(), 2.5) << "test_batch_properties get y";
+
+  return true;
+}
+
+static bool test_object_shape(JSEnv* jsenv,
+                              void* user_data,
+                              JSObject self,
+                              const JSValue* argv,
+                              int argc,
+                              JSValue* presult) {
+  static const char* names[] = {"type", "x", "y"};
+  static JSObjectShape shape = nullptr;
+  if (shape == nullptr) {
+    shape = jsenv->CreateObjectShape(names, 3);
+    EXPECT_NE(shape, nullptr) << "test_object_shape create";
+
+    static const char* duplicate_names[] = {"x", "y", "x"};
+    EXPECT_EQ(jsenv->CreateObjectShape(duplicate_names, 3), nullptr)
+        << "test_object_shape duplicate names";
+  }
+
+  int x = argc > 0 ? argv[0].IntVal() : 0;
+  JSValue values[2] = {JSValue("touch"), JSValue(x)};
+  presult->Set(jsenv->NewObjectWithShape(shape, values, 2));
+  return true;
+}
+
 static bool test_foreach_object(JSEnv* jsenv,
                                 void* user_data,
                                 JSObject self,
@@ -373,6 +641,102 @@ static bool test_set_array(JSEnv* jsenv,
   return true;
 }
 
+static bool test_array_elements(JSEnv* jsenv,
+                                void* user_data,
+                                JSObject self,
+                                const JSValue* argv,
+                                int argc,
+                                JSValue* presult) {
+  if (argc < 3 || !argv[0].IsObject() || !argv[1].IsObject() ||
+      !argv[2].IsObject()) {
+    ALOGE("JSENV", "test_array_elements need array, Float64Array and "
+          "Uint8ClampedArray");
+    return false;
+  }
+
+  JSValue values[4];
+  bool bret = jsenv->GetArrayElements(argv[0].Object(), 1, 4, values,
+                                      JSEnv::kFlagUseUTF8);
+  EXPECT_EQ(bret, true) << "test_array_elements get array";
+  EXPECT_EQ(values[0].IntVal(), 2) << "test_array_elements get array 1";
+  EXPECT_EQ(values[1].FloatVal(), 3.5) << "test_array_elements get array 2";
+  EXPECT_EQ(std::string(values[2].UTF8Str()), std::string("four"))
+      << "test_array_elements get array 3";
+  EXPECT_EQ(values[3].Type(), JSValue::kNull)
+      << "test_array_elements get out of range";
+
+  bret = jsenv->GetArrayElements(argv[1].Object(), 0, 2, values);
+  EXPECT_EQ(bret, true) << "test_array_elements get Float64Array";
+  EXPECT_EQ(values[0].FloatVal(), 1.5) << "test_array_elements Float64 0";
+  EXPECT_EQ(values[1].FloatVal(), -2.25) << "test_array_elements Float64 1";
+
+  JSValue new_values[3] = {JSValue(300), JSValue(-1.0), JSValue(127.5)};
+  bret = jsenv->SetArrayElements(argv[2].Object(), 0, new_values, 3);
+  EXPECT_EQ(bret, true) << "test_array_elements set Uint8ClampedArray";
+  bret = jsenv->SetArrayElements(argv[2].Object(), 2, new_values, 3);
+  EXPECT_EQ(bret, false) << "test_array_elements set out of range";
+
+  bret = jsenv->SetArrayElements(argv[0].Object(), 4, new_values, 3);
+  EXPECT_EQ(bret, true) << "test_array_elements set array";
+
+  return true;
+}
+
+// a view of the buffer detached by test_serialize
+static bool test_detached_elements(JSEnv* jsenv,
+                                   void* user_data,
+                                   JSObject self,
+                                   const JSValue* argv,
+                                   int argc,
+                                   JSValue* presult) {
+  if (argc < 1 || !argv[0].IsObject()) {
+    return false;
+  }
+
+  JSValue values[2] = {JSValue(1), JSValue(2)};
+  bool bret = jsenv->GetArrayElements(argv[0].Object(), 0, 2, values);
+  EXPECT_EQ(bret, false) << "test_detached_elements get";
+  EXPECT_EQ(values[0].Type(), JSValue::kNull) << "test_detached_elements 0";
+  EXPECT_EQ(values[1].Type(), JSValue::kNull) << "test_detached_elements 1";
+  presult->Set(!bret && values[0].Type() == JSValue::kNull &&
+               values[1].Type() == JSValue::kNull);
+  return true;
+}
+
+static bool test_int64(JSEnv* jsenv,
+                       void* user_data,
+                       JSObject self,
+                       const JSValue* argv,
+                       int argc,
+                       JSValue* presult) {
+  EXPECT_EQ(argc, 4) << "test_int64 argc";
+  if (argc < 4) {
+    return false;
+  }
+
+  EXPECT_EQ(argv[0].IsInt64(), true) << "test_int64 number";
+  EXPECT_EQ(argv[0].Int64Val(), 1099511627777LL) << "test_int64 2^40+1";
+  EXPECT_EQ(argv[0].IsNumber(), true) << "test_int64 is a number";
+  EXPECT_EQ(argv[1].Type(), JSValue::kBigUint64) << "test_int64 big uint";
+  EXPECT_EQ(argv[1].Uint64Val(), 9223372036854775808ULL)
+      << "test_int64 2n**63n";
+  EXPECT_EQ(argv[2].Type(), JSValue::kBigInt64) << "test_int64 big int";
+  EXPECT_EQ(argv[2].Int64Val(), -5) << "test_int64 -5n";
+
+  EXPECT_EQ(jsenv->GetTypedArrayType(argv[3].Object()), JSValue::kJSInt64Array)
+      << "test_int64 BigInt64Array";
+  JSValue element;
+  bool bret = jsenv->GetArrayElements(argv[3].Object(), 0, 1, &element);
+  EXPECT_EQ(bret, true) << "test_int64 get BigInt64Array";
+  EXPECT_EQ(element.Int64Val(), -7) << "test_int64 BigInt64Array 0";
+
+  JSValue values[2];
+  values[0].Set(static_cast<int64_t>(9007199254740991LL));
+  values[1].SetBigInt(INT64_MIN);
+  presult->Set(jsenv->NewArrayWithValues(values, 2));
+  return true;
+}
+
 static bool test_set_array_with_values(JSEnv* jsenv,
                                        void* user_data,
                                        JSObject self,
@@ -718,6 +1082,701 @@ static bool new_array_buffer_external(JSEnv* jsenv,
   return true;
 }
 
+// argv: a value to clone, an ArrayBuffer to transfer
+static bool test_serialize(JSEnv* jsenv,
+                           void* user_data,
+                           JSObject self,
+                           const JSValue* argv,
+                           int argc,
+                           JSValue* presult) {
+  if (argc < 2 || !argv[1].IsObject()) {
+    ALOGE("JSENV", "test_serialize need a value and an ArrayBuffer");
+    return false;
+  }
+
+  // save and restore without transfers
+  JSSerializedData data = jsenv->SerializeValue(&argv[0]);
+  EXPECT_NE(data, nullptr) << "test_serialize serialize";
+  size_t size = 0;
+  const void* buffer = jsenv->GetSerializedDataBuffer(data, &size);
+  EXPECT_NE(buffer, nullptr) << "test_serialize buffer";
+  JSSerializedData saved = jsenv->NewSerializedData(buffer, size);
+  jsenv->DeleteSerializedData(data);
+
+  JSValue value;
+  EXPECT_EQ(jsenv->DeserializeValue(saved, &value), true)
+      << "test_serialize deserialize saved";
+  jsenv->DeleteSerializedData(saved);
+
+  // move the ArrayBuffer
+  JSObject transfers[] = {argv[1].Object()};
+  JSValue array_buffer(argv[1].Object());
+  data = jsenv->SerializeValue(&array_buffer, transfers, 1);
+  EXPECT_NE(data, nullptr) << "test_serialize transfer";
+  EXPECT_EQ(jsenv->GetArrayBufferLength(argv[1].Object()), 0u)
+      << "test_serialize detached";
+  EXPECT_EQ(jsenv->GetSerializedDataBuffer(data, &size), nullptr)
+      << "test_serialize transfer can't be saved";
+
+  JSValue moved;
+  EXPECT_EQ(jsenv->DeserializeValue(data, &moved), true)
+      << "test_serialize deserialize transfer";
+  EXPECT_EQ(jsenv->DeserializeValue(data, &moved), false)
+      << "test_serialize transfer once";
+  jsenv->DeleteSerializedData(data);
+
+  JSValue values[2];
+  values[0].CopyFrom(value);
+  values[1].CopyFrom(moved);
+  presult->Set(jsenv->NewArrayWithValues(values, 2));
+  return true;
+}
+
+static bool test_json(JSEnv* jsenv,
+                      void* user_data,
+                      JSObject self,
+                      const JSValue* argv,
+                      int argc,
+                      JSValue* presult) {
+  const char* json = "{\"id\":12,\"tags\":[\"a\",\"b\"]}";
+  JSValue object;
+  bool bret = jsenv->ParseJSON(json, -1, &object);
+  EXPECT_EQ(bret, true) << "test_json parse";
+  EXPECT_EQ(object.IsObject(), true) << "test_json parse object";
+
+  JSValue id;
+  jsenv->GetObjectPropertyValue(object.Object(), "id", &id);
+  EXPECT_EQ(id.IntVal(), 12) << "test_json parse id";
+
+  JSValue str;
+  bret = jsenv->StringifyJSON(object.Object(), &str, JSEnv::kFlagUseUTF8);
+  EXPECT_EQ(bret, true) << "test_json stringify";
+  EXPECT_EQ(std::string(str.UTF8Str()), std::string(json))
+      << "test_json stringify result";
+
+  JSValue invalid;
+  bret = jsenv->ParseJSON("{id:", -1, &invalid);
+  EXPECT_EQ(bret, false) << "test_json parse invalid";
+  EXPECT_EQ(jsenv->HasException(), true) << "test_json parse exception";
+  jsenv->ClearException();
+
+  presult->CopyFrom(object);
+  return true;
+}
+
+static double typed_hypot(int32_t x, int32_t y) {
+  return std::sqrt(static_cast<double>(x) * x + static_cast<double>(y) * y);
+}
+
+static bool typed_is_even(int64_t v) {
+  return v % 2 == 0;
+}
+
+static int64_t typed_negate(int64_t v) {
+  return -v;
+}
+
+static bool new_typed_functions(JSEnv* jsenv,
+                                void* user_data,
+                                JSObject self,
+                                const JSValue* argv,
+                                int argc,
+                                JSValue* presult) {
+  JSObject functions = jsenv->NewObject();
+  jsenv->SetObjectPropertyValue(
+      functions, "hypot",
+      jsenv->NewTypedFunction<double(int32_t, int32_t)>(typed_hypot));
+  jsenv->SetObjectPropertyValue(functions, "is_even",
+                                jsenv->NewTypedFunction(typed_is_even));
+  jsenv->SetObjectPropertyValue(functions, "negate",
+                                jsenv->NewTypedFunction(typed_negate));
+  presult->Set(functions);
+  return true;
+}
+
+// completed on worker threads, settled by run_async_completions
+static std::vector<std::thread> g_async_threads;
+
+static void async_square(JSEnv* jsenv,
+                         void* user_data,
+                         JSObject self,
+                         const JSValue* argv,
+                         int argc,
+                         JSAsyncToken token) {
+  if (argc == 0 || !argv[0].IsInt()) {
+    // rejects the promise, the token is not completed
+    jsenv->SetException(JSException::kNativeException, "not an int");
+    return;
+  }
+  int n = argv[0].IntVal();
+  // the worker holds its own reference while it completes
+  jsenv->AddReference();
+  g_async_threads.emplace_back([jsenv, token, n]() {
+    if (n < 0) {
+      JSValue error("negative");
+      jsenv->CompleteAsync(token, false, &error);
+    } else {
+      JSValue result(n * n);
+      jsenv->CompleteAsync(token, true, &result);
+    }
+    jsenv->Release();
+  });
+}
+
+static bool new_async_square(JSEnv* jsenv,
+                             void* user_data,
+                             JSObject self,
+                             const JSValue* argv,
+                             int argc,
+                             JSValue* presult) {
+  presult->Set(jsenv->NewAsyncFunction(async_square, nullptr));
+  return true;
+}
+
+// argv[0] is serialized on the JS thread, the worker resolves with the copy
+static void async_clone(JSEnv* jsenv,
+                        void* user_data,
+                        JSObject self,
+                        const JSValue* argv,
+                        int argc,
+                        JSAsyncToken token) {
+  JSSerializedData data =
+      argc > 0 ? jsenv->SerializeValue(&argv[0]) : nullptr;
+  jsenv->AddReference();
+  g_async_threads.emplace_back([jsenv, token, data]() {
+    EXPECT_EQ(jsenv->CompleteAsyncWithSerializedData(token, true, data), true)
+        << "async_clone complete";
+    jsenv->Release();
+  });
+}
+
+static bool new_async_clone(JSEnv* jsenv,
+                            void* user_data,
+                            JSObject self,
+                            const JSValue* argv,
+                            int argc,
+                            JSValue* presult) {
+  presult->Set(jsenv->NewAsyncFunction(async_clone, nullptr));
+  return true;
+}
+
+static bool run_async_completions(JSEnv* jsenv,
+                                  void* user_data,
+                                  JSObject self,
+                                  const JSValue* argv,
+                                  int argc,
+                                  JSValue* presult) {
+  for (std::thread& thread : g_async_threads) {
+    thread.join();
+  }
+  g_async_threads.clear();
+  presult->Set(jsenv->RunAsyncCompletions());
+  return true;
+}
+
+// the tasks append their names, run_pending_tasks returns the run order
+static std::string g_task_order;
+
+static void append_task_name(JSEnv* jsenv, void* user_data) {
+  if (jsenv) {
+    g_task_order += reinterpret_cast<const char*>(user_data);
+  }
+}
+
+static bool IsFdReadable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+// returns whether the wakeup fd is readable after the tasks are posted
+static bool post_tasks(JSEnv* jsenv,
+                       void* user_data,
+                       JSObject self,
+                       const JSValue* argv,
+                       int argc,
+                       JSValue* presult) {
+  EXPECT_GE(jsenv->GetTaskWakeupFd(), 0) << "post_tasks wakeup fd";
+
+  // the poster holds its own reference while it posts
+  jsenv->AddReference();
+  std::thread poster([jsenv]() {
+    jsenv->PostTask(append_task_name, const_cast<char*>("l"),
+                    kJSTaskPriorityLow);
+    jsenv->PostTask(append_task_name, const_cast<char*>("n"));
+    jsenv->PostTask(append_task_name, const_cast<char*>("h"),
+                    kJSTaskPriorityHigh);
+    jsenv->PostTask(append_task_name, const_cast<char*>("N"));
+    jsenv->Release();
+  });
+  poster.join();
+  presult->Set(IsFdReadable(jsenv->GetTaskWakeupFd()));
+  return true;
+}
+
+static bool task_fd_readable(JSEnv* jsenv,
+                             void* user_data,
+                             JSObject self,
+                             const JSValue* argv,
+                             int argc,
+                             JSValue* presult) {
+  presult->Set(IsFdReadable(jsenv->GetTaskWakeupFd()));
+  return true;
+}
+
+static bool run_pending_tasks(JSEnv* jsenv,
+                              void* user_data,
+                              JSObject self,
+                              const JSValue* argv,
+                              int argc,
+                              JSValue* presult) {
+  // argv[0] is the budget in microseconds
+  int64_t budget_us = (argc > 0 && argv[0].IsInt()) ? argv[0].IntVal() : -1;
+  g_task_order.clear();
+  int count = jsenv->RunPendingTasks(budget_us);
+  EXPECT_EQ(count, static_cast<int>(g_task_order.size()))
+      << "run_pending_tasks count";
+  presult->Set(g_task_order.c_str(), static_cast<int>(g_task_order.size()),
+               true);
+  return true;
+}
+
+// settle a frame of promises and run their reactions by one checkpoint
+static bool test_microtask_policy(JSEnv* jsenv,
+                                  void* user_data,
+                                  JSObject self,
+                                  const JSValue* argv,
+                                  int argc,
+                                  JSValue* presult) {
+  if (argc < 1 || !argv[0].IsObject()) {
+    return false;
+  }
+
+  int policy = jsenv->GetMicrotaskPolicy();
+  EXPECT_EQ(jsenv->SetMicrotaskPolicy(kJSMicrotaskPolicyExplicit), true)
+      << "test_microtask_policy set explicit";
+  jsenv->PerformMicrotaskCheckpoint();
+  EXPECT_EQ(jsenv->GetSettledPromiseCount(), 0)
+      << "test_microtask_policy drained";
+
+  for (int i = 0; i < 3; i++) {
+    JSObject resolver = jsenv->CreateResolver();
+    jsenv->SetPromiseThen(jsenv->GetPromiseFromResolver(resolver),
+                          argv[0].Object());
+    jsenv->ResolveValue(resolver, i);
+  }
+  EXPECT_EQ(jsenv->GetSettledPromiseCount(), 3)
+      << "test_microtask_policy settled";
+
+  jsenv->PerformMicrotaskCheckpoint();
+  EXPECT_EQ(jsenv->GetSettledPromiseCount(), 0)
+      << "test_microtask_policy checkpoint";
+
+  jsenv->SetMicrotaskPolicy(policy);
+  return true;
+}
+
+// call the handler argv[0] on the receiver argv[1] 100 times
+static bool test_prepared_call(JSEnv* jsenv,
+                               void* user_data,
+                               JSObject self,
+                               const JSValue* argv,
+                               int argc,
+                               JSValue* presult) {
+  if (argc < 2 || !argv[0].IsObject() || !argv[1].IsObject()) {
+    return false;
+  }
+
+  JSPreparedCall call =
+      jsenv->PrepareCall(argv[0].Object(), argv[1].Object(), 1);
+  EXPECT_NE(call, nullptr) << "test_prepared_call prepare";
+
+  int sum = 0;
+  for (int i = 0; i < 100; i++) {
+    JSValue arg(i);
+    JSValue result;
+    EXPECT_EQ(jsenv->InvokePreparedCall(call, &arg, &result), true)
+        << "test_prepared_call invoke " << i;
+    sum += result.IntVal();
+  }
+
+  jsenv->DeletePreparedCall(call);
+  presult->Set(sum);
+  return true;
+}
+
+// argv[0] adds the listeners to the channel object, the count of the
+// listeners called by 2 emits is returned
+static bool test_event_channel(JSEnv* jsenv,
+                               void* user_data,
+                               JSObject self,
+                               const JSValue* argv,
+                               int argc,
+                               JSValue* presult) {
+  if (argc < 1 || !argv[0].IsObject()) {
+    return false;
+  }
+
+  JSEventChannel channel = jsenv->CreateEventChannel();
+  JSValue object(jsenv->GetEventChannelObject(channel));
+  JSValue result;
+  jsenv->CallFunction(argv[0].Object(), nullptr, &object, 1, &result);
+  EXPECT_EQ(jsenv->AddEventListener(channel, argv[0].Object()), true)
+      << "test_event_channel add native";
+  EXPECT_EQ(jsenv->AddEventListener(channel, argv[0].Object()), false)
+      << "test_event_channel add twice";
+  EXPECT_EQ(jsenv->RemoveEventListener(channel, argv[0].Object()), true)
+      << "test_event_channel remove native";
+
+  JSValue payload[2] = {JSValue(1), JSValue(2)};
+  int count = jsenv->EmitEvent(channel, payload, 2);
+  EXPECT_EQ(jsenv->HasException(), true) << "test_event_channel exception";
+  if (jsenv->HasException()) {
+    EXPECT_NE(strstr(jsenv->GetException().message, "listener error"),
+              nullptr)
+        << "test_event_channel exception message";
+    jsenv->ClearException();
+  }
+  count += jsenv->EmitEvent(channel, payload, 2);
+  jsenv->ClearException();
+
+  jsenv->DeleteEventChannel(channel);
+  presult->Set(count);
+  return true;
+}
+
+// a listener which deletes the channel being emitted
+static bool delete_event_channel(JSEnv* jsenv,
+                                 void* user_data,
+                                 JSObject self,
+                                 const JSValue* argv,
+                                 int argc,
+                                 JSValue* presult) {
+  jsenv->DeleteEventChannel(static_cast<JSEventChannel>(user_data));
+  return true;
+}
+
+// argv[0] adds the listeners around delete_event_channel, the count of the
+// listeners called by the emit is returned
+static bool test_delete_emitting_channel(JSEnv* jsenv,
+                                         void* user_data,
+                                         JSObject self,
+                                         const JSValue* argv,
+                                         int argc,
+                                         JSValue* presult) {
+  if (argc < 1 || !argv[0].IsObject()) {
+    return false;
+  }
+
+  JSEventChannel channel = jsenv->CreateEventChannel();
+  JSValue args[2] = {JSValue(jsenv->GetEventChannelObject(channel)),
+                     JSValue(jsenv->NewFunction(delete_event_channel,
+                                                channel))};
+  JSValue result;
+  jsenv->CallFunction(argv[0].Object(), nullptr, args, 2, &result);
+
+  JSValue payload(3);
+  int count = jsenv->EmitEvent(channel, &payload, 1);
+  EXPECT_EQ(jsenv->HasException(), false)
+      << "test_delete_emitting_channel exception";
+  presult->Set(count);
+  return true;
+}
+
+struct BatchedCallsResult {
+  int batches;
+  int calls;
+  int native_calls;
+  int sum;
+};
+
+// batch.post(n, "call" + n or an object): sums the first argument of the
+// calls, the ones without an object are read without V8
+static void on_batched_calls(JSEnv* jsenv,
+                             void* user_data,
+                             const JSBatchedCall* calls,
+                             int count) {
+  BatchedCallsResult* result = static_cast<BatchedCallsResult*>(user_data);
+  result->batches++;
+  for (int i = 0; i < count; i++) {
+    result->calls++;
+    if (calls[i].argv) {
+      EXPECT_EQ(calls[i].argc, 2) << "on_batched_calls argc " << i;
+      const JSValue* argv = calls[i].argv;
+      EXPECT_EQ(argv[1].IsUTF8String(), true) << "on_batched_calls string";
+      EXPECT_EQ(std::string(argv[1].UTF8Str()),
+                "call" + std::to_string(argv[0].IntVal()))
+          << "on_batched_calls string " << i;
+      result->sum += argv[0].IntVal();
+      result->native_calls++;
+      continue;
+    }
+
+    JSSerializedData data = jsenv->NewSerializedData(calls[i].data,
+                                                     calls[i].size);
+    JSValue args;
+    EXPECT_EQ(jsenv->DeserializeValue(data, &args), true)
+        << "on_batched_calls deserialize " << i;
+    jsenv->DeleteSerializedData(data);
+
+    JSValue value;
+    if (args.IsObject() && jsenv->GetObjectAtIndex(args.Object(), 0, &value)) {
+      result->sum += value.IntVal();
+    }
+  }
+}
+
+// argv[0] calls batch.post, the calls are delivered by one flush
+static bool test_batched_calls(JSEnv* jsenv,
+                               void* user_data,
+                               JSObject self,
+                               const JSValue* argv,
+                               int argc,
+                               JSValue* presult) {
+  if (argc < 1 || !argv[0].IsObject()) {
+    return false;
+  }
+
+  static BatchedCallsResult result;
+  result = BatchedCallsResult();
+  EXPECT_EQ(jsenv->RegisterBatchedCallback(nullptr, "batch.post",
+                                           on_batched_calls, &result),
+            true)
+      << "test_batched_calls register";
+
+  JSValue call_result;
+  jsenv->CallFunction(argv[0].Object(), nullptr, nullptr, 0, &call_result);
+  EXPECT_EQ(result.batches, 0) << "test_batched_calls queued";
+
+  jsenv->FlushBatchedCalls();
+  EXPECT_EQ(result.batches, 1) << "test_batched_calls one batch";
+  jsenv->FlushBatchedCalls();
+  EXPECT_EQ(result.batches, 1) << "test_batched_calls empty flush";
+
+  presult->Set(result.native_calls * 1000000 + result.calls * 10000 +
+               result.sum);
+  return true;
+}
+
+static int g_deferred_finalized = 0;
+
+static void Deferred_Finalize(void* private_data, void* extra_data) {
+  g_deferred_finalized++;
+}
+
+static JSClassDefinition deferred_class = {
+    "DeferredFinalize",
+    {nullptr, nullptr, nullptr, JSEnv::kFlagDeferredFinalize},
+    Deferred_Finalize,
+    nullptr,
+    nullptr};
+
+static std::atomic<int> g_background_finalized(0);
+static std::atomic<bool> g_finalized_on_js_thread(false);
+static std::thread::id g_js_thread_id;
+
+static void Background_Finalize(void* private_data, void* extra_data) {
+  if (std::this_thread::get_id() == g_js_thread_id) {
+    g_finalized_on_js_thread = true;
+  }
+  g_background_finalized++;
+}
+
+static JSClassDefinition background_class = {
+    "BackgroundFinalize",
+    {nullptr, nullptr, nullptr, JSEnv::kFlagBackgroundFinalize},
+    Background_Finalize,
+    nullptr,
+    nullptr};
+
+// a full collection, the test runtime exposes gc()
+static void CollectGarbage(JSEnv* jsenv) {
+  static const char code[] = "gc()";
+  JSValue result;
+  jsenv->ExecuteScript(code, static_cast<int>(sizeof(code) - 1), &result);
+  EXPECT_EQ(jsenv->HasException(), false) << "CollectGarbage gc";
+}
+
+// makes |count| instances in a scope which is closed, then collects them
+static void CollectInstances(JSEnv* jsenv, JSClass clazz, int count) {
+  jsenv->PushScope();
+  for (int i = 0; i < count; i++) {
+    EXPECT_NE(jsenv->NewInstance(clazz), nullptr)
+        << "CollectInstances instance " << i;
+  }
+  jsenv->PopScope();
+  CollectGarbage(jsenv);
+}
+
+// the collected instances are finalized by RunPendingFinalizers, or on the
+// worker thread for kFlagBackgroundFinalize
+static bool test_finalize_stats(JSEnv* jsenv,
+                                void* user_data,
+                                JSObject self,
+                                const JSValue* argv,
+                                int argc,
+                                JSValue* presult) {
+  JSClass clazz = jsenv->CreateClass(&deferred_class, nullptr);
+  EXPECT_NE(clazz, nullptr) << "test_finalize_stats class";
+
+  jsenv->RunPendingFinalizers();
+  jsenv->ResetFinalizeStats();
+  JSFinalizeStats stats;
+  jsenv->GetFinalizeStats(&stats);
+  EXPECT_EQ(stats.pending, 0u) << "test_finalize_stats drained";
+  EXPECT_EQ(stats.finalize_count, 0u) << "test_finalize_stats reset";
+
+  int finalized = g_deferred_finalized;
+  CollectInstances(jsenv, clazz, 100);
+
+  jsenv->GetFinalizeStats(&stats);
+  EXPECT_GT(stats.pending, 0u) << "test_finalize_stats queued by the GC";
+  EXPECT_EQ(stats.max_pending, stats.pending) << "test_finalize_stats max";
+  EXPECT_EQ(g_deferred_finalized, finalized)
+      << "test_finalize_stats not run in the GC";
+
+  int pending = static_cast<int>(stats.pending);
+  EXPECT_EQ(jsenv->RunPendingFinalizers(), pending)
+      << "test_finalize_stats run";
+  EXPECT_EQ(g_deferred_finalized, finalized + pending)
+      << "test_finalize_stats finalizers called";
+
+  jsenv->GetFinalizeStats(&stats);
+  EXPECT_EQ(stats.pending, 0u) << "test_finalize_stats pending after run";
+  EXPECT_EQ(stats.finalize_count, static_cast<uint64_t>(pending))
+      << "test_finalize_stats finalize_count";
+  EXPECT_GT(stats.max_latency_ns, 0u) << "test_finalize_stats max latency";
+  EXPECT_GE(stats.total_latency_ns, stats.max_latency_ns)
+      << "test_finalize_stats total latency";
+
+  // kFlagBackgroundFinalize
+  g_js_thread_id = std::this_thread::get_id();
+  g_background_finalized = 0;
+  g_finalized_on_js_thread = false;
+  JSClass background = jsenv->CreateClass(&background_class, nullptr);
+  CollectInstances(jsenv, background, 100);
+  for (int i = 0; i < 1000 && g_background_finalized.load() == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_GT(g_background_finalized.load(), 0)
+      << "test_finalize_stats background";
+  EXPECT_EQ(g_finalized_on_js_thread.load(), false)
+      << "test_finalize_stats background thread";
+
+  presult->Set(stats.finalize_count > 0 && g_background_finalized.load() > 0);
+  return true;
+}
+
+// the private data of a bulk instance is its index
+static int g_bulk_finalized = 0;
+static int64_t g_bulk_index_sum = 0;
+
+static void Bulk_Finalize(void* private_data, void* extra_data) {
+  int* index = reinterpret_cast<int*>(private_data);
+  g_bulk_finalized++;
+  g_bulk_index_sum += *index;
+  delete index;
+}
+
+static JSClassDefinition bulk_class = {
+    "BulkInstance",
+    {nullptr, nullptr, nullptr, JSEnv::kFlagDeferredFinalize},
+    Bulk_Finalize,
+    nullptr,
+    nullptr};
+
+// makes argv[0] instances by NewInstances in a scope which is closed, then
+// collects them, returns the number of the instances finalized
+static bool test_new_instances(JSEnv* jsenv,
+                               void* user_data,
+                               JSObject self,
+                               const JSValue* argv,
+                               int argc,
+                               JSValue* presult) {
+  if (argc < 1 || !argv[0].IsInt()) {
+    return false;
+  }
+
+  int count = argv[0].IntVal();
+  JSClass clazz = jsenv->CreateClass(&bulk_class, nullptr);
+  EXPECT_NE(clazz, nullptr) << "test_new_instances class";
+
+  jsenv->RunPendingFinalizers();
+  g_bulk_finalized = 0;
+  g_bulk_index_sum = 0;
+
+  std::vector<void*> private_data(count);
+  for (int i = 0; i < count; i++) {
+    private_data[i] = new int(i);
+  }
+
+  jsenv->PushScope();
+  std::vector<JSObject> objects(count);
+  int made = jsenv->NewInstances(clazz, count, objects.data(),
+                                 private_data.data());
+  EXPECT_EQ(made, count) << "test_new_instances count";
+  for (int i = 0; i < made; i++) {
+    EXPECT_EQ(jsenv->GetObjectPrivateData(objects[i]), private_data[i])
+        << "test_new_instances private data " << i;
+  }
+  jsenv->PopScope();
+  // the private data of the instances not made has no finalizer
+  for (int i = made; i < count; i++) {
+    delete reinterpret_cast<int*>(private_data[i]);
+  }
+
+  for (int i = 0; i < 10 && g_bulk_finalized < made; i++) {
+    CollectGarbage(jsenv);
+    jsenv->RunPendingFinalizers();
+  }
+  EXPECT_EQ(g_bulk_finalized, made) << "test_new_instances finalized";
+  EXPECT_EQ(g_bulk_index_sum, static_cast<int64_t>(made) * (made - 1) / 2)
+      << "test_new_instances finalized private data";
+
+  presult->Set(g_bulk_finalized);
+  return true;
+}
+
+static JSExternalString g_external_string = nullptr;
+
+static void ExternalStringRelease(void* user_data, const void* data) {
+  free(const_cast<void*>(data));
+}
+
+static bool new_external_string(JSEnv* jsenv,
+                                void* user_data,
+                                JSObject self,
+                                const JSValue* argv,
+                                int argc,
+                                JSValue* presult) {
+  if (g_external_string == nullptr) {
+    const size_t length = 4096;
+    char* buffer = reinterpret_cast<char*>(malloc(length));
+    for (size_t i = 0; i < length; i++) {
+      buffer[i] = 'a' + (i % 26);
+    }
+
+    g_external_string =
+        jsenv->NewExternalString(buffer, length, kJSExternalStringLatin1,
+                                 ExternalStringRelease, nullptr);
+    EXPECT_NE(g_external_string, nullptr) << "new_external_string";
+  }
+
+  presult->Set(g_external_string);
+  return true;
+}
+
+// the JS strings keep the buffer alive after the handle is deleted
+static bool delete_external_string(JSEnv* jsenv,
+                                   void* user_data,
+                                   JSObject self,
+                                   const JSValue* argv,
+                                   int argc,
+                                   JSValue* presult) {
+  jsenv->DeleteExternalString(g_external_string);
+  g_external_string = nullptr;
+  return true;
+}
+
 static JSObject g_resolver = nullptr;
 
 static void ResolverWeakReferenceDelete(const void* weak_data) {
@@ -930,10 +1989,30 @@ static bool new_func(JSEnv* env,
   return true;
 }
 
+static bool delete_function(JSEnv* env,
+                            void* user_data,
+                            JSObject self,
+                            const JSValue* argv,
+                            int argc,
+                            JSValue* presult) {
+  if (argc < 1 || !argv[0].IsObject()) {
+    return false;
+  }
+  presult->Set(env->DeleteFunction(argv[0].Object()));
+  return true;
+}
+
 static JSFunctionDefinition test1_functions[] = {
     {"mirror", mirror_func, 0, 0},
+    JSEnv::LazyFunctionDefinition("lazy_dispatch", lazy_dispatch_func, 0,
+                                  JSEnv::kFlagUseUTF8),
+    {"borrow_string", borrow_string_func, 0,
+     JSEnv::kFlagUseUTF8 | JSEnv::kFlagBorrowString},
+    {"arena_stats", test_arena_stats, 0, JSEnv::kFlagUseUTF8},
+    {"callback_profile", test_callback_profile, 0, 0},
     {"new_func", new_func<100>, reinterpret_cast<void*>(100), 0},
     {"new_func2", new_func<200>, reinterpret_cast<void*>(200), 0},
+    {"delete_function", delete_function, 0, 0},
     {"user_data_100", user_data_func<100>, reinterpret_cast<void*>(100), 0},
     {"user_data_200", user_data_func<200>, reinterpret_cast<void*>(200), 0},
     {"set_private_data", test_set_private_data<true>, 0, 0},
@@ -943,10 +2022,16 @@ static JSFunctionDefinition test1_functions[] = {
     {"test_get_global_value", test_get_global_value, 0, 0},
     {"test_get_object_properties", test_get_object_properties, 0, 0},
     {"test_set_object_properties", test_set_object_properties, 0, 0},
+    {"test_property_key", test_property_key, 0, 0},
+    {"test_batch_properties", test_batch_properties, 0, 0},
+    {"test_object_shape", test_object_shape, 0, 0},
     {"test_foreach_object", test_foreach_object, 0, 0},
     {"test_set_array", test_set_array, 0, 0},
     {"test_get_array", test_get_array, 0, 0},
     {"test_set_array_with_values", test_set_array_with_values, 0, 0},
+    {"test_array_elements", test_array_elements, 0, 0},
+    {"test_detached_elements", test_detached_elements, 0, 0},
+    {"test_int64", test_int64, 0, JSEnv::kFlagUseInt64},
     {"test_functions", test_functions, 0, 0},
     {"test_function_ctr", test_function_ctr, 0, 0},
     {"test_typed_arraies", test_typed_arraies, 0, 0},
@@ -962,6 +2047,25 @@ static JSFunctionDefinition test1_functions[] = {
     {"test_resolve_state", test_resolve_state, 0, 0},
     {"test_reject_state", test_reject_state, 0, 0},
     {"test_promise_then_catch", test_promise_then_catch, 0, 0},
+    {"new_external_string", new_external_string, 0, 0},
+    {"delete_external_string", delete_external_string, 0, 0},
+    {"test_serialize", test_serialize, 0, 0},
+    {"test_json", test_json, 0, 0},
+    {"new_typed_functions", new_typed_functions, 0, 0},
+    {"new_async_square", new_async_square, 0, 0},
+    {"new_async_clone", new_async_clone, 0, 0},
+    {"run_async_completions", run_async_completions, 0, 0},
+    {"post_tasks", post_tasks, 0, 0},
+    {"task_fd_readable", task_fd_readable, 0, 0},
+    {"test_microtask_policy", test_microtask_policy, 0, 0},
+    {"test_prepared_call", test_prepared_call, 0, 0},
+    {"test_event_channel", test_event_channel, 0, 0},
+    {"test_delete_emitting_channel", test_delete_emitting_channel, 0, 0},
+    {"test_batched_calls", test_batched_calls, 0, 0},
+    {"test_lazy_callback", test_lazy_callback, 0, 0},
+    {"test_finalize_stats", test_finalize_stats, 0, 0},
+    {"test_new_instances", test_new_instances, 0, 0},
+    {"run_pending_tasks", run_pending_tasks, 0, JSEnv::kFlagUseUTF8},
     {0}};
 
 static JSClassDefinition test1_class = {"test1",
@@ -1256,6 +2360,112 @@ static void InitInheritClass(JSEnv* jsenv) {
   jsenv->SetGlobalValue("DriverClass", object);
 }
 
+////////////////////////////
+// RowList: an array-like view of g_rows, row<N> is g_rows[N] too
+static std::vector<int> g_rows = {0, 10, 20, 30, 40};
+
+static bool Rows_GetIndex(JSEnv* jsenv,
+                          void* user_data,
+                          JSObject self,
+                          uint32_t index,
+                          JSValue* pvalue) {
+  if (index >= g_rows.size()) {
+    return false;
+  }
+  pvalue->Set(g_rows[index]);
+  return true;
+}
+
+static bool Rows_SetIndex(JSEnv* jsenv,
+                          void* user_data,
+                          JSObject self,
+                          uint32_t index,
+                          const JSValue* pvalue) {
+  if (index >= g_rows.size() || !pvalue->IsInt()) {
+    return false;
+  }
+  g_rows[index] = pvalue->IntVal();
+  return true;
+}
+
+static bool Rows_HasIndex(JSEnv* jsenv,
+                          void* user_data,
+                          JSObject self,
+                          uint32_t index) {
+  return index < g_rows.size();
+}
+
+static uint32_t Rows_Count(JSEnv* jsenv, void* user_data, JSObject self) {
+  return static_cast<uint32_t>(g_rows.size());
+}
+
+static bool Rows_GetNamed(JSEnv* jsenv,
+                          void* user_data,
+                          JSObject self,
+                          const JSValue* name,
+                          JSValue* pvalue) {
+  if (!name->IsUTF8String() || strncmp(name->UTF8Str(), "row", 3) != 0) {
+    return false;
+  }
+  return Rows_GetIndex(jsenv, user_data, self, atoi(name->UTF8Str() + 3),
+                       pvalue);
+}
+
+static bool Rows_GetLength(JSEnv* jsenv,
+                           void* user_data,
+                           JSObject self,
+                           JSValue* pvalue) {
+  pvalue->Set(static_cast<int>(g_rows.size()));
+  return true;
+}
+
+static bool Rows_GetKind(JSEnv* jsenv,
+                         void* user_data,
+                         JSObject self,
+                         JSValue* pvalue) {
+  EXPECT_EQ(self, nullptr) << "Rows_GetKind is called by CreateClass";
+  pvalue->Set("rows");
+  return true;
+}
+
+// the count of the calls, a lazy property calls it once per object
+static bool Rows_GetStamp(JSEnv* jsenv,
+                          void* user_data,
+                          JSObject self,
+                          JSValue* pvalue) {
+  static int stamp = 0;
+  pvalue->Set(++stamp);
+  return true;
+}
+
+static JSPropertyDefinition rows_properties[] = {
+    {"length", Rows_GetLength, nullptr, nullptr, 0},
+    {"kind", Rows_GetKind, nullptr, nullptr, JSEnv::kFlagConstant},
+    {"stamp", Rows_GetStamp, nullptr, nullptr, JSEnv::kFlagLazy},
+    {0}};
+
+static JSClassDefinition rows_class = {"RowList",
+                                       {nullptr, nullptr, nullptr, 0},
+                                       nullptr,
+                                       rows_properties,
+                                       nullptr};
+
+static JSNamedPropertyHandler rows_named_handler = {
+    Rows_GetNamed, nullptr, nullptr, nullptr, nullptr, nullptr,
+    JSEnv::kFlagUseUTF8};
+
+static JSIndexedPropertyHandler rows_indexed_handler = {
+    Rows_GetIndex, Rows_SetIndex, Rows_HasIndex, nullptr, Rows_Count, nullptr,
+    0};
+
+static void InitInterceptorClass(JSEnv* jsenv) {
+  JSClass clazz = jsenv->CreateClassWithInterceptors(
+      &rows_class, nullptr, &rows_named_handler, &rows_indexed_handler);
+  EXPECT_NE(clazz, nullptr) << "Create RowList class";
+
+  jsenv->SetGlobalValue("native_rows", jsenv->NewInstance(clazz));
+}
+
 static void InitClassesObjects(JSEnv* jsenv) {
   InitClassObject(jsenv, &test1_class);
   InitClass(jsenv, &Foo_class);
@@ -1264,11 +2474,248 @@ static void InitClassesObjects(JSEnv* jsenv) {
   // Test NewInstanceWithConstructor
   InitFooConstructor(jsenv);
   InitInheritClass(jsenv);
+  InitInterceptorClass(jsenv);
+}
+
+// FlushBatchedCalls called by the host loop, not from a JS callback
+TEST(JSEnvTest, FlushBatchedCallsOutsideCallback) {
+  JSEnv* jsenv = g_jsenv;
+  static BatchedCallsResult result;
+  result = BatchedCallsResult();
+  EXPECT_EQ(jsenv->RegisterBatchedCallback(nullptr, "batch_host.post",
+                                           on_batched_calls, &result),
+            true)
+      << "FlushBatchedCallsOutsideCallback register";
+
+  // no checkpoint at the end of the script, the calls stay queued
+  int policy = jsenv->GetMicrotaskPolicy();
+  jsenv->SetMicrotaskPolicy(kJSMicrotaskPolicyExplicit);
+
+  static const char code[] =
+      "for (let i = 0; i < 10; i++) batch_host.post(i, {name: 'c' + i});";
+  JSValue script_result;
+  jsenv->ExecuteScript(code, static_cast<int>(sizeof(code) - 1),
+                       &script_result);
+  EXPECT_EQ(jsenv->HasException(), false)
+      << "FlushBatchedCallsOutsideCallback script";
+  EXPECT_EQ(result.batches, 0) << "FlushBatchedCallsOutsideCallback queued";
+
+  jsenv->FlushBatchedCalls();
+  EXPECT_EQ(result.batches, 1) << "FlushBatchedCallsOutsideCallback flush";
+  EXPECT_EQ(result.calls, 10) << "FlushBatchedCallsOutsideCallback calls";
+  EXPECT_EQ(result.native_calls, 0)
+      << "FlushBatchedCallsOutsideCallback structured clones";
+  EXPECT_EQ(result.sum, 45) << "FlushBatchedCallsOutsideCallback sum";
+
+  jsenv->SetMicrotaskPolicy(policy);
+}
+
+// the auto policy delivers the calls when the script returns, though no
+// microtask is queued and V8 skips the checkpoint
+TEST(JSEnvTest, BatchedCallsAutoPolicy) {
+  JSEnv* jsenv = g_jsenv;
+  static BatchedCallsResult result;
+  result = BatchedCallsResult();
+  EXPECT_EQ(jsenv->RegisterBatchedCallback(nullptr, "batch_auto.post",
+                                           on_batched_calls, &result),
+            true)
+      << "BatchedCallsAutoPolicy register";
+
+  int policy = jsenv->GetMicrotaskPolicy();
+  jsenv->SetMicrotaskPolicy(kJSMicrotaskPolicyAuto);
+
+  static const char code[] =
+      "for (let i = 0; i < 10; i++) batch_auto.post(i, 'call' + i);";
+  JSValue script_result;
+  jsenv->ExecuteScript(code, static_cast<int>(sizeof(code) - 1),
+                       &script_result);
+  EXPECT_EQ(jsenv->HasException(), false) << "BatchedCallsAutoPolicy script";
+  EXPECT_EQ(result.batches, 1) << "BatchedCallsAutoPolicy delivered";
+  EXPECT_EQ(result.calls, 10) << "BatchedCallsAutoPolicy calls";
+  EXPECT_EQ(result.native_calls, 10) << "BatchedCallsAutoPolicy native calls";
+  EXPECT_EQ(result.sum, 45) << "BatchedCallsAutoPolicy sum";
+
+  jsenv->SetMicrotaskPolicy(policy);
+}
+
+////////////////////////////
+// snapshot classes: SnapshotDerived extends SnapshotBase, SnapshotList has
+// an indexed interceptor
+static int snapshot_version_reads = 0;
+static int snapshot_base_value = 40;
+
+static bool Snapshot_GetVersion(JSEnv* jsenv,
+                                void* user_data,
+                                JSObject self,
+                                JSValue* pvalue) {
+  snapshot_version_reads++;
+  pvalue->Set(7);
+  return true;
+}
+
+static bool Snapshot_Base(JSEnv* jsenv,
+                          void* user_data,
+                          JSObject self,
+                          const JSValue* argv,
+                          int argc,
+                          JSValue* presult) {
+  presult->Set(*static_cast<int*>(user_data));
+  return true;
+}
+
+static bool Snapshot_Add(JSEnv* jsenv,
+                         void* user_data,
+                         JSObject self,
+                         const JSValue* argv,
+                         int argc,
+                         JSValue* presult) {
+  if (argc < 2 || !argv[0].IsInt() || !argv[1].IsInt()) {
+    return false;
+  }
+  presult->Set(argv[0].IntVal() + argv[1].IntVal());
+  return true;
+}
+
+static bool Snapshot_GetIndex(JSEnv* jsenv,
+                              void* user_data,
+                              JSObject self,
+                              uint32_t index,
+                              JSValue* pvalue) {
+  if (index >= 4) {
+    return false;
+  }
+  pvalue->Set(static_cast<int>(index * 2));
+  return true;
+}
+
+static JSPropertyDefinition snapshot_base_properties[] = {
+    {"version", Snapshot_GetVersion, nullptr, nullptr, JSEnv::kFlagConstant},
+    {0}};
+
+static JSFunctionDefinition snapshot_base_functions[] = {
+    {"base", Snapshot_Base, &snapshot_base_value, 0},
+    {0}};
+
+static JSFunctionDefinition snapshot_derived_functions[] = {
+    {"add", Snapshot_Add, nullptr, 0},
+    {0}};
+
+static JSClassDefinition snapshot_base_class = {
+    "SnapshotBase",
+    {nullptr, Null_Constructor, nullptr, 0},
+    nullptr,
+    snapshot_base_properties,
+    snapshot_base_functions};
+
+static JSClassDefinition snapshot_derived_class = {
+    "SnapshotDerived",
+    {nullptr, Null_Constructor, nullptr, 0},
+    nullptr,
+    nullptr,
+    snapshot_derived_functions};
+
+static JSClassDefinition snapshot_list_class = {"SnapshotList",
+                                                {nullptr, nullptr, nullptr, 0},
+                                                nullptr,
+                                                nullptr,
+                                                nullptr};
+
+static JSIndexedPropertyHandler snapshot_list_handler = {
+    Snapshot_GetIndex, nullptr, nullptr, nullptr, nullptr, nullptr, 0};
+
+static int snapshot_class_ids[3] = {-1, -1, -1};
+
+// before the first isolate, see JSEnv::RegisterSnapshotClass
+static void RegisterSnapshotClasses() {
+  snapshot_class_ids[0] = JSEnv::RegisterSnapshotClass(&snapshot_base_class);
+  snapshot_class_ids[1] = JSEnv::RegisterSnapshotClass(&snapshot_derived_class,
+                                                       snapshot_class_ids[0]);
+  snapshot_class_ids[2] = JSEnv::RegisterSnapshotClass(
+      &snapshot_list_class, -1, nullptr, &snapshot_list_handler);
+}
+
+static void WriteSnapshotBlob(const char* data, int size, void* user_data) {
+  static_cast<std::string*>(user_data)->assign(data, size);
+}
+
+// creates the snapshot classes in |jsenv|, returns the value of the script
+static int RunSnapshotClasses(JSEnv* jsenv, const char* name) {
+  JSClass base = jsenv->CreateClass(&snapshot_base_class, nullptr);
+  JSClass derived = jsenv->CreateClass(&snapshot_derived_class, base);
+  JSClass list = jsenv->CreateClassWithInterceptors(
+      &snapshot_list_class, nullptr, nullptr, &snapshot_list_handler);
+  EXPECT_NE(derived, nullptr) << name << " SnapshotDerived";
+  EXPECT_NE(list, nullptr) << name << " SnapshotList";
+  if (derived == nullptr || list == nullptr) {
+    return -1;
+  }
+  jsenv->SetGlobalValue("SnapshotDerived",
+                        jsenv->GetClassConstructorFunction(derived));
+  jsenv->SetGlobalValue("snapshot_list", jsenv->NewInstance(list));
+
+  static const char code[] =
+      "var d = new SnapshotDerived();"
+      "(d instanceof SnapshotDerived) * d.add(d.base(), d.version) * 10 +"
+      "snapshot_list[3] + (typeof snapshot_marker === 'number' ? 1000 : 0)";
+  JSValue result;
+  jsenv->ExecuteScript(code, static_cast<int>(sizeof(code) - 1), &result);
+  EXPECT_EQ(jsenv->HasException(), false) << name << " script";
+  return result.IsInt() ? result.IntVal() : -1;
+}
+
+TEST(JSEnvTest, SnapshotClasses) {
+  EXPECT_EQ(snapshot_class_ids[0], 0) << "SnapshotClasses SnapshotBase id";
+  EXPECT_EQ(snapshot_class_ids[1], 1) << "SnapshotClasses SnapshotDerived id";
+  EXPECT_EQ(snapshot_class_ids[2], 2) << "SnapshotClasses SnapshotList id";
+
+  // the member tables are external references, or V8 aborts
+  std::string blob;
+  EXPECT_EQ(JSEnv::CreateSnapshot("var snapshot_marker = 1;",
+                                  WriteSnapshotBlob, &blob),
+            true)
+      << "SnapshotClasses CreateSnapshot";
+  ASSERT_GT(blob.size(), 0u) << "SnapshotClasses blob";
+  EXPECT_EQ(snapshot_version_reads, 1)
+      << "SnapshotClasses the constant is read by CreateSnapshot";
+  // registered after the external references are made
+  EXPECT_EQ(JSEnv::RegisterSnapshotClass(&rows_class), -1)
+      << "SnapshotClasses late RegisterSnapshotClass";
+
+  char file_name[] = "/tmp/jsenv_snapshot_XXXXXX";
+  int fd = mkstemp(file_name);
+  ASSERT_GE(fd, 0) << "SnapshotClasses blob file";
+  EXPECT_EQ(write(fd, blob.data(), blob.size()),
+            static_cast<ssize_t>(blob.size()))
+      << "SnapshotClasses write the blob";
+  close(fd);
+
+  // see create_test_j2v8handle
+  setenv("JSENV_TEST_SNAPSHOT", file_name, 1);
+  JSEnv* restored = JSEnv::GetInstance(reinterpret_cast<J2V8Handle>(-1),
+                                       JSENV_VERSION, nullptr);
+  unsetenv("JSENV_TEST_SNAPSHOT");
+  unlink(file_name);
+  ASSERT_NE(restored, nullptr) << "SnapshotClasses restored runtime";
+
+  restored->PushScope();
+  EXPECT_EQ(RunSnapshotClasses(restored, "SnapshotClasses restored"), 1476)
+      << "SnapshotClasses restored classes";
+  EXPECT_EQ(snapshot_version_reads, 1)
+      << "SnapshotClasses the templates are restored, not built";
+  restored->PopScope();
+  JSEnv::Release(restored);
+
+  // no snapshot: the templates are built on the shared member tables
+  EXPECT_EQ(RunSnapshotClasses(g_jsenv, "SnapshotClasses built"), 476)
+      << "SnapshotClasses built classes";
+  EXPECT_EQ(snapshot_version_reads, 2)
+      << "SnapshotClasses the constant is read by CreateClass";
 }
 
 }  // namespace hybrid
 
 int main(int argc, char** argv) {
+  hybrid::RegisterSnapshotClasses();
   InitJSEnv();
 
   testing::InitGoogleTest(&argc, argv);